@@ -47,85 +47,365 @@ ALU flags: CZNV (for conditions)
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <filesystem>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cctype>
+#include <cstdio>
+#include <ctime>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 using namespace std;
 
-bool isInstruction(string str)
-{
-	if (str == "NOP") return true;
-	if (str == "ADD") return true;
-	if (str == "ADC") return true;
-	if (str == "SUB") return true;
-	if (str == "SBB") return true;
-	if (str == "ONC") return true;
-	if (str == "TWC") return true;
-	if (str == "AND") return true;
-	if (str == "OR") return true;
-	if (str == "XOR") return true;
-	if (str == "LSL") return true;
-	if (str == "LSR") return true;
-	if (str == "ASR") return true;
-	if (str == "ROL") return true;
-	if (str == "ROR") return true;
-	if (str == "RDL") return true;
-	if (str == "RCR") return true;
-	if (str == "LOD") return true;
-	if (str == "STO") return true;
-	if (str == "PSH") return true;
-	if (str == "POP") return true;
-	if (str == "JMP") return true;
-	if (str == "BRC") return true;
-	if (str == "BRZ") return true;
-	if (str == "BRN") return true;
-	if (str == "BRV") return true;
-	if (str == "BNC") return true;
-	if (str == "BNZ") return true;
-	if (str == "BNN") return true;
-	if (str == "BNV") return true;
-	if (str == "JSR") return true;
-	if (str == "RSR") return true;
-	if (str == "HLT") return true;
-	return false;
-}
-
-bool isDirective(string str)
-{
-	if (str == ".reserve") return true;
-	if (str == ".org") return true;
-	if (str == ".byte") return true;
-	if (str == ".string") return true;
-	if (str == ".data") return true;
-	return false;
-}
-
-bool isInteger(string str)
-{
-	// if the number is negative, then ignore the minus sign
-	if (str[0] == '-') str.erase(0, 1);
+// how much the assembler reports
+enum LogLevel
+{
+	LOG_ERROR,			// errors only (-q)
+	LOG_INFO,			// a line per assembled file
+	LOG_VERBOSE,		// memory layout and timings (-v)
+	LOG_DEBUG			// the full dumps of every stage (-vv)
+};
 
-	// hexadecimal numbers
-	if (str.length() >= 3 && str[0] == '0' && (str[1] == 'X' || str[1] == 'x'))
-		for (int i = 2; i < str.length(); ++i)
+// which stage a message comes from, as a mask
+enum LogCategory : unsigned
+{
+	LOG_GENERAL = 1,
+	LOG_LEXER = 2,		// source, tokens and expressions
+	LOG_SYMBOLS = 4,	// tag declarations and label addresses
+	LOG_RESOLVE = 8,	// equate resolution
+	LOG_EMIT = 16,		// code generation and output
+	LOG_ALL = 31
+};
+
+const char* logCategoryNames[] = { "general", "lexer", "symbols", "resolve", "emit" };
+const int numLogCategories = sizeof(logCategoryNames) / sizeof(logCategoryNames[0]);
+
+// a file making up the source being assembled; included files are numbered on from the lines of the files before them
+struct SourceFile
+{
+	string name;
+	uint32_t firstLine;		// the number its line 1 has in the tokens
+	uint32_t numLines;
+};
+
+// diagnostic output, collected in a buffer and written to stdout in large blocks, or held back in a string
+class Logger : private streambuf
+{
+public:
+	Logger() : stream(this) { setp(buffer, buffer + sizeof(buffer)); }
+	~Logger() { flush(); }
+
+	// errors are always shown, everything else only at its level and for the selected categories
+	bool enabled(LogLevel messageLevel, unsigned category) const
+	{
+		return messageLevel <= level && (messageLevel == LOG_ERROR || (category & categories));
+	}
+
+	void flush()
+	{
+		if (capture) capture->append(pbase(), pptr() - pbase());
+		else
 		{
-			if ((str[i] < '0' || str[i] > '9') && (str[i] < 'a' || str[i] > 'f') && (str[i] < 'A' || str[i] > 'F')) return false;
+			fwrite(pbase(), 1, pptr() - pbase(), stdout);
+			fflush(stdout);
 		}
-	// binary numbers
-	else if (str.length() >= 3 && str[0] == '0' && (str[1] == 'B' || str[1] == 'b'))
-		for (int i = 2; i < str.length(); ++i)
+		setp(buffer, buffer + sizeof(buffer));
+	}
+
+	// a line number as it appears in messages, naming the included file it comes from
+	string where(uint32_t line) const
+	{
+		if (sources)
 		{
-			if (str[i] != '0' && str[i] != '1') return false;
+			for (size_t i = 1; i < sources->size(); ++i)
+			{
+				const SourceFile& file = (*sources)[i];
+				if (line >= file.firstLine && line < file.firstLine + file.numLines) return file.name + " line " + to_string(line - file.firstLine + 1);
+			}
 		}
-	else // decimal numbers
-		for (int i = 0; i < str.length(); ++i)
+		return "line " + to_string(line);
+	}
+
+	LogLevel level = LOG_INFO;
+	unsigned categories = LOG_ALL;
+	const vector<SourceFile>* sources = nullptr;	// the files of the source being assembled
+	string* capture = nullptr;	// where the output goes instead of stdout, if anywhere
+	ostream stream;
+
+private:
+	int overflow(int c) override
+	{
+		flush();
+		if (c != EOF) sputc(c);
+		return c;
+	}
+	int sync() override
+	{
+		flush();
+		return 0;
+	}
+
+	char buffer[1 << 16];
+};
+
+// each thread assembling files has its own, so their messages can be put in order afterwards
+thread_local Logger logger;
+
+// a message is only formatted when its level and category are enabled
+#define LOG(level, category) if (!logger.enabled(level, category)) ; else logger.stream
+
+// operand forms an instruction can take
+enum OperandMode : uint8_t
+{
+	MODE_IMPLIED,		// no operand, e.g. HLT
+	MODE_ACCUMULATOR,	// #a_reg, or no operand for the ALU operations
+	MODE_STACK,			// #stack
+	MODE_IMMEDIATE,		// !value, one byte
+	MODE_ADDRESS,		// 16-bit little-endian address
+
+	NUM_OPERAND_MODES
+};
+
+const char* operandModeNames[NUM_OPERAND_MODES] = { "no", "an accumulator", "a stack", "an immediate", "an address" };
+
+// condition flags, as tested by the low nibble of BR and BN
+enum ConditionFlag : uint8_t
+{
+	FLAG_C = 0x1,
+	FLAG_Z = 0x2,
+	FLAG_N = 0x4,
+	FLAG_V = 0x8
+};
+
+struct InstructionInfo
+{
+	char mnemonic[4];
+	uint8_t opcodes[NUM_OPERAND_MODES];	// encoding for each operand mode
+	uint8_t modes;						// bit mask of the operand modes accepted
+	OperandMode defaultMode;			// mode used when the operand is left out, MODE_IMPLIED if it is required
+};
+
+constexpr uint8_t modeBit(OperandMode mode)
+{
+	return 1 << mode;
+}
+
+// instruction without an operand
+constexpr InstructionInfo implied(const char* mnemonic, uint8_t opcode)
+{
+	return { { mnemonic[0], mnemonic[1], mnemonic[2], 0 }, { opcode, 0, 0, 0, 0 }, modeBit(MODE_IMPLIED), MODE_IMPLIED };
+}
+
+// ALU operation, which takes its second operand from memory, the accumulator, an immediate value or the stack
+constexpr InstructionInfo alu(const char* mnemonic, uint8_t operation)
+{
+	return { { mnemonic[0], mnemonic[1], mnemonic[2], 0 },
+		{ 0, (uint8_t)(0x20 | operation), (uint8_t)(0x40 | operation), (uint8_t)(0x30 | operation), (uint8_t)(0x10 | operation) },
+		(uint8_t)(modeBit(MODE_ACCUMULATOR) | modeBit(MODE_STACK) | modeBit(MODE_IMMEDIATE) | modeBit(MODE_ADDRESS)), MODE_ACCUMULATOR };
+}
+
+// jump, branch or subroutine call to an address; the low nibble holds the condition
+constexpr InstructionInfo jump(const char* mnemonic, uint8_t opcode)
+{
+	return { { mnemonic[0], mnemonic[1], mnemonic[2], 0 }, { 0, 0, 0, 0, opcode }, modeBit(MODE_ADDRESS), MODE_IMPLIED };
+}
+
+constexpr InstructionInfo instructionTable[] =
+{
+	implied("NOP", 0x00),
+
+	alu("ADD", 0x0),
+	alu("ADC", 0x1),
+	alu("SUB", 0x2),
+	alu("SBB", 0x3),
+	alu("ONC", 0x4),
+	alu("TWC", 0x5),
+	alu("AND", 0x6),
+	alu("OR", 0x7),
+	alu("XOR", 0x8),
+	alu("LSL", 0x9),
+	alu("LSR", 0xa),
+	alu("ASR", 0xb),
+	alu("ROL", 0xc),
+	alu("ROR", 0xd),
+	alu("RCL", 0xe),
+	alu("RCR", 0xf),
+
+	// LOD #stack and STO #stack are the same instructions as POP and PSH
+	{ "LOD", { 0, 0, 0x90, 0x60, 0x50 }, modeBit(MODE_STACK) | modeBit(MODE_IMMEDIATE) | modeBit(MODE_ADDRESS), MODE_IMPLIED },
+	{ "STO", { 0, 0, 0x80, 0, 0x70 }, modeBit(MODE_STACK) | modeBit(MODE_ADDRESS), MODE_IMPLIED },
+	implied("PSH", 0x80),
+	implied("POP", 0x90),
+
+	jump("JMP", 0xa0),
+	jump("BRC", 0xb0 | FLAG_C),
+	jump("BRZ", 0xb0 | FLAG_Z),
+	jump("BRN", 0xb0 | FLAG_N),
+	jump("BRV", 0xb0 | FLAG_V),
+	jump("BNC", 0xc0 | FLAG_C),
+	jump("BNZ", 0xc0 | FLAG_Z),
+	jump("BNN", 0xc0 | FLAG_N),
+	jump("BNV", 0xc0 | FLAG_V),
+	jump("JSR", 0xd0),
+	implied("RSR", 0xe0),
+	implied("HLT", 0xff)
+};
+
+constexpr int numInstructions = sizeof(instructionTable) / sizeof(instructionTable[0]);
+
+// encoded size of an instruction in bytes
+constexpr int instructionSize(OperandMode mode)
+{
+	return mode == MODE_ADDRESS ? 3 : mode == MODE_IMMEDIATE ? 2 : 1;
+}
+
+// clock cycles each operation takes on the CPU, by the high nibble of its opcode; BR and BN take two more when they do not branch
+const uint8_t cycleCounts[16] = { 2, 4, 2, 2, 3, 4, 2, 4, 2, 3, 4, 4, 4, 6, 6, 2 };
+const int branchNotTakenCycles = 2;
+
+// mnemonics are at most three characters, so they pack into an integer
+constexpr uint32_t packMnemonic(const char* str, size_t length)
+{
+	uint32_t packed = 0;
+	for (size_t i = 0; i < 3; ++i) packed = (packed << 8) | (i < length ? (uint8_t)str[i] : 0);
+	return packed;
+}
+
+// multiplicative hash of a packed mnemonic, chosen so no two instructions share a slot
+constexpr uint32_t mnemonicHash(uint32_t packed)
+{
+	return (packed * 0x63351347u) >> 26;
+}
+
+struct MnemonicSlots
+{
+	int8_t slots[64];
+	bool perfect;
+};
+
+constexpr MnemonicSlots buildMnemonicSlots()
+{
+	MnemonicSlots table = {};
+	table.perfect = true;
+	for (int8_t& slot : table.slots) slot = -1;
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		const char* mnemonic = instructionTable[i].mnemonic;
+		uint32_t hash = mnemonicHash(packMnemonic(mnemonic, mnemonic[2] ? 3 : 2));
+		if (table.slots[hash] >= 0) table.perfect = false;
+		table.slots[hash] = i;
+	}
+	return table;
+}
+
+constexpr MnemonicSlots mnemonicSlots = buildMnemonicSlots();
+static_assert(mnemonicSlots.perfect, "mnemonicHash must map every instruction to its own slot");
+
+// index into instructionTable of the mnemonic, or -1 if it isn't one
+int findInstruction(string_view str)
+{
+	if (str.size() < 2 || str.size() > 3) return -1;
+	uint32_t packed = packMnemonic(str.data(), str.size());
+	int index = mnemonicSlots.slots[mnemonicHash(packed)];
+	if (index < 0) return -1;
+	const char* mnemonic = instructionTable[index].mnemonic;
+	if (packMnemonic(mnemonic, mnemonic[2] ? 3 : 2) != packed) return -1;
+	return index;
+}
+
+// names interned ahead of time, so the passes can compare ids instead of strings
+// (mnemonics are looked up in instructionTable instead)
+enum KnownName : uint32_t
+{
+	// directives
+	NAME_RESERVE, NAME_ORG, NAME_BYTE, NAME_STRING, NAME_DATA, NAME_INCLUDE, NAME_GLOBAL,
+	NAME_MACRO, NAME_ENDM, NAME_REPT, NAME_ENDR, NAME_IF, NAME_ELSE, NAME_ENDIF,
+
+	// operand keywords
+	NAME_STACK, NAME_A_REG, NAME_REG_A,
+
+	NUM_KNOWN_NAMES
+};
+
+const char* knownNames[] =
+{
+	".reserve", ".org", ".byte", ".string", ".data", ".include", ".global",
+	".macro", ".endm", ".rept", ".endr", ".if", ".else", ".endif",
+
+	"#stack", "#a_reg", "#reg_a"
+};
+
+static_assert(sizeof(knownNames) / sizeof(knownNames[0]) == NUM_KNOWN_NAMES, "knownNames must match KnownName");
+
+// stores each distinct string once in an arena and hands out a small integer id for it
+class StringInterner
+{
+public:
+	StringInterner()
+	{
+		for (const char* name : knownNames) intern(name);
+	}
+
+	uint32_t intern(string_view str)
+	{
+		auto it = ids.find(str);
+		if (it != ids.end()) return it->second;
+
+		string_view stored = store(str);
+		uint32_t id = strings.size();
+		strings.push_back(stored);
+		ids.emplace(stored, id);
+		return id;
+	}
+
+	string_view text(uint32_t id) const { return strings[id]; }
+	size_t size() const { return strings.size(); }
+
+	// forget every string but the known names, keeping the first block for reuse
+	void clear()
+	{
+		ids.clear();
+		strings.clear();
+		if (blocks.size() > 1) blocks.resize(1);
+		blockSize = blocks.empty() ? 0 : firstBlockSize;
+		blockUsed = 0;
+		for (const char* name : knownNames) intern(name);
+	}
+
+private:
+	// copy a string into the arena; blocks are never moved, so views stay valid
+	string_view store(string_view str)
+	{
+		if (str.size() > blockSize - blockUsed)
 		{
-			if (str[i] < '0' || str[i] > '9') return false;
+			blockSize = max<size_t>(4096, str.size());
+			blocks.emplace_back(new char[blockSize]);
+			if (blocks.size() == 1) firstBlockSize = blockSize;
+			blockUsed = 0;
 		}
+		char* dest = blocks.back().get() + blockUsed;
+		copy(str.begin(), str.end(), dest);
+		blockUsed += str.size();
+		return string_view(dest, str.size());
+	}
 
-	return true;
-}
+	vector<unique_ptr<char[]>> blocks;
+	size_t blockSize = 0;
+	size_t blockUsed = 0;
+	size_t firstBlockSize = 0;
+	vector<string_view> strings;
+	unordered_map<string_view, uint32_t> ids;
+};
 
 int integer(string str)
 {
@@ -147,7 +427,7 @@ int integer(string str)
 			char charDigit = str[i];
 			int digit = charDigit - '0';
 			if (charDigit >= 'a' && charDigit <= 'f') digit = charDigit - 'a' + 10;
-			if (charDigit >= 'A' && charDigit <= 'F') digit = charDigit - 'F' + 10;
+			if (charDigit >= 'A' && charDigit <= 'F') digit = charDigit - 'A' + 10;
 			number = (number << 4) + digit;
 		}
 	}
@@ -229,1025 +509,3637 @@ string to_hex(string str)
 	}
 }
 
-string to_immediate(string str)
+// parse an integer literal (decimal, 0x hexadecimal or 0b binary), also reporting how
+// many bytes it spans as written; literals wider than 32 bits only report their width
+bool parseNumber(string_view str, uint32_t& value, int& width)
 {
-	if (str[0] == '!') str.erase(0, 1);
-	int value = integer(str);
-	int a = value / 16;
-	int b = value % 16;
+	int base = 10;
+	int bitsPerDigit = 0;
+	if (str.length() >= 3 && str[0] == '0' && (str[1] == 'X' || str[1] == 'x')) base = 16, bitsPerDigit = 4;
+	else if (str.length() >= 3 && str[0] == '0' && (str[1] == 'B' || str[1] == 'b')) base = 2, bitsPerDigit = 1;
+	if (base != 10) str.remove_prefix(2);
 
-	a = (a < 10) ? a + '0' : a - 10 + 'A';
-	b = (b < 10) ? b + '0' : b - 10 + 'A';
+	uint64_t number = 0;
+	bool overflow = false;
+	for (char c : str)
+	{
+		int digit = base;
+		if (c >= '0' && c <= '9') digit = c - '0';
+		else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+		if (digit >= base) return false;
 
-	string immediate = "";
+		number = number * base + digit;
+		if (number > 0xffffffff) overflow = true, number = 0;
+	}
 
-	immediate.push_back(a);
-	immediate.push_back(b);
+	// hexadecimal and binary literals keep their written width, so 0x00ff is two bytes
+	if (bitsPerDigit) width = ((str.length() * bitsPerDigit + 3) / 4 + 1) / 2;
+	else if (overflow) width = 5;
+	else
+	{
+		width = 1;
+		while (width < 4 && (number >> (8 * width))) ++width;
+	}
 
-	return immediate;
+	value = number;
+	return true;
 }
 
-string to_address(string str)
+// value of a hex digit, or -1 if it is not one
+int hexValue(char digit)
 {
-	int value = integer(str);
-
-	int d = value % 16;
-	value /= 16;
-	int c = value % 16;
-	value /= 16;
-	int b = value % 16;
-	value /= 16;
-	int a = value % 16;
-
-	a = (a < 10) ? a + '0' : a - 10 + 'A';
-	b = (b < 10) ? b + '0' : b - 10 + 'A';
-	c = (c < 10) ? c + '0' : c - 10 + 'A';
-	d = (d < 10) ? d + '0' : d - 10 + 'A';
-
-	string address = "";
-
-	// little-endian, hence the order of terms
-	address.push_back(c);
-	address.push_back(d);
-	address.push_back(a);
-	address.push_back(b);
-
-	return address;
+	if (digit >= '0' && digit <= '9') return digit - '0';
+	if (digit >= 'a' && digit <= 'f') return digit - 'a' + 10;
+	if (digit >= 'A' && digit <= 'F') return digit - 'A' + 10;
+	return -1;
 }
 
-string loadFile(string filename)
+bool loadFile(string filename, string& code)
 {
-	ifstream fin(filename);
-	string line;
-	string code = "";
-	while(getline(fin, line)) code += line + "\n";
+	// read the whole file in one go so the lexer can walk a single buffer
+	ifstream fin(filename, ios::binary);
+	if (!fin) return false;
+	fin.seekg(0, ios::end);
+	streamoff size = fin.tellg();
+	fin.seekg(0, ios::beg);
+
+	code.clear();
+	if (size > 0)
+	{
+		code.resize(size);
+		fin.read(&code[0], size);
+		code.resize(fin.gcount());
+	}
 	fin.close();
 
-	return code;
+	return true;
 }
 
-int numPreceedingBackslashes(string str, int index)
+// token types produced by the lexer
+enum class TokenKind : uint8_t
 {
-	int n = 0;
-	for (int i = index - 1; i >= 0 && str[i] == '\\'; --i) ++n;
-	return n;
-}
+	Mnemonic,	// instruction name, e.g. LOD
+	Directive,	// assembler directive, e.g. .org
+	Identifier,	// tag name
+	Number,		// integer literal (decimal, 0x hexadecimal or 0b binary)
+	String,		// quoted string, stored with its escapes decoded
+	Keyword,	// operand keyword, e.g. #stack
+	Operator,	// single character operator, e.g. + or (
+	LabelColon,	// the ':' ending a tag definition
+	Expression	// an operand expression, replaced by its postfix form after lexing
+};
 
-string assemble(string& asmCode)
+// compact, trivially copyable token
+struct Token
 {
-	if (asmCode.empty()) return "";
+	TokenKind kind;
+	uint8_t detail;		// numbers: byte width as written, above 4 the value holds the literal's name id;
+						// mnemonics: the operand mode chosen by the sizing pass
+	uint16_t column;
+	uint32_t line;
+	uint32_t value;		// interned name id, instruction index, integer value, operator character or expression index
+};
 
-	// DEBUG: output initial code file
-	cout << endl << "ASSEMBLY CODE: " << endl << endl;
-	cout << asmCode << endl << endl;
+// true if the token is the given directive or operand keyword
+bool isName(const Token& token, uint32_t id)
+{
+	return token.value == id && (token.kind == TokenKind::Directive || token.kind == TokenKind::Keyword);
+}
 
-	// remove single-line coments
-	for (int i = 0; i < asmCode.length() - 1; ++i)
-		if (asmCode[i] == '/' && asmCode[i + 1] == '/')
-			while (i < asmCode.size() && asmCode[i] != '\n' && asmCode[i] != '\0')
-				asmCode.erase(i, 1);
+bool isOperator(const Token& token, char op)
+{
+	return token.kind == TokenKind::Operator && token.value == (uint32_t)op;
+}
 
-	// remove block comments
-	for (int i = 0; i < asmCode.length() - 1; ++i)
-		if (asmCode[i] == '/' && asmCode[i + 1] == '*')
-			while (i < asmCode.size() - 1 && (asmCode[i] != '*' || asmCode[i] != '/'))
-				asmCode.erase(i, 1);
+bool isIdentifierStart(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.';
+}
 
-	// remove unneccessary whitespace
-	bool inQuotes = false;
-	for (int i = 0; i < asmCode.length(); ++i)
-	{
-		if (asmCode[i] == '"' && !(numPreceedingBackslashes(asmCode, i) % 2)) inQuotes = !inQuotes;
-		if (inQuotes) continue;
-		if (asmCode[i] == '\n' || asmCode[i] == '\t') asmCode[i] = ' ';
-	}
-	inQuotes = false;
-	for (int i = 0; i < asmCode.length() - 1; ++i)
-	{
-		if (asmCode[i] == '"' && !(numPreceedingBackslashes(asmCode, i) % 2)) inQuotes = !inQuotes;
-		if (inQuotes) continue;
-		if (asmCode[i] == ' ') while (asmCode[i + 1] == ' ') asmCode.erase(i + 1, 1);
-	}
+bool isIdentifierChar(char c)
+{
+	return isIdentifierStart(c) || (c >= '0' && c <= '9');
+}
 
-	// make sure all mathematical symbols are separated by a space
-	inQuotes = false;
-	for (int i = 1; i < asmCode.length() - 1; ++i)
+// decode the escapes in the body of a string literal
+string decodeString(string_view str)
+{
+	string decoded;
+	decoded.reserve(str.size());
+	for (size_t i = 0; i < str.size(); ++i)
 	{
-		if (asmCode[i] == '"' && !(numPreceedingBackslashes(asmCode, i) % 2)) inQuotes = !inQuotes;
-		if (inQuotes) continue;
-		if (asmCode[i] == ':' || asmCode[i] == '=' || asmCode[i] == '+' || asmCode[i] == '-' || asmCode[i] == '*' || asmCode[i] == '/' || asmCode[i] == '(' || asmCode[i] == ')' || asmCode[i] == '%')
+		char c = str[i];
+		if (c == '\\' && i + 1 < str.size())
 		{
-			if (asmCode[i + 1] != ' ') asmCode.insert(i + 1, " ");
-			if (asmCode[i - 1] != ' ') asmCode.insert(i, " ");
+			c = str[++i];
+			if (c == 'a') c = '\a';
+			if (c == 'b') c = '\b';
+			if (c == 'f') c = '\f';
+			if (c == 'n') c = '\n';
+			if (c == 'r') c = '\r';
+			if (c == 't') c = '\t';
+			if (c == 'v') c = '\v';
 		}
+		decoded.push_back(c);
 	}
+	return decoded;
+}
 
-	// generate symbols
-	cout << "FORMATTED CODE:" << endl << endl;
-	cout << asmCode << endl << endl;
-	vector<string> symbols;
-	inQuotes = false;
-	for (int i = 0; i < asmCode.length(); ++i)
+// split the source into tokens in a single pass, skipping whitespace and comments
+bool tokenize(string_view source, StringInterner& names, vector<Token>& tokens, uint32_t firstLine = 1)
+{
+	size_t i = 0;
+	int line = firstLine;
+	size_t lineStart = 0;
+
+	while (i < source.size())
 	{
-		if (asmCode[i] == '"' && !(numPreceedingBackslashes(asmCode, i) % 2)) inQuotes = !inQuotes;
-		if (inQuotes)
+		char c = source[i];
+
+		// whitespace
+		if (c == '\n')
 		{
-			string symbol = "";
-			for (int index = i; i < asmCode.length(); ++index)
-			{
-				symbol += asmCode[index];
-				++i;
-				if (asmCode[i] == '"' && !(numPreceedingBackslashes(asmCode, i) % 2)) break;
-			}
-			symbol += "\"";
-			inQuotes = false;
-			symbols.push_back(symbol);
 			++i;
+			++line;
+			lineStart = i;
+			continue;
 		}
-		if (asmCode[i] != ' ')
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f')
 		{
-			string symbol = "";
-			while (asmCode[i] != ' ') symbol += asmCode.substr(i++, 1);
-			symbols.push_back(symbol);
+			++i;
+			continue;
 		}
-	}
 
-	// add leading zeros for unitary operators
-	for (int i = 0; i < symbols.size(); ++i)
-	{
-		if (symbols[i] == "+" || symbols[i] == "-")
+		int column = i - lineStart + 1;
+		size_t start = i;
+
+		// single-line comments
+		if (c == '/' && i + 1 < source.size() && source[i + 1] == '/')
 		{
-			if (i == 0 || symbols[i - 1] == "(" || symbols[i - 1] == "=" || isInstruction(symbols[i - 1]) || isDirective(symbols[i - 1]))
+			while (i < source.size() && source[i] != '\n') ++i;
+			continue;
+		}
+
+		// block comments
+		if (c == '/' && i + 1 < source.size() && source[i + 1] == '*')
+		{
+			i += 2;
+			while (i < source.size() && !(source[i] == '*' && i + 1 < source.size() && source[i + 1] == '/'))
 			{
-				symbols.insert(symbols.begin() + i, "0");
+				if (source[i] == '\n')
+				{
+					++line;
+					lineStart = i + 1;
+				}
 				++i;
 			}
+			if (i >= source.size())
+			{
+				LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(line) << ": unterminated block comment!\n";
+				return false;
+			}
+			i += 2;
+			continue;
 		}
-	}
 
-	// place parentheses to enforce order of operations
-	for (int i = 0; i < symbols.size(); ++i)
-	{
-		if (symbols[i] == "*" || symbols[i] == "/" || symbols[i] == "%")
+		Token token;
+		token.detail = 0;
+		token.line = line;
+		token.column = min(column, 0xffff);
+
+		// strings
+		if (c == '"')
 		{
-			// place left parenthese
-			int parnum = 0;
-			for (int index = i - 1; index >= 0; --index)
+			++i;
+			while (i < source.size() && source[i] != '"')
 			{
-				if (symbols[index] == ")") ++parnum;
-				else if (symbols[index] == "(") --parnum;
-				if (parnum == 0)
+				if (source[i] == '\\' && i + 1 < source.size()) ++i;
+				if (source[i] == '\n')
 				{
-					symbols.insert(symbols.begin() + index, "(");
-					++i;
-					break;
+					++line;
+					lineStart = i + 1;
 				}
+				++i;
 			}
-			// place right parenthese
-			parnum = 0;
-			for (int index = i + 1; index < symbols.size(); ++index)
+			if (i >= source.size())
 			{
-				if (symbols[index] == "(") ++parnum;
-				else if (symbols[index] == ")") --parnum;
-				if (parnum == 0)
-				{
-					symbols.insert(symbols.begin() + index + 1, ")");
-					break;
-				}
+				LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(token.line) << ":" << token.column << ": unterminated string!\n";
+				return false;
 			}
+			++i;
+			token.kind = TokenKind::String;
+			token.value = names.intern(decodeString(source.substr(start + 1, i - start - 2)));
 		}
-	}
-	for (int i = 0; i < symbols.size(); ++i)
-	{
-		if (symbols[i] == "+" || symbols[i] == "-")
+		// numbers
+		else if (c >= '0' && c <= '9')
 		{
-			// place left parenthese
-			int parnum = 0;
-			for (int index = i - 1; index >= 0; --index)
+			while (i < source.size() && isIdentifierChar(source[i])) ++i;
+			string_view text = source.substr(start, i - start);
+			int width;
+			if (!parseNumber(text, token.value, width))
 			{
-				if (symbols[index] == ")") ++parnum;
-				else if (symbols[index] == "(") --parnum;
-				if (parnum == 0)
-				{
-					symbols.insert(symbols.begin() + index, "(");
-					++i;
-					break;
-				}
+				LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(line) << ":" << column << ": " << text << " is not a valid number!\n";
+				return false;
 			}
-			// place right parenthese
-			parnum = 0;
-			for (int index = i + 1; index < symbols.size(); ++index)
+			token.kind = TokenKind::Number;
+			token.detail = min(width, 0xff);
+			if (width > 4) token.value = names.intern(text);
+		}
+		// mnemonics, directives and tags
+		else if (isIdentifierStart(c))
+		{
+			while (i < source.size() && isIdentifierChar(source[i])) ++i;
+			string_view word = source.substr(start, i - start);
+			int instruction = findInstruction(word);
+			if (instruction >= 0)
 			{
-				if (symbols[index] == "(") ++parnum;
-				else if (symbols[index] == ")") --parnum;
-				if (parnum == 0)
-				{
-					symbols.insert(symbols.begin() + index + 1, ")");
-					break;
-				}
+				token.kind = TokenKind::Mnemonic;
+				token.value = instruction;
+			}
+			else
+			{
+				token.kind = c == '.' ? TokenKind::Directive : TokenKind::Identifier;
+				token.value = names.intern(word);
 			}
 		}
+		// operand keywords
+		else if (c == '#')
+		{
+			++i;
+			while (i < source.size() && isIdentifierChar(source[i])) ++i;
+			token.kind = TokenKind::Keyword;
+			token.value = names.intern(source.substr(start, i - start));
+		}
+		else if (c == ':')
+		{
+			++i;
+			token.kind = TokenKind::LabelColon;
+			token.value = c;
+		}
+		// shifts are stored as '<' and '>', since there are no comparison operators
+		else if ((c == '<' || c == '>') && i + 1 < source.size() && source[i + 1] == c)
+		{
+			i += 2;
+			token.kind = TokenKind::Operator;
+			token.value = c;
+		}
+		else if (c == '=' || c == '+' || c == '-' || c == '*' || c == '/' || c == '%' || c == '(' || c == ')' || c == '!' ||
+			c == '&' || c == '|' || c == '^' || c == '~' || c == ',')
+		{
+			++i;
+			token.kind = TokenKind::Operator;
+			token.value = c;
+		}
+		else
+		{
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(line) << ":" << column << ": unexpected character '" << c << "'!\n";
+			return false;
+		}
+
+		tokens.push_back(token);
 	}
 
-	// DEBUG: output symbols
-	cout << "SYMBOLS:" << endl << endl;
-	for (int i = 0; i < symbols.size(); ++i) cout << symbols[i] << endl;
-	cout << endl;
+	return true;
+}
 
-	// generate tags
-	unordered_map<string, int> tags;
+// node of an operand expression's syntax tree; constant subtrees are folded into Number nodes
+struct ExprNode
+{
+	enum Type : uint8_t
+	{
+		Number, Tag,
+		Negate, Complement,
+		Multiply, Divide, Modulo, Add, Subtract, ShiftLeft, ShiftRight, And, Xor, Or
+	} type;
+	uint16_t depth;		// levels of operators below the node, so walking the tree never recurses too deep
+	int32_t value;		// Number: the value; Tag: the tag's name id
+	uint32_t left;		// operand of unary nodes, left operand of binary nodes
+	uint32_t right;		// right operand of binary nodes
+};
 
-	// directly defined tags
-	int address = 0;
-	for (int i = 0; i < symbols.size(); ++i)
+const int maxExpressionDepth = 256;
+
+// binding power of a binary operator token, 0 if the token does not continue an expression
+int bindingPower(const Token& token, ExprNode::Type& type)
+{
+	if (token.kind != TokenKind::Operator) return 0;
+	switch (token.value)
 	{
-		// tag definitions
-		if (symbols[i] == ":" && i)
-		{
-			tags[symbols[i - 1]] = address;
-			symbols.erase(symbols.begin() + i, symbols.begin() + i + 1);
-			symbols.erase(symbols.begin() + i - 1, symbols.begin() + i);
-			--i;
-			cout << "ADDRESS ADDED TO TAG: " << address << endl;
-		}
-		if (i >= symbols.size() - 1) break;
-		// update the address based on instruction byte-size
-		if (symbols[i] == "NOP" || symbols[i] == "PSH" || symbols[i] == "POP" || symbols[i] == "RSR") ++address;
-		if (symbols[i] == "ADD" || symbols[i] == "ADC" || symbols[i] == "SUB" || symbols[i] == "SBB" ||
-			symbols[i] == "ONC" || symbols[i] == "TWC" || symbols[i] == "AND" || symbols[i] == "OR" ||
-			symbols[i] == "XOR" || symbols[i] == "LSL" || symbols[i] == "LSR" || symbols[i] == "ASR" ||
-			symbols[i] == "ROL" || symbols[i] == "ROR" || symbols[i] == "RCL" || symbols[i] == "RCR")
+	case '*': type = ExprNode::Multiply; return 6;
+	case '/': type = ExprNode::Divide; return 6;
+	case '%': type = ExprNode::Modulo; return 6;
+	case '+': type = ExprNode::Add; return 5;
+	case '-': type = ExprNode::Subtract; return 5;
+	case '<': type = ExprNode::ShiftLeft; return 4;
+	case '>': type = ExprNode::ShiftRight; return 4;
+	case '&': type = ExprNode::And; return 3;
+	case '^': type = ExprNode::Xor; return 2;
+	case '|': type = ExprNode::Or; return 1;
+	}
+	return 0;
+}
+
+// apply an operator to constant operands, failing only on division by zero
+bool applyOperator(ExprNode::Type type, int a, int b, int& result)
+{
+	switch (type)
+	{
+	case ExprNode::Negate: result = -a; break;
+	case ExprNode::Complement: result = ~a; break;
+	case ExprNode::Multiply: result = a * b; break;
+	case ExprNode::Divide: if (!b) return false; result = a / b; break;
+	case ExprNode::Modulo: if (!b) return false; result = a % b; break;
+	case ExprNode::Add: result = a + b; break;
+	case ExprNode::Subtract: result = a - b; break;
+	case ExprNode::ShiftLeft: result = (b < 0 || b > 31) ? 0 : (int)((uint32_t)a << b); break;
+	case ExprNode::ShiftRight: result = (b < 0 || b > 31) ? 0 : (int)((uint32_t)a >> b); break;
+	case ExprNode::And: result = a & b; break;
+	case ExprNode::Xor: result = a ^ b; break;
+	case ExprNode::Or: result = a | b; break;
+	default: result = a;
+	}
+	return true;
+}
+
+// precedence-climbing parser building expression trees in a shared node list
+struct ExpressionParser
+{
+	const vector<Token>& tokens;
+	vector<ExprNode>& nodes;
+	size_t i;
+	int depth;
+
+	// parse the expression starting at tokens[i], leaving i just past it; returns its root node or -1
+	int parse(int minPower = 1)
+	{
+		if (++depth > maxExpressionDepth)
 		{
-			// immediate operand
-			if (symbols[i + 1][0] == '!') address += 2;
-			// accumulator operand
-			else if (symbols[i + 1] == "#reg_a") ++address;
-			// stack operand
-			else if (symbols[i + 1] == "#stack") ++address;
-			// address operand
-			else address += 3;
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(tokens[i - 1].line) << ": expression is too deeply nested!\n";
+			return -1;
 		}
-		if (symbols[i] == "LOD")
+
+		int left = parseOperand();
+		ExprNode::Type type = ExprNode::Add;
+		int power;
+		while (left >= 0 && i < tokens.size() && (power = bindingPower(tokens[i], type)) >= minPower)
 		{
-			// immediate operand
-			if (symbols[i + 1][0] == '!') address += 2;
-			// stack operand
-			else if (symbols[i + 1] == "#stack") ++address;
-			// address operand
-			else address += 3;
+			uint32_t line = tokens[i].line;
+			++i;
+			int right = parse(power + 1);
+			if (right < 0) return -1;
+			left = makeNode(type, left, right, line);
 		}
-		if (symbols[i] == "STO")
+
+		--depth;
+		return left;
+	}
+
+	int parseOperand()
+	{
+		if (i >= tokens.size())
 		{
-			// stack operand
-			if (symbols[i + 1] == "#stack") ++address;
-			// address operand
-			else address += 3;
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(tokens.back().line) << ": incomplete expression!\n";
+			return -1;
 		}
-		if (symbols[i] == "JMP" || symbols[i] == "JSR" || symbols[i] == "BRC" || symbols[i] == "BRZ" || symbols[i] == "BRN" ||
-			symbols[i] == "BRV" || symbols[i] == "BNC" || symbols[i] == "BNZ" || symbols[i] == "BNN" || symbols[i] == "BNV")
-			address += 3;
-		if (symbols[i] == "HLT") ++address;
-		if (symbols[i] == ".reserve" && i < symbols.size() - 1)
+
+		const Token& token = tokens[i++];
+		if (token.kind == TokenKind::Number)
 		{
-			if (!isInteger(symbols[i + 1]))
+			if (token.detail > 4)
 			{
-				cout << "ERROR: .reserve " << symbols[i + 1] << " is not a valid directive!" << endl;
-				return "";
+				LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(token.line) << ": number is too large for an expression!\n";
+				return -1;
 			}
-			address += integer(symbols[i + 1]);
+			nodes.push_back({ ExprNode::Number, 0, (int32_t)token.value, 0, 0 });
+			return nodes.size() - 1;
 		}
-		if (symbols[i] == ".org" && i < symbols.size() - 1)
+		if (token.kind == TokenKind::Identifier)
 		{
-			if (!isInteger(symbols[i + 1]))
-			{
-				cout << "ERROR: .org " << symbols[i + 1] << " is not a valid directive!" << endl;
-				return "";
-			}
-			address = integer(symbols[i + 1]);
+			nodes.push_back({ ExprNode::Tag, 0, (int32_t)token.value, 0, 0 });
+			return nodes.size() - 1;
 		}
-		if (symbols[i] == ".byte" && i < symbols.size() - 1)
-			++address;
-		if (symbols[i] == ".string" && i < symbols.size() - 1 && symbols[i + 1][0] == '"' && symbols[i + 1].back() == '"')
+		if (isOperator(token, '('))
 		{
-			int length = symbols[i + 1].length() - 1;
-			for (int j = 0; j < symbols[i + 1].length(); ++j) if (symbols[i + 1][j] == '\\') --length;
-			address += length;
+			int inner = parse();
+			if (inner < 0) return -1;
+			if (i >= tokens.size() || !isOperator(tokens[i], ')'))
+			{
+				LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(token.line) << ": missing ')' in expression!\n";
+				return -1;
+			}
+			++i;
+			return inner;
 		}
-		if (symbols[i] == ".data" && i < symbols.size() - 1 && isInteger(symbols[i + 1]))
+		if (isOperator(token, '-') || isOperator(token, '~') || isOperator(token, '+'))
 		{
-			string data = to_hex(symbols[i + 1]);
-			int dataSize = data.size();
-			if (dataSize % 2) ++dataSize;
-			address += dataSize / 2;
+			// unary operators bind tighter than any binary operator
+			int operand = parse(7);
+			if (operand < 0 || isOperator(token, '+')) return operand;
+			return makeNode(isOperator(token, '-') ? ExprNode::Negate : ExprNode::Complement, operand, 0, token.line);
 		}
+
+		LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(token.line) << ": expected a value in expression!\n";
+		return -1;
 	}
 
-	// indirectly defined tags
-	int numUndefined = 1;
-	bool progress = false;
-	while (numUndefined)
+	// add an operator node, folding it straight into a number if its operands are constant
+	int makeNode(ExprNode::Type type, uint32_t left, uint32_t right, uint32_t line)
 	{
-		numUndefined = 0;
-		progress = false;
-		// define tags with a valid definition
-		for (int i = 1; i < symbols.size() - 1; ++i)
+		bool unary = type == ExprNode::Negate || type == ExprNode::Complement;
+		if (nodes[left].type == ExprNode::Number && (unary || nodes[right].type == ExprNode::Number))
 		{
-			if (symbols[i] == "=")
+			int result;
+			if (!applyOperator(type, nodes[left].value, unary ? 0 : nodes[right].value, result))
 			{
-				if (isInteger(symbols[i + 1]) && (i >= symbols.size() - 2 || (symbols[i + 2] != "=" && symbols[i + 2] != "+" &&
-					symbols[i + 2] != "-" && symbols[i + 2] != "*" && symbols[i + 2] != "/" && symbols[i + 2] != "%")))
-				{
-					tags[symbols[i - 1]] = integer(symbols[i + 1]);
-					symbols.erase(symbols.begin() + i - 1, symbols.begin() + i + 2);
-					--i;
-					progress = true;
-				}
-				else ++numUndefined;
+				LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(line) << ": division by zero in expression!\n";
+				return -1;
 			}
+
+			// the operands are normally the last nodes added, so their slots can be reused
+			if (unary ? left + 1 == nodes.size() : (left + 1 == right && right + 1 == nodes.size())) nodes.resize(left);
+			nodes.push_back({ ExprNode::Number, 0, result, 0, 0 });
+			return nodes.size() - 1;
 		}
 
-		// replace defined tags
-		for (int i = 0; i < symbols.size(); ++i)
+		// (x + a) + b and (x - a) + b fold their constants together, so chains like lab + 1 + 1 stay shallow
+		ExprNode& inner = nodes[left];
+		if ((type == ExprNode::Add || type == ExprNode::Subtract) && nodes[right].type == ExprNode::Number &&
+			(inner.type == ExprNode::Add || inner.type == ExprNode::Subtract) && nodes[inner.right].type == ExprNode::Number)
 		{
-			if (tags.find(symbols[i]) != tags.end())
-			{
-				symbols[i] = to_string(tags[symbols[i]]);
-				progress = true;
-			}
+			int a = inner.type == ExprNode::Add ? nodes[inner.right].value : -nodes[inner.right].value;
+			int b = type == ExprNode::Add ? nodes[right].value : -nodes[right].value;
+			inner.type = ExprNode::Add;
+			nodes[inner.right].value = a + b;
+			if (right + 1 == nodes.size()) nodes.pop_back();
+			return left;
 		}
 
-		// evaluate expressions
-		for (int i = 0; i < symbols.size(); ++i)
+		// a long chain like a + b + c + ... is as deep as it is long, however few parentheses it has
+		int depth = 1 + max<int>(nodes[left].depth, unary ? 0 : nodes[right].depth);
+		if (depth > maxExpressionDepth)
 		{
-			if (symbols[i] == "*" && isInteger(symbols[i - 1]) && isInteger(symbols[i + 1]))
-			{
-				symbols[i] = to_string(integer(symbols[i - 1]) * integer(symbols[i + 1]));
-				symbols.erase(symbols.begin() + i + 1);
-				symbols.erase(symbols.begin() + i - 1);
-				--i;
-				progress = true;
-			}
-			if (symbols[i] == "/" && isInteger(symbols[i - 1]) && isInteger(symbols[i + 1]))
-			{
-				symbols[i] = to_string(integer(symbols[i - 1]) / integer(symbols[i + 1]));
-				symbols.erase(symbols.begin() + i + 1);
-				symbols.erase(symbols.begin() + i - 1);
-				--i;
-				progress = true;
-			}
-			if (symbols[i] == "%" && isInteger(symbols[i - 1]) && isInteger(symbols[i + 1]))
-			{
-				symbols[i] = to_string(integer(symbols[i - 1]) % integer(symbols[i + 1]));
-				symbols.erase(symbols.begin() + i + 1);
-				symbols.erase(symbols.begin() + i - 1);
-				--i;
-				progress = true;
-			}
-			if (symbols[i] == "+" && isInteger(symbols[i - 1]) && isInteger(symbols[i + 1]))
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(line) << ": expression is too deeply nested!\n";
+			return -1;
+		}
+		nodes.push_back({ type, (uint16_t)depth, 0, left, right });
+		return nodes.size() - 1;
+	}
+};
+
+// a tag, defined either by a label's address or by an equate's expression
+struct TagInfo
+{
+	enum State : uint8_t { Undefined, Pending, Resolving, Resolved } state = Undefined;
+	bool isLabel = false;
+	int value = 0;
+	uint32_t expr = 0;				// equate's expression root
+	uint32_t line = 0;				// line of the definition
+	uint32_t firstDependency = 0;	// the tags an equate uses, as a range of SymbolTable::dependencies
+	uint32_t numDependencies = 0;
+	bool relocatable = false;		// label in the section the linker places, its value is an offset into that section
+	bool imported = false;			// used but not defined in an object module, the linker takes it from another module
+};
+
+// evaluate an expression tree, failing with the first undefined tag if it references one;
+// evaluated subtrees are folded into numbers so deferred expressions are only walked once
+bool evaluate(vector<ExprNode>& nodes, uint32_t node, uint32_t line, const vector<TagInfo>& tags, int& result, uint32_t& undefinedTag)
+{
+	ExprNode& expr = nodes[node];
+	if (expr.type == ExprNode::Number)
+	{
+		result = expr.value;
+		return true;
+	}
+	if (expr.type == ExprNode::Tag)
+	{
+		if (tags[expr.value].state != TagInfo::Resolved)
+		{
+			undefinedTag = expr.value;
+			return false;
+		}
+		result = tags[expr.value].value;
+		return true;
+	}
+
+	ExprNode::Type type = expr.type;
+	uint32_t right = expr.right;
+	int a = 0;
+	int b = 0;
+	if (!evaluate(nodes, expr.left, line, tags, a, undefinedTag)) return false;
+	if (type != ExprNode::Negate && type != ExprNode::Complement && !evaluate(nodes, right, line, tags, b, undefinedTag)) return false;
+	if (!applyOperator(type, a, b, result))
+	{
+		LOG(LOG_ERROR, LOG_RESOLVE) << "ERROR: " << logger.where(line) << ": division by zero in expression!\n";
+		undefinedTag = UINT32_MAX;
+		return false;
+	}
+
+	// only tags that are already final get here, so the result is final too
+	nodes[node] = { ExprNode::Number, 0, result, 0, 0 };
+	return true;
+}
+
+// tags indexed by name id, with the dependency graph between equates
+class SymbolTable
+{
+public:
+	SymbolTable(size_t numNames) : tags(numNames) {}
+
+	const TagInfo& operator[](uint32_t id) const { return tags[id]; }
+	const vector<uint32_t>& resolutionOrder() const { return order; }
+
+	// record a label, whose address is only known once the sizing pass reaches it
+	bool declareLabel(uint32_t id, uint32_t line, const StringInterner& names)
+	{
+		if (!declare(id, line, names)) return false;
+		tags[id].isLabel = true;
+		return true;
+	}
+
+	void placeLabel(uint32_t id, int address, bool relocatable = false)
+	{
+		tags[id].value = address;
+		tags[id].state = TagInfo::Resolved;
+		tags[id].relocatable = relocatable;
+		order.push_back(id);
+	}
+
+	// in an object module, every tag that is used but never defined comes from another module
+	void declareImports(const vector<ExprNode>& nodes)
+	{
+		for (const ExprNode& node : nodes)
+		{
+			if (node.type != ExprNode::Tag || tags[node.value].state != TagInfo::Undefined) continue;
+			TagInfo& tag = tags[node.value];
+			tag.state = TagInfo::Resolved;
+			tag.isLabel = true;
+			tag.imported = true;
+			order.push_back(node.value);
+		}
+	}
+
+	// record an equate along with every tag its expression uses
+	bool declareEquate(uint32_t id, uint32_t expr, uint32_t line, const vector<ExprNode>& nodes, const StringInterner& names)
+	{
+		if (!declare(id, line, names)) return false;
+		TagInfo& tag = tags[id];
+		tag.expr = expr;
+		tag.firstDependency = dependencies.size();
+		collectTags(nodes, expr, dependencies);
+		tag.numDependencies = dependencies.size() - tag.firstDependency;
+		return true;
+	}
+
+	// resolve a tag and, depth first, every equate it depends on, so each is evaluated once in topological order
+	bool resolve(uint32_t root, vector<ExprNode>& nodes, const StringInterner& names)
+	{
+		if (tags[root].state == TagInfo::Resolved) return true;
+		if (!checkDefined(root, tags[root].line, names)) return false;
+
+		struct Frame { uint32_t id; uint32_t next; };
+		vector<Frame> stack = { { root, 0 } };
+		tags[root].state = TagInfo::Resolving;
+		while (!stack.empty())
+		{
+			Frame& frame = stack.back();
+			TagInfo& tag = tags[frame.id];
+			if (frame.next < tag.numDependencies)
+			{
+				uint32_t dependency = dependencies[tag.firstDependency + frame.next++];
+				TagInfo& next = tags[dependency];
+				if (next.state == TagInfo::Resolved) continue;
+				if (!checkDefined(dependency, tag.line, names)) return false;
+				if (next.state == TagInfo::Resolving)
+				{
+					// the cycle runs from the dependency's frame to the top of the stack
+					size_t start = 0;
+					while (stack[start].id != dependency) ++start;
+					LOG(LOG_ERROR, LOG_RESOLVE) << "ERROR: " << logger.where(next.line) << ": circular definition: ";
+					for (size_t i = start; i < stack.size(); ++i) logger.stream << names.text(stack[i].id) << " -> ";
+					logger.stream << names.text(dependency) << "!\n";
+					return false;
+				}
+				next.state = TagInfo::Resolving;
+				stack.push_back({ dependency, 0 });
+				continue;
+			}
+
+			// every dependency is resolved, so the expression evaluates straight away
+			uint32_t undefinedTag;
+			if (!evaluate(nodes, tag.expr, tag.line, tags, tag.value, undefinedTag)) return false;
+			tag.state = TagInfo::Resolved;
+			order.push_back(frame.id);
+			stack.pop_back();
+		}
+		return true;
+	}
+
+	// resolve every tag an expression uses, then evaluate it
+	bool evaluateExpression(vector<ExprNode>& nodes, uint32_t expr, uint32_t line, const StringInterner& names, int& result)
+	{
+		vector<uint32_t> used;
+		collectTags(nodes, expr, used);
+		for (uint32_t id : used)
+			if (!checkDefined(id, line, names) || !resolve(id, nodes, names)) return false;
+		uint32_t undefinedTag;
+		return evaluate(nodes, expr, line, tags, result, undefinedTag);
+	}
+
+	bool resolveAll(vector<ExprNode>& nodes, const StringInterner& names)
+	{
+		for (uint32_t id = 0; id < tags.size(); ++id)
+			if (tags[id].state == TagInfo::Pending && !resolve(id, nodes, names)) return false;
+		return true;
+	}
+
+	// print the resolved tags in resolution order, along with the tags each equate uses
+	void dump(ostream& out, const StringInterner& names) const
+	{
+		for (uint32_t id : order)
+		{
+			const TagInfo& tag = tags[id];
+			out << "\ttag: " << names.text(id) << "\tdef: " << tag.value;
+			if (tag.imported) out << "\t(imported)";
+			else if (tag.relocatable) out << "\t(relocatable label)";
+			else if (tag.isLabel) out << "\t(label)";
+			for (uint32_t i = 0; i < tag.numDependencies; ++i)
+				out << (i ? ", " : "\tuses: ") << names.text(dependencies[tag.firstDependency + i]);
+			out << "\n";
+		}
+	}
+
+private:
+	bool declare(uint32_t id, uint32_t line, const StringInterner& names)
+	{
+		if (tags[id].state != TagInfo::Undefined)
+		{
+			LOG(LOG_ERROR, LOG_SYMBOLS) << "ERROR: " << logger.where(line) << ": tag " << names.text(id) << " is already defined on " << logger.where(tags[id].line) << "!\n";
+			return false;
+		}
+		tags[id].state = TagInfo::Pending;
+		tags[id].line = line;
+		return true;
+	}
+
+	// report tags that are never defined, or labels used before the sizing pass has placed them
+	bool checkDefined(uint32_t id, uint32_t line, const StringInterner& names) const
+	{
+		if (tags[id].state == TagInfo::Undefined)
+		{
+			LOG(LOG_ERROR, LOG_RESOLVE) << "ERROR: " << logger.where(line) << ": undefined tag " << names.text(id) << "!\n";
+			return false;
+		}
+		if (tags[id].isLabel && tags[id].state != TagInfo::Resolved)
+		{
+			LOG(LOG_ERROR, LOG_RESOLVE) << "ERROR: " << logger.where(line) << ": tag " << names.text(id) << " must be defined before it is used here!\n";
+			return false;
+		}
+		return true;
+	}
+
+	// add the name id of every tag in an expression tree
+	static void collectTags(const vector<ExprNode>& nodes, uint32_t root, vector<uint32_t>& ids)
+	{
+		vector<uint32_t> pending = { root };
+		while (!pending.empty())
+		{
+			const ExprNode& node = nodes[pending.back()];
+			pending.pop_back();
+			if (node.type == ExprNode::Tag) ids.push_back(node.value);
+			else if (node.type != ExprNode::Number)
+			{
+				pending.push_back(node.left);
+				if (node.type != ExprNode::Negate && node.type != ExprNode::Complement) pending.push_back(node.right);
+			}
+		}
+	}
+
+	vector<TagInfo> tags;
+	vector<uint32_t> dependencies;
+	vector<uint32_t> order;	// tags in the order they were resolved
+};
+
+// a contiguous run of assembled bytes
+struct Segment
+{
+	uint32_t base;
+	vector<uint8_t> bytes;
+
+	uint32_t end() const { return base + bytes.size(); }
+};
+
+// sparse image of the address space: segments sorted by base address, with holes between them
+class MemoryImage
+{
+public:
+	static const uint32_t addressSpace = 0x10000;
+
+	// move the write position; skipped memory is a hole, nothing is filled in
+	void org(uint32_t address)
+	{
+		cursor = address;
+		extent = max(extent, cursor);
+	}
+	void reserve(uint32_t count) { org(cursor + count); }
+
+	// write a byte at the write position; a collision with existing data or the end of memory sticks until checked
+	void emit(uint8_t byte)
+	{
+		if (collided) return;
+		if ((current < 0 || segments[current].end() != cursor) && !openSegment()) return;
+		if (cursor >= limit)
+		{
+			collided = true;
+			return;
+		}
+		segments[current].bytes.push_back(byte);
+		org(cursor + 1);
+	}
+
+	// write a 16-bit address, little-endian
+	void emitAddress(int value)
+	{
+		emit(value);
+		emit(value >> 8);
+	}
+
+	bool good() const { return !collided; }
+	uint32_t position() const { return cursor; }
+	const vector<Segment>& segmentList() const { return segments; }
+
+	// one past the highest address written or reserved
+	uint32_t size() const { return extent; }
+
+	// dense copy of memory from address 0, with the holes filled
+	vector<uint8_t> flatten(uint8_t fill = 0) const
+	{
+		vector<uint8_t> memory(extent, fill);
+		for (const Segment& segment : segments) copy(segment.bytes.begin(), segment.bytes.end(), memory.begin() + segment.base);
+		return memory;
+	}
+
+private:
+	vector<Segment> segments;
+	int current = -1;			// segment being appended to
+	uint32_t limit = 0;			// base of the segment after it, which it must not grow into
+	uint32_t cursor = 0;
+	uint32_t extent = 0;
+	bool collided = false;
+
+	// find or insert the segment that ends at the write position
+	bool openSegment()
+	{
+		auto next = upper_bound(segments.begin(), segments.end(), cursor, [](uint32_t address, const Segment& segment) { return address < segment.base; });
+		if (next != segments.begin() && prev(next)->end() > cursor)
+		{
+			collided = true;
+			return false;
+		}
+		limit = next == segments.end() ? addressSpace : next->base;
+		current = next - segments.begin();
+		if (next != segments.begin() && prev(next)->end() == cursor) --current;
+		else segments.insert(next, { cursor, {} });
+		return true;
+	}
+};
+
+// print an expression tree in fully parenthesized infix form
+void printExpression(const vector<ExprNode>& nodes, uint32_t node, const StringInterner& names, ostream& out)
+{
+	const char* symbols[] = { "", "", "-", "~", "*", "/", "%", "+", "-", "<<", ">>", "&", "^", "|" };
+	const ExprNode& expr = nodes[node];
+	if (expr.type == ExprNode::Number) out << expr.value;
+	else if (expr.type == ExprNode::Tag) out << names.text(expr.value);
+	else if (expr.type == ExprNode::Negate || expr.type == ExprNode::Complement)
+	{
+		out << symbols[expr.type];
+		printExpression(nodes, expr.left, names, out);
+	}
+	else
+	{
+		out << "(";
+		printExpression(nodes, expr.left, names, out);
+		out << " " << symbols[expr.type] << " ";
+		printExpression(nodes, expr.right, names, out);
+		out << ")";
+	}
+}
+
+// work out the operand mode of the instruction at symbols[i] from the symbols that follow it
+OperandMode operandMode(const vector<Token>& symbols, size_t i)
+{
+	if (i + 1 < symbols.size())
+	{
+		const Token& operand = symbols[i + 1];
+		if (isOperator(operand, '!') && i + 2 < symbols.size() && symbols[i + 2].kind == TokenKind::Expression) return MODE_IMMEDIATE;
+		if (isName(operand, NAME_STACK)) return MODE_STACK;
+		if (isName(operand, NAME_A_REG) || isName(operand, NAME_REG_A)) return MODE_ACCUMULATOR;
+		if (operand.kind == TokenKind::Expression) return MODE_ADDRESS;
+	}
+	return instructionTable[symbols[i].value].defaultMode;
+}
+
+// print a token the way it was written, or an expression as a fully parenthesized tree
+void printToken(const Token& token, const StringInterner& names, const vector<ExprNode>& nodes, ostream& out)
+{
+	switch (token.kind)
+	{
+	case TokenKind::Number:
+		if (token.detail > 4) out << names.text(token.value);
+		else out << (int32_t)token.value;
+		break;
+	case TokenKind::String:
+		out << '"' << names.text(token.value) << '"';
+		break;
+	case TokenKind::Operator:
+	case TokenKind::LabelColon:
+		out << (char)token.value;
+		break;
+	case TokenKind::Mnemonic:
+		out << instructionTable[token.value].mnemonic;
+		break;
+	case TokenKind::Expression:
+		printExpression(nodes, token.value, names, out);
+		break;
+	default:
+		out << names.text(token.value);
+	}
+}
+
+// how a relocation patches its field
+enum RelocationType : uint8_t
+{
+	RELOC_ADDRESS,		// 16-bit little-endian address
+	RELOC_LOW,			// low byte of an address, written as tag % 256
+	RELOC_HIGH,			// high byte of an address, written as tag / 256
+	NUM_RELOCATION_TYPES
+};
+
+const char* relocationTypeNames[NUM_RELOCATION_TYPES] = { "address", "low", "high" };
+
+// a field the linker patches with the address of the module's relocatable section, or of a tag from another module, plus an addend
+struct Relocation
+{
+	RelocationType type;
+	bool inText;		// the field is at an offset into the relocatable section rather than at an absolute address
+	uint32_t address;
+	string target;		// imported tag, empty for the module's own relocatable section
+	int addend;
+};
+
+// a tag exported with .global
+struct ObjectSymbol
+{
+	string name;
+	bool inText;		// the value is an offset into the relocatable section
+	int value;
+};
+
+// a module assembled for linking: the code placed with .org stays where it is, while the code before the first .org
+// is a relocatable section the linker places wherever there is room
+struct ObjectModule
+{
+	string name;
+	MemoryImage absolute;
+	MemoryImage text;
+	vector<ObjectSymbol> symbols;
+	vector<Relocation> relocations;
+};
+
+// an operand as a constant plus the addresses only the linker knows, the only form a relocation can patch
+struct LinearValue
+{
+	int constant = 0;
+	int textCount = 0;				// times the base of the module's relocatable section is added
+	uint32_t import = UINT32_MAX;	// the imported tag, if any
+	int importCount = 0;
+
+	bool isConstant() const { return textCount == 0 && importCount == 0; }
+};
+
+// whether an expression uses a tag, directly or through the equates it uses
+bool usesTag(const vector<ExprNode>& nodes, uint32_t node, const SymbolTable& tags, uint32_t id, int depth = 0)
+{
+	const ExprNode& expr = nodes[node];
+	if (depth > maxExpressionDepth || expr.type == ExprNode::Number) return false;
+	if (expr.type == ExprNode::Tag)
+	{
+		const TagInfo& tag = tags[expr.value];
+		if ((uint32_t)expr.value == id) return true;
+		return !tag.isLabel && tag.state != TagInfo::Undefined && usesTag(nodes, tag.expr, tags, id, depth + 1);
+	}
+	bool unary = expr.type == ExprNode::Negate || expr.type == ExprNode::Complement;
+	return usesTag(nodes, expr.left, tags, id, depth + 1) || (!unary && usesTag(nodes, expr.right, tags, id, depth + 1));
+}
+
+// work out an unevaluated expression as a LinearValue, failing if it combines addresses in a way no relocation can express
+bool linearValue(const vector<ExprNode>& nodes, uint32_t node, const SymbolTable& tags, LinearValue& result, uint32_t line, int depth = 0)
+{
+	const ExprNode& expr = nodes[node];
+	result = LinearValue();
+	if (depth > maxExpressionDepth)
+	{
+		LOG(LOG_ERROR, LOG_SYMBOLS) << "ERROR: " << logger.where(line) << ": expression is too deeply nested!\n";
+		return false;
+	}
+	if (expr.type == ExprNode::Number)
+	{
+		result.constant = expr.value;
+		return true;
+	}
+	if (expr.type == ExprNode::Tag)
+	{
+		const TagInfo& tag = tags[expr.value];
+		if (tag.imported)
+		{
+			result.import = expr.value;
+			result.importCount = 1;
+		}
+		else if (tag.isLabel || tag.state == TagInfo::Undefined)
+		{
+			result.constant = tag.value;
+			result.textCount = tag.relocatable;
+		}
+		else if (tag.state != TagInfo::Resolved && usesTag(nodes, tag.expr, tags, expr.value))
+		{
+			// circular equates are reported when they are resolved
+			return true;
+		}
+		else return linearValue(nodes, tag.expr, tags, result, line, depth + 1);
+		return true;
+	}
+
+	LinearValue a, b;
+	bool unary = expr.type == ExprNode::Negate || expr.type == ExprNode::Complement;
+	if (!linearValue(nodes, expr.left, tags, a, line, depth + 1)) return false;
+	if (!unary && !linearValue(nodes, expr.right, tags, b, line, depth + 1)) return false;
+	if (a.isConstant() && b.isConstant())
+	{
+		// division by zero is reported when the expression is evaluated
+		if (!applyOperator(expr.type, a.constant, b.constant, result.constant)) result.constant = 0;
+		return true;
+	}
+
+	// addresses can only be added, subtracted and scaled by a constant
+	int sign = 1;
+	switch (expr.type)
+	{
+	case ExprNode::Negate:
+		b = a;
+		a = LinearValue();
+		sign = -1;
+		break;
+	case ExprNode::Subtract:
+		sign = -1;
+		break;
+	case ExprNode::Add:
+		break;
+	case ExprNode::Multiply:
+		if (!b.isConstant()) swap(a, b);
+		if (!b.isConstant()) return false;
+		result = a;
+		result.constant *= b.constant;
+		result.textCount *= b.constant;
+		result.importCount *= b.constant;
+		return true;
+	default:
+		return false;
+	}
+	if (a.importCount && b.importCount && a.import != b.import) return false;
+	result.constant = a.constant + sign * b.constant;
+	result.textCount = a.textCount + sign * b.textCount;
+	result.import = a.importCount ? a.import : b.import;
+	result.importCount = a.importCount + sign * b.importCount;
+	if (result.importCount == 0) result.import = UINT32_MAX;
+	return true;
+}
+
+// work out whether an operand field needs a relocation; a byte can only take the low or high byte of an address
+bool fieldRelocation(const vector<ExprNode>& nodes, uint32_t root, bool isAddress, const SymbolTable& tags, const StringInterner& names,
+	uint32_t line, bool& needed, Relocation& relocation)
+{
+	// tag % 256, tag & 255, tag / 256 or tag >> 8 select a byte of an address
+	const ExprNode& expr = nodes[root];
+	int divisor = expr.type >= ExprNode::Multiply && nodes[expr.right].type == ExprNode::Number ? nodes[expr.right].value : -1;
+	relocation.type = RELOC_ADDRESS;
+	if ((expr.type == ExprNode::Modulo && divisor == 256) || (expr.type == ExprNode::And && divisor == 255)) relocation.type = RELOC_LOW;
+	if ((expr.type == ExprNode::Divide && divisor == 256) || (expr.type == ExprNode::ShiftRight && divisor == 8)) relocation.type = RELOC_HIGH;
+
+	LinearValue value;
+	needed = false;
+	if (!linearValue(nodes, relocation.type == RELOC_ADDRESS ? root : expr.left, tags, value, line)) return false;
+	if (value.isConstant()) return true;
+	if (isAddress != (relocation.type == RELOC_ADDRESS)) return false;
+
+	// exactly one address, either the relocatable section or an imported tag
+	if (!((value.textCount == 1 && value.importCount == 0) || (value.textCount == 0 && value.importCount == 1))) return false;
+	relocation.target = value.importCount ? string(names.text(value.import)) : "";
+	relocation.addend = value.constant;
+	needed = true;
+	return true;
+}
+
+// an instruction or data directive in the listing, and where it went
+struct ListingEntry
+{
+	uint32_t address;
+	uint32_t size;
+	uint32_t line;
+	int16_t opcode;		// -1 for data, -2 for reserved space
+};
+
+// a tag as the map file shows it
+struct MapSymbol
+{
+	string name;
+	int value;
+	bool isLabel;
+};
+
+// buffers kept from one file to the next, so batch runs don't reallocate them
+struct Workspace
+{
+	StringInterner names;
+	vector<Token> tokens;
+	vector<Token> symbols;
+	vector<ExprNode> exprNodes;
+	vector<SourceFile> sources;
+	vector<Token> expanded;		// the tokens with the macros expanded, swapped with tokens
+	string symbolTable;			// the tags of the last file assembled, as SymbolTable::dump prints them
+	bool keepSymbolTable = false;	// fill in symbolTable even when it is not being logged
+	bool optimize = false;			// run the peephole optimizer before the layout
+	bool keepListing = false;		// fill in listing and mapSymbols
+	vector<ListingEntry> listing;	// what each line of the last program assembled to, in the order it was emitted
+	vector<MapSymbol> mapSymbols;
+	string listingText;				// the listing and map of the last file, as written to .lst and .map
+	string mapText;
+};
+
+const size_t maxIncludedFiles = 1000;
+
+// replace each .include "file" with the tokens of the file, which is found relative to the file including it
+bool expandIncludes(Workspace& work)
+{
+	vector<Token>& tokens = work.tokens;
+	vector<SourceFile>& sources = work.sources;
+	vector<Token> included;
+	for (size_t i = 0; i < tokens.size(); ++i)
+	{
+		if (!isName(tokens[i], NAME_INCLUDE)) continue;
+		uint32_t line = tokens[i].line;
+		if (i + 1 >= tokens.size() || tokens[i + 1].kind != TokenKind::String)
+		{
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(line) << ": .include needs a file name in quotes!\n";
+			return false;
+		}
+		if (sources.size() > maxIncludedFiles)
+		{
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(line) << ": too many included files, does a file include itself?\n";
+			return false;
+		}
+
+		// the file doing the including is the one whose lines contain the directive
+		size_t parent = sources.size() - 1;
+		while (parent > 0 && !(line >= sources[parent].firstLine && line < sources[parent].firstLine + sources[parent].numLines)) --parent;
+		string name(work.names.text(tokens[i + 1].value));
+		size_t directory = sources[parent].name.find_last_of("/\\");
+		if (directory != string::npos && name[0] != '/' && name[0] != '\\') name = sources[parent].name.substr(0, directory + 1) + name;
+
+		string code;
+		if (!loadFile(name, code))
+		{
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(line) << ": could not read " << name << "!\n";
+			return false;
+		}
+		uint32_t firstLine = sources.back().firstLine + sources.back().numLines;
+		sources.push_back({ name, firstLine, (uint32_t)count(code.begin(), code.end(), '\n') + 1 });
+		included.clear();
+		if (!tokenize(code, work.names, included, firstLine)) return false;
+
+		// the included tokens are scanned next, for includes of their own
+		tokens.erase(tokens.begin() + i, tokens.begin() + i + 2);
+		tokens.insert(tokens.begin() + i, included.begin(), included.end());
+		--i;
+	}
+	return true;
+}
+
+// whether an operand is a constant, along with the equates it uses, and its value if so; labels have not been placed yet
+bool constantOperand(const vector<ExprNode>& nodes, uint32_t node, const SymbolTable& tags, int& value, int depth = 0)
+{
+	const ExprNode& expr = nodes[node];
+	if (depth > maxExpressionDepth) return false;
+	if (expr.type == ExprNode::Number)
+	{
+		value = expr.value;
+		return true;
+	}
+	if (expr.type == ExprNode::Tag)
+	{
+		const TagInfo& tag = tags[expr.value];
+		return !tag.isLabel && !tag.imported && tag.state != TagInfo::Undefined && constantOperand(nodes, tag.expr, tags, value, depth + 1);
+	}
+
+	int a = 0;
+	int b = 0;
+	bool unary = expr.type == ExprNode::Negate || expr.type == ExprNode::Complement;
+	if (!constantOperand(nodes, expr.left, tags, a, depth + 1)) return false;
+	if (!unary && !constantOperand(nodes, expr.right, tags, b, depth + 1)) return false;
+	return applyOperator(expr.type, a, b, value);
+}
+
+// whether two expressions are written the same way, and so have the same value
+bool sameExpression(const vector<ExprNode>& nodes, uint32_t a, uint32_t b)
+{
+	const ExprNode& x = nodes[a];
+	const ExprNode& y = nodes[b];
+	if (x.type != y.type) return false;
+	if (x.type == ExprNode::Number || x.type == ExprNode::Tag) return x.value == y.value;
+	bool unary = x.type == ExprNode::Negate || x.type == ExprNode::Complement;
+	return sameExpression(nodes, x.left, y.left) && (unary || sameExpression(nodes, x.right, y.right));
+}
+
+// whether an expression is a label plus a constant, possibly through equates
+bool labelOffset(const vector<ExprNode>& nodes, uint32_t node, const SymbolTable& tags, uint32_t& label, int& offset, int depth = 0)
+{
+	const ExprNode& expr = nodes[node];
+	if (depth > maxExpressionDepth) return false;
+	if (expr.type == ExprNode::Tag)
+	{
+		const TagInfo& tag = tags[expr.value];
+		if (tag.isLabel)
+		{
+			label = expr.value;
+			offset = 0;
+			return true;
+		}
+		return !tag.imported && tag.state != TagInfo::Undefined && labelOffset(nodes, tag.expr, tags, label, offset, depth + 1);
+	}
+	int constant;
+	if (expr.type == ExprNode::Add && constantOperand(nodes, expr.right, tags, constant) && labelOffset(nodes, expr.left, tags, label, offset, depth + 1)) offset += constant;
+	else if (expr.type == ExprNode::Add && constantOperand(nodes, expr.left, tags, constant) && labelOffset(nodes, expr.right, tags, label, offset, depth + 1)) offset += constant;
+	else if (expr.type == ExprNode::Subtract && constantOperand(nodes, expr.right, tags, constant) && labelOffset(nodes, expr.left, tags, label, offset, depth + 1)) offset -= constant;
+	else return false;
+	return true;
+}
+
+// turn loads and ALU operations that read a byte of data the program never stores to into the immediate forms, which
+// are a byte shorter and two cycles faster: LOD digits + 2 becomes LOD !50 when digits: .string "0123456789" is never
+// written.
+// As soon as any store goes to a label in the code, the program is modifying itself and could be writing anywhere, so
+// nothing is changed.  The sizes of the data directives do not depend on where the labels end up, so this is decided
+// before the layout and the addresses only have to be worked out once
+void foldConstantLoads(vector<Token>& symbols, vector<ExprNode>& nodes, const SymbolTable& tags, const StringInterner& names)
+{
+	// runs of data directives, and which run each label starts a part of
+	enum LabelKind : uint8_t { LABEL_OTHER, LABEL_CODE, LABEL_DATA };
+	unordered_map<uint32_t, pair<LabelKind, size_t>> labels;	// the kind of each label, and for data the symbol it starts at
+	unordered_map<uint32_t, size_t> runs;						// the run of each data label, by the symbol the run starts at
+	unordered_map<uint32_t, int> reserved;						// the bytes reserved at each label followed by .reserve
+	uint32_t address = 0, end = 0;								// a layout of the code, for the highest address it reaches
+	vector<uint32_t> pending;
+	size_t run = SIZE_MAX;
+	for (size_t i = 0; i < symbols.size(); ++i)
+	{
+		const Token& symbol = symbols[i];
+		if (symbol.kind == TokenKind::Identifier && i + 1 < symbols.size() && symbols[i + 1].kind == TokenKind::LabelColon)
+		{
+			pending.push_back(symbol.value);
+			++i;
+			continue;
+		}
+		if (symbol.kind == TokenKind::Identifier && i + 1 < symbols.size() && isOperator(symbols[i + 1], '='))
+		{
+			i += 2;
+			continue;
+		}
+		bool data = (isName(symbol, NAME_BYTE) && i + 1 < symbols.size() && symbols[i + 1].kind == TokenKind::Expression) ||
+			(isName(symbol, NAME_STRING) && i + 1 < symbols.size() && symbols[i + 1].kind == TokenKind::String) ||
+			(isName(symbol, NAME_DATA) && i + 1 < symbols.size() && symbols[i + 1].kind == TokenKind::Number && symbols[i + 1].detail <= 4);
+		if (data && run == SIZE_MAX) run = i;
+		if (!data && symbol.kind != TokenKind::Expression && symbol.kind != TokenKind::String && symbol.kind != TokenKind::Number) run = SIZE_MAX;
+		int constant;
+		bool known = i + 1 < symbols.size() && symbols[i + 1].kind == TokenKind::Expression && constantOperand(nodes, symbols[i + 1].value, tags, constant);
+		if (symbol.kind == TokenKind::Mnemonic) address += instructionSize(operandMode(symbols, i));
+		else if (isName(symbol, NAME_BYTE)) ++address;
+		else if (isName(symbol, NAME_STRING) && i + 1 < symbols.size() && symbols[i + 1].kind == TokenKind::String) address += names.text(symbols[i + 1].value).size() + 1;
+		else if (isName(symbol, NAME_DATA) && i + 1 < symbols.size() && symbols[i + 1].kind == TokenKind::Number)
+			address += symbols[i + 1].detail > 4 ? (to_hex(string(names.text(symbols[i + 1].value))).size() + 1) / 2 : symbols[i + 1].detail;
+		else if (isName(symbol, NAME_RESERVE) || isName(symbol, NAME_ORG))
+		{
+			// without a constant the program could reach anywhere
+			if (!known) address = 0x10000;
+			else address = isName(symbol, NAME_RESERVE) ? address + constant : constant;
+		}
+		end = max(end, address);
+		for (uint32_t label : pending)
+		{
+			labels[label] = { data ? LABEL_DATA : symbol.kind == TokenKind::Mnemonic ? LABEL_CODE : LABEL_OTHER, i };
+			if (data) runs[label] = run;
+			if (isName(symbol, NAME_RESERVE) && known) reserved[label] = constant;
+		}
+		pending.clear();
+		if (data) ++i;
+	}
+
+	// the size of a data directive, or -1 if it is not one that can be folded
+	auto dataSize = [&](const Token& directive, const Token& operand)
+	{
+		if (isName(directive, NAME_BYTE) && operand.kind == TokenKind::Expression) return 1;
+		if (isName(directive, NAME_STRING) && operand.kind == TokenKind::String) return (int)names.text(operand.value).size() + 1;
+		if (isName(directive, NAME_DATA) && operand.kind == TokenKind::Number && operand.detail <= 4) return (int)operand.detail;
+		return -1;
+	};
+
+	// the bytes from a symbol to the end of its run of data
+	auto runSize = [&](size_t i)
+	{
+		int total = 0;
+		for (; i + 1 < symbols.size(); i += 2)
+		{
+			while (i + 1 < symbols.size() && symbols[i].kind == TokenKind::Identifier && symbols[i + 1].kind == TokenKind::LabelColon) i += 2;
+			if (i + 1 >= symbols.size()) break;
+			int size = dataSize(symbols[i], symbols[i + 1]);
+			if (size < 0) break;
+			total += size;
+		}
+		return total;
+	};
+
+	// the runs that are stored to.  Only a store to a label plus a constant that stays within the label's run (or the
+	// space it reserves), or to a constant address past the end of the program, is known to write one run or none; any
+	// other store, or one to the code, could be writing anywhere, and so can the stack when the program reaches its page
+	unordered_map<size_t, bool> written;
+	for (size_t i = 0; i + 1 < symbols.size(); ++i)
+	{
+		if (symbols[i].kind != TokenKind::Mnemonic) continue;
+		uint8_t opcode = instructionTable[symbols[i].value].opcodes[operandMode(symbols, i)];
+		uint8_t operation = opcode >> 4;
+		if (end > 0xff00 && (opcode == 0x80 || operation == 0x4 || operation == 0xd))
+		{
+			LOG(LOG_VERBOSE, LOG_EMIT) << "constant loads: the stack may reach data placed in its page, so none are folded\n";
+			return;
+		}
+		if (opcode != 0x70) continue;
+
+		uint32_t label;
+		int offset;
+		auto found = labels.end();
+		if (labelOffset(nodes, symbols[i + 1].value, tags, label, offset) && offset >= 0) found = labels.find(label);
+		if (found != labels.end() && found->second.first == LABEL_DATA && offset < runSize(found->second.second))
+		{
+			written[runs[label]] = true;
+			continue;
+		}
+		if (found != labels.end() && found->second.first == LABEL_OTHER && reserved.count(label) && offset < reserved[label]) continue;
+		int constant;
+		if (constantOperand(nodes, symbols[i + 1].value, tags, constant) && (uint32_t)constant >= end) continue;
+		LOG(LOG_VERBOSE, LOG_EMIT) << "constant loads: the program " << (found != labels.end() && found->second.first == LABEL_CODE ?
+			"modifies its code" : "stores to an address that may hold data") << ", so none are folded\n";
+		return;
+	}
+
+	// the expression giving a byte of a run of data, or -1 past the end of the run
+	auto dataByte = [&](size_t i, int offset)
+	{
+		for (; i + 1 < symbols.size(); i += 2)
+		{
+			while (i + 1 < symbols.size() && symbols[i].kind == TokenKind::Identifier && symbols[i + 1].kind == TokenKind::LabelColon) i += 2;
+			if (i + 1 >= symbols.size()) break;
+			const Token& directive = symbols[i];
+			const Token& operand = symbols[i + 1];
+			int size = dataSize(directive, operand);
+			if (size < 0) break;
+			if (offset == 0 && isName(directive, NAME_BYTE)) return (int)operand.value;
+			if (offset < size && !isName(directive, NAME_BYTE))
+			{
+				int value = isName(directive, NAME_STRING) ? (offset + 1 < size ? (uint8_t)names.text(operand.value)[offset] : 0) :
+					(operand.value >> (8 * (size - 1 - offset))) & 0xff;
+				nodes.push_back({ ExprNode::Number, 0, value, 0, 0 });
+				return (int)nodes.size() - 1;
+			}
+			offset -= size;
+		}
+		return -1;
+	};
+
+	// rewrite the loads, putting a '!' in front of the operand
+	size_t folded = 0;
+	vector<Token> rewritten;
+	rewritten.reserve(symbols.size());
+	for (size_t i = 0; i < symbols.size(); ++i)
+	{
+		rewritten.push_back(symbols[i]);
+		if (symbols[i].kind != TokenKind::Mnemonic || operandMode(symbols, i) != MODE_ADDRESS) continue;
+		uint8_t opcode = instructionTable[symbols[i].value].opcodes[MODE_ADDRESS];
+		if (opcode != 0x50 && (opcode & 0xf0) != 0x10) continue;
+
+		uint32_t label;
+		int offset;
+		if (!labelOffset(nodes, symbols[i + 1].value, tags, label, offset) || offset < 0) continue;
+		auto found = labels.find(label);
+		if (found == labels.end() || found->second.first != LABEL_DATA || written[runs[label]]) continue;
+		int byte = dataByte(found->second.second, offset);
+		if (byte < 0) continue;
+
+		Token immediate = symbols[i + 1];
+		immediate.kind = TokenKind::Operator;
+		immediate.value = '!';
+		rewritten.push_back(immediate);
+		rewritten.push_back(symbols[++i]);
+		rewritten.back().value = byte;
+		++folded;
+	}
+	symbols.swap(rewritten);
+
+	LOG(LOG_VERBOSE, LOG_EMIT) << "constant loads: " << folded << " folded into immediates, " << folded << " bytes and " << 2 * folded << " cycles saved\n";
+}
+
+// the instruction with the given encoding in address mode, or -1
+int findAddressInstruction(uint8_t opcode)
+{
+	for (int i = 0; i < numInstructions; ++i)
+		if ((instructionTable[i].modes & modeBit(MODE_ADDRESS)) && instructionTable[i].opcodes[MODE_ADDRESS] == opcode) return i;
+	return -1;
+}
+
+// an instruction, or a directive or one of its operands, as the peephole optimizer sees the symbols
+struct PeepholeStep
+{
+	size_t first;			// its first symbol
+	size_t numSymbols;
+	int opcode;				// the instruction's encoding, -1 for directives
+	uint32_t operand;		// expression of an address or immediate operand
+	uint32_t firstLabel;	// the labels placed right before it
+	uint32_t numLabels;
+};
+
+const int peepholeLookahead = 64;
+
+// rewrite redundant instruction sequences in the symbols before the layout, so the labels are placed as if the code had
+// been written that way:
+//	STO x, LOD x				the value is still in the accumulator, and neither changes the flags
+//	ADD !0 etc.					an ALU operation that leaves the accumulator alone, when its flags are not used
+//	JMP next					a jump to the instruction after it
+//	BRc skip, JMP x, skip:		becomes BNc x (and BNc skip becomes BRc x)
+// an instruction with a label is never removed, as code may jump to it or modify it
+void optimize(vector<Token>& symbols, const vector<ExprNode>& nodes, const SymbolTable& tags)
+{
+	vector<PeepholeStep> steps;
+	vector<uint32_t> labels;
+	vector<bool> removed;
+	size_t rewrites = 0;
+	size_t bytesSaved = 0;
+
+	// a rewrite can expose another, so keep going until nothing changes
+	for (bool changed = true; changed;)
+	{
+		changed = false;
+
+		// split the symbols into steps, skipping equates and collecting the labels before each step
+		steps.clear();
+		labels.clear();
+		uint32_t firstLabel = 0;
+		for (size_t i = 0; i < symbols.size();)
+		{
+			const Token& symbol = symbols[i];
+			if (symbol.kind == TokenKind::Identifier && i + 1 < symbols.size() && symbols[i + 1].kind == TokenKind::LabelColon)
+			{
+				labels.push_back(symbol.value);
+				i += 2;
+				continue;
+			}
+			if (symbol.kind == TokenKind::Identifier && i + 1 < symbols.size() && isOperator(symbols[i + 1], '='))
+			{
+				i += 3;
+				continue;
+			}
+
+			PeepholeStep step = { i, 1, -1, 0, firstLabel, (uint32_t)labels.size() - firstLabel };
+			if (symbol.kind == TokenKind::Mnemonic)
+			{
+				OperandMode mode = operandMode(symbols, i);
+				const InstructionInfo& info = instructionTable[symbol.value];
+				if (info.modes & modeBit(mode)) step.opcode = info.opcodes[mode];
+				if (mode == MODE_IMMEDIATE) step.numSymbols = 3, step.operand = symbols[i + 2].value;
+				else if (mode == MODE_ADDRESS) step.numSymbols = 2, step.operand = symbols[i + 1].value;
+				else if (i + 1 < symbols.size() && symbols[i + 1].kind == TokenKind::Keyword) step.numSymbols = 2;
+			}
+			steps.push_back(step);
+			firstLabel = labels.size();
+			i += step.numSymbols;
+		}
+		steps.push_back({ symbols.size(), 0, -1, 0, firstLabel, (uint32_t)labels.size() - firstLabel });
+
+		auto labelledWith = [&](const PeepholeStep& step, uint32_t expr)
+		{
+			if (nodes[expr].type != ExprNode::Tag) return false;
+			for (uint32_t l = step.firstLabel; l < step.firstLabel + step.numLabels; ++l)
+				if (labels[l] == (uint32_t)nodes[expr].value) return true;
+			return false;
+		};
+
+		// whether the flags might be read from a step on, before an ALU operation sets them all again
+		auto flagsUsed = [&](size_t k)
+		{
+			for (size_t n = k; n < steps.size() && n < k + peepholeLookahead; ++n)
+			{
+				int later = steps[n].opcode;
+				if (later >= 0x10 && later < 0x50)
+				{
+					// ADC, SBB, RCL and RCR read the carry
+					int operation = later & 0xf;
+					return operation == 0x1 || operation == 0x3 || operation == 0xe || operation == 0xf;
+				}
+				// LOD, LDI, STO, PSH, POP and NOP leave the flags alone; anything else might read them
+				if (later < 0 || later >= 0xa0) return true;
+			}
+			return true;
+		};
+
+		removed.assign(steps.size(), false);
+		for (size_t k = 0; k + 1 < steps.size(); ++k)
+		{
+			const PeepholeStep& step = steps[k];
+			const PeepholeStep& next = steps[k + 1];
+			int opcode = step.opcode;
+			if (opcode < 0 || removed[k]) continue;
+			int value;
+
+			// STO x, LOD x, unless x is in the page of the devices, where reading does not give back what was written
+			if (opcode == 0x70 && next.opcode == 0x50 && !next.numLabels && sameExpression(nodes, step.operand, next.operand) &&
+				!(constantOperand(nodes, step.operand, tags, value) && (value & 0xff00) == 0xfe00))
+			{
+				removed[k + 1] = true;
+				bytesSaved += instructionSize(MODE_ADDRESS);
+			}
+			// an ALU operation on an immediate that leaves the accumulator as it is, when the flags it sets are not used;
+			// every ALU operation sets all four
+			else if ((opcode & 0xf0) == 0x30 && !step.numLabels && constantOperand(nodes, step.operand, tags, value) &&
+				((value & 0xff) == 0 ? (opcode == 0x30 || opcode == 0x32 || opcode == 0x37 || opcode == 0x38) : ((value & 0xff) == 0xff && opcode == 0x36)) &&
+				!flagsUsed(k + 1))
+			{
+				removed[k] = true;
+				bytesSaved += instructionSize(MODE_IMMEDIATE);
+			}
+			// JMP to the instruction after it
+			else if (opcode == 0xa0 && !step.numLabels && labelledWith(next, step.operand))
+			{
+				removed[k] = true;
+				bytesSaved += instructionSize(MODE_ADDRESS);
+			}
+			// a branch over a jump, which is the opposite branch to where the jump goes
+			else if ((opcode & 0xf0) >= 0xb0 && (opcode & 0xf0) <= 0xc0 && next.opcode == 0xa0 && !next.numLabels && k + 2 < steps.size() &&
+				labelledWith(steps[k + 2], step.operand))
+			{
+				symbols[step.first].value = findAddressInstruction(opcode ^ 0x70);
+				uint32_t line = symbols[step.first + 1].line;
+				symbols[step.first + 1] = symbols[next.first + 1];
+				symbols[step.first + 1].line = line;
+				removed[k + 1] = true;
+				bytesSaved += instructionSize(MODE_ADDRESS);
+			}
+			else continue;
+			++rewrites;
+			changed = true;
+		}
+
+		// drop the removed steps' symbols, keeping the labels
+		if (!changed) break;
+		size_t out = 0;
+		size_t k = 0;
+		for (size_t i = 0; i < symbols.size(); ++i)
+		{
+			while (k < steps.size() && steps[k].first + steps[k].numSymbols <= i) ++k;
+			if (k < steps.size() && removed[k] && i >= steps[k].first) continue;
+			symbols[out++] = symbols[i];
+		}
+		symbols.resize(out);
+	}
+
+	LOG(LOG_VERBOSE, LOG_EMIT) << "peephole: " << rewrites << " rewrites, " << bytesSaved << " bytes saved\n";
+}
+
+const int maxMacroDepth = 64;
+const size_t maxExpandedTokens = 1 << 24;
+
+// a macro defined with .macro, kept as ranges of the expander's lists
+struct MacroInfo
+{
+	uint32_t name;
+	uint32_t firstToken, numTokens;			// the body, in MacroExpander::bodies
+	uint32_t firstParameter, numParameters;	// the parameter names, in MacroExpander::names
+	uint32_t firstLocal, numLocals;			// the labels the body defines, renamed for each use
+};
+
+// expands .macro, .rept and .if at the token level; a macro body is stored once and copied to the output for each use with
+// its parameters replaced by the argument tokens, so the work done is proportional to the size of the output.  A directive
+// takes the rest of its line, and a macro is used by putting its name at the start of a line, followed by its arguments
+// separated by commas
+class MacroExpander
+{
+public:
+	MacroExpander(StringInterner& names) : interner(names), scratch(maxMacroDepth + 1) {}
+
+	bool run(vector<Token>& tokens, vector<Token>& expanded)
+	{
+		// most sources use none of these, and are left as they are
+		bool used = false;
+		for (const Token& token : tokens)
+			used |= token.kind == TokenKind::Directive && token.value >= NAME_MACRO && token.value <= NAME_ENDIF;
+		if (!used) return true;
+
+		output = &expanded;
+		output->clear();
+		output->reserve(tokens.size());
+		if (!expand(tokens, 0, tokens.size(), 0, 0)) return false;
+		tokens.swap(expanded);
+		return true;
+	}
+
+private:
+	// the end of the line starting at begin
+	static size_t lineEnd(const vector<Token>& source, size_t begin, size_t end)
+	{
+		size_t i = begin + 1;
+		while (i < end && source[i].line == source[begin].line) ++i;
+		return i;
+	}
+
+	// the directive closing a block, skipping blocks of the same kind nested inside it; end if there is none
+	static size_t blockEnd(const vector<Token>& source, size_t begin, size_t end, uint32_t open, uint32_t close)
+	{
+		int depth = 1;
+		for (size_t i = begin; i < end; ++i)
+		{
+			if (isName(source[i], open)) ++depth;
+			else if (isName(source[i], close) && --depth == 0) return i;
+		}
+		return end;
+	}
+
+	// copy source[begin, end) to the output, expanding as it goes; line is the line the output is attributed to, 0 to keep
+	// the lines of the source
+	bool expand(const vector<Token>& source, size_t begin, size_t end, uint32_t line, int depth)
+	{
+		struct Conditional
+		{
+			uint32_t line;
+			bool enclosing;		// whether the code around the .if is assembled
+			bool taken;			// whether a branch has been assembled
+			bool inElse;
+		};
+		vector<Conditional> conditionals;
+		bool active = true;
+
+		for (size_t i = begin; i < end;)
+		{
+			Token token = source[i];
+			uint32_t where = line ? line : token.line;
+
+			// conditional assembly, which is followed even in code that is skipped so the .endif can be matched
+			if (isName(token, NAME_IF))
+			{
+				size_t next = lineEnd(source, i, end);
+				int value = 0;
+				if (active && !constantValue(source, i + 1, next, token, true, value)) return false;
+				conditionals.push_back({ where, active, active && value != 0, false });
+				active = conditionals.back().taken;
+				i = next;
+				continue;
+			}
+			if (isName(token, NAME_ELSE) || isName(token, NAME_ENDIF))
+			{
+				if (conditionals.empty() || (isName(token, NAME_ELSE) && conditionals.back().inElse))
+				{
+					LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(where) << ": " << interner.text(token.value) << " without .if!\n";
+					return false;
+				}
+				Conditional& conditional = conditionals.back();
+				if (isName(token, NAME_ELSE))
+				{
+					active = conditional.enclosing && !conditional.taken;
+					conditional.taken = true;
+					conditional.inElse = true;
+				}
+				else
+				{
+					active = conditional.enclosing;
+					conditionals.pop_back();
+				}
+				++i;
+				continue;
+			}
+			if (!active)
+			{
+				++i;
+				continue;
+			}
+
+			// definitions
+			if (isName(token, NAME_MACRO))
+			{
+				size_t header = lineEnd(source, i, end);
+				size_t close = blockEnd(source, header, end, NAME_MACRO, NAME_ENDM);
+				if (!defineMacro(source, i, header, close, end, where)) return false;
+				i = close + 1;
+				continue;
+			}
+			if (isName(token, NAME_REPT))
+			{
+				size_t header = lineEnd(source, i, end);
+				size_t close = blockEnd(source, header, end, NAME_REPT, NAME_ENDR);
+				if (close == end)
+				{
+					LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(where) << ": .rept without .endr!\n";
+					return false;
+				}
+				int count;
+				if (!constantValue(source, i + 1, header, token, true, count)) return false;
+				for (int n = 0; n < count; ++n)
+					if (!expand(source, header, close, line, depth + 1)) return false;
+				i = close + 1;
+				continue;
+			}
+			if (isName(token, NAME_ENDM) || isName(token, NAME_ENDR))
+			{
+				LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(where) << ": " << interner.text(token.value) << " without "
+					<< (isName(token, NAME_ENDM) ? ".macro" : ".rept") << "!\n";
+				return false;
+			}
+
+			// equates with constant values can be used by .if and .rept further on
+			bool definition = i + 1 < end && (source[i + 1].kind == TokenKind::LabelColon || isOperator(source[i + 1], '='));
+			if (token.kind == TokenKind::Identifier && definition && isOperator(source[i + 1], '='))
+			{
+				int value;
+				if (constantValue(source, i + 2, lineEnd(source, i, end), token, false, value)) constants[token.value] = value;
+				else constants.erase(token.value);
+			}
+
+			// uses of macros, which start a line or follow a label
+			bool statementStart = i == begin || source[i - 1].line != token.line || source[i - 1].kind == TokenKind::LabelColon;
+			auto macro = token.kind == TokenKind::Identifier && statementStart && !definition ? macros.find(token.value) : macros.end();
+			if (macro != macros.end())
+			{
+				size_t next = lineEnd(source, i, end);
+				if (!invoke(macro->second, source, i + 1, next, where, depth)) return false;
+				i = next;
+				continue;
+			}
+
+			if (output->size() >= maxExpandedTokens)
+			{
+				LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(where) << ": macros expand to too much code!\n";
+				return false;
+			}
+			token.line = where;
+			output->push_back(token);
+			++i;
+		}
+
+		if (!conditionals.empty())
+		{
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(conditionals.back().line) << ": .if without .endif!\n";
+			return false;
+		}
+		return true;
+	}
+
+	// store the macro defined from source[i] up to its .endm at close
+	bool defineMacro(const vector<Token>& source, size_t i, size_t header, size_t close, size_t end, uint32_t where)
+	{
+		if (close == end)
+		{
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(where) << ": .macro without .endm!\n";
+			return false;
+		}
+		if (i + 1 >= header || source[i + 1].kind != TokenKind::Identifier)
+		{
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(where) << ": .macro needs a name!\n";
+			return false;
+		}
+
+		MacroInfo macro;
+		macro.name = source[i + 1].value;
+		macro.firstParameter = names.size();
+		for (size_t p = i + 2; p < header; ++p)
+		{
+			if (isOperator(source[p], ',')) continue;
+			if (source[p].kind != TokenKind::Identifier)
+			{
+				LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(where) << ": the parameters of a macro have to be names!\n";
+				return false;
+			}
+			names.push_back(source[p].value);
+		}
+		macro.numParameters = names.size() - macro.firstParameter;
+
+		macro.firstToken = bodies.size();
+		bodies.insert(bodies.end(), source.begin() + header, source.begin() + close);
+		macro.numTokens = close - header;
+
+		macro.firstLocal = names.size();
+		for (size_t b = header; b + 1 < close; ++b)
+			if (source[b].kind == TokenKind::Identifier && source[b + 1].kind == TokenKind::LabelColon) names.push_back(source[b].value);
+		macro.numLocals = names.size() - macro.firstLocal;
+
+		// a later definition replaces an earlier one
+		macros[macro.name] = macro;
+		return true;
+	}
+
+	// expand a use of a macro with the arguments in source[begin, end)
+	bool invoke(MacroInfo macro, const vector<Token>& source, size_t begin, size_t end, uint32_t line, int depth)
+	{
+		if (depth >= maxMacroDepth)
+		{
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(line) << ": macros are nested too deeply, does the macro " << interner.text(macro.name) << " use itself?\n";
+			return false;
+		}
+
+		// the arguments are separated by the commas outside parentheses
+		arguments.clear();
+		size_t start = begin;
+		int parentheses = 0;
+		for (size_t k = begin; k < end; ++k)
+		{
+			if (isOperator(source[k], '(')) ++parentheses;
+			else if (isOperator(source[k], ')')) --parentheses;
+			else if (isOperator(source[k], ',') && parentheses == 0)
+			{
+				arguments.push_back({ start, k });
+				start = k + 1;
+			}
+		}
+		if (end > begin) arguments.push_back({ start, end });
+		if (arguments.size() != macro.numParameters)
+		{
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(line) << ": " << interner.text(macro.name) << " takes " << macro.numParameters
+				<< " arguments, not " << arguments.size() << "!\n";
+			return false;
+		}
+
+		// each use gets its own copy of the labels in the body; '@' cannot be written in a name, so they cannot clash
+		++expansions;
+		localNames.resize(macro.numLocals);
+		for (uint32_t l = 0; l < macro.numLocals; ++l)
+			localNames[l] = interner.intern(string(interner.text(names[macro.firstLocal + l])) + "@" + to_string(expansions));
+
+		vector<Token>& body = scratch[depth + 1];
+		body.clear();
+		for (uint32_t k = macro.firstToken; k < macro.firstToken + macro.numTokens; ++k)
+		{
+			Token token = bodies[k];
+			if (token.kind == TokenKind::Identifier)
+			{
+				uint32_t p = 0;
+				while (p < macro.numParameters && names[macro.firstParameter + p] != token.value) ++p;
+				if (p < macro.numParameters)
+				{
+					// the argument takes the place of the parameter in its line, so it stays part of the statement
+					for (size_t a = arguments[p].first; a < arguments[p].second; ++a)
+					{
+						body.push_back(source[a]);
+						body.back().line = token.line;
+					}
+					continue;
+				}
+				uint32_t l = 0;
+				while (l < macro.numLocals && names[macro.firstLocal + l] != token.value) ++l;
+				if (l < macro.numLocals) token.value = localNames[l];
+			}
+			body.push_back(token);
+		}
+		return expand(body, 0, body.size(), line, depth + 1);
+	}
+
+	// the value of a constant expression in source[begin, end), which can use the equates with constant values defined so
+	// far; reports an error if it is required
+	bool constantValue(const vector<Token>& source, size_t begin, size_t end, const Token& directive, bool required, int& value)
+	{
+		expression.clear();
+		bool constant = true;
+		for (size_t k = begin; k < end; ++k)
+		{
+			Token token = source[k];
+			if (token.kind == TokenKind::Identifier)
+			{
+				auto known = constants.find(token.value);
+				if (known == constants.end()) constant = false;
+				else
+				{
+					token.kind = TokenKind::Number;
+					token.detail = 4;
+					token.value = known->second;
+				}
+			}
+			else if (token.kind != TokenKind::Number && token.kind != TokenKind::Operator) constant = false;
+			expression.push_back(token);
+		}
+		if (!required && (!constant || expression.empty())) return false;
+		if (expression.empty())
+		{
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(directive.line) << ": " << interner.text(directive.value) << " needs a value!\n";
+			return false;
+		}
+
+		nodes.clear();
+		ExpressionParser parser = { expression, nodes, 0, 0 };
+		int root = parser.parse();
+		if (root < 0) return false;
+		if (parser.i != expression.size() || nodes[root].type != ExprNode::Number)
+		{
+			if (required)
+			{
+				LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(directive.line) << ": " << interner.text(directive.value)
+					<< " needs a constant, only numbers and equates of numbers can be used!\n";
+			}
+			return false;
+		}
+		value = nodes[root].value;
+		return true;
+	}
+
+	StringInterner& interner;
+	vector<Token>* output = nullptr;
+	unordered_map<uint32_t, MacroInfo> macros;
+	unordered_map<uint32_t, int> constants;		// equates with constant values, by name
+	vector<Token> bodies;
+	vector<uint32_t> names;						// parameters and local labels of the macros
+	vector<vector<Token>> scratch;				// the body of the macro being expanded at each depth
+	vector<pair<size_t, size_t>> arguments;
+	vector<uint32_t> localNames;
+	vector<Token> expression;
+	vector<ExprNode> nodes;
+	uint32_t expansions = 0;
+};
+
+// assemble into a memory image, or with an object module given, into a module for the linker
+bool assemble(string_view asmCode, const string& sourceName, Workspace& work, MemoryImage& image, ObjectModule* object = nullptr)
+{
+	if (asmCode.empty()) return false;
+
+	// DEBUG: output initial code file
+	LOG(LOG_DEBUG, LOG_LEXER) << "\nASSEMBLY CODE: \n\n" << asmCode << "\n\n";
+
+	// split the source into tokens
+	StringInterner& names = work.names;
+	vector<Token>& tokens = work.tokens;
+	names.clear();
+	tokens.clear();
+	work.sources.assign(1, { sourceName, 1, (uint32_t)count(asmCode.begin(), asmCode.end(), '\n') + 1 });
+	work.listing.clear();
+	work.mapSymbols.clear();
+	logger.sources = &work.sources;
+	if (!tokenize(asmCode, names, tokens) || !expandIncludes(work) || !MacroExpander(names).run(tokens, work.expanded)) return false;
+
+	// generate symbols, replacing each operand expression with its syntax tree
+	vector<Token>& symbols = work.symbols;
+	vector<ExprNode>& exprNodes = work.exprNodes;
+	symbols.clear();
+	exprNodes.clear();
+	symbols.reserve(tokens.size());
+	for (size_t i = 0; i < tokens.size();)
+	{
+		const Token& token = tokens[i];
+		bool definition = token.kind == TokenKind::Identifier && i + 1 < tokens.size() &&
+			(tokens[i + 1].kind == TokenKind::LabelColon || isOperator(tokens[i + 1], '='));
+		bool dataOperand = token.kind == TokenKind::Number && !symbols.empty() && isName(symbols.back(), NAME_DATA);
+
+		if (!definition && !dataOperand && (token.kind == TokenKind::Number || token.kind == TokenKind::Identifier ||
+			isOperator(token, '(') || isOperator(token, '-') || isOperator(token, '+') || isOperator(token, '~')))
+		{
+			ExpressionParser parser = { tokens, exprNodes, i, 0 };
+			int root = parser.parse();
+			if (root < 0) return false;
+			i = parser.i;
+
+			Token exprToken = token;
+			exprToken.kind = TokenKind::Expression;
+			exprToken.value = root;
+			symbols.push_back(exprToken);
+			continue;
+		}
+		if (token.kind == TokenKind::Operator && !isOperator(token, '!') && !isOperator(token, '='))
+		{
+			LOG(LOG_ERROR, LOG_LEXER) << "ERROR: " << logger.where(token.line) << ":" << token.column << ": unexpected '" << (char)token.value << "'!\n";
+			return false;
+		}
+		symbols.push_back(token);
+		++i;
+	}
+
+	// DEBUG: output symbols
+	if (logger.enabled(LOG_DEBUG, LOG_LEXER))
+	{
+		logger.stream << "SYMBOLS:\n\n";
+		for (const Token& symbol : symbols)
+		{
+			printToken(symbol, names, exprNodes, logger.stream);
+			logger.stream << "\n";
+		}
+		logger.stream << "\n";
+	}
+
+	// declare every tag up front, so uses can be checked against definitions anywhere in the file
+	SymbolTable tags(names.size());
+	for (size_t i = 0; i + 1 < symbols.size(); ++i)
+	{
+		const Token& symbol = symbols[i];
+		if (symbol.kind != TokenKind::Identifier) continue;
+		if (symbols[i + 1].kind == TokenKind::LabelColon)
+		{
+			if (!tags.declareLabel(symbol.value, symbol.line, names)) return false;
+		}
+		else if (isOperator(symbols[i + 1], '='))
+		{
+			if (i + 2 >= symbols.size() || symbols[i + 2].kind != TokenKind::Expression)
+			{
+				LOG(LOG_ERROR, LOG_SYMBOLS) << "ERROR: " << logger.where(symbol.line) << ": tag " << names.text(symbol.value) << " has no value!\n";
+				return false;
+			}
+			if (!tags.declareEquate(symbol.value, symbols[i + 2].value, symbol.line, exprNodes, names)) return false;
+		}
+	}
+	if (object) tags.declareImports(exprNodes);
+	if (work.optimize && !object) foldConstantLoads(symbols, exprNodes, tags, names);
+	if (work.optimize) optimize(symbols, exprNodes, tags);
+
+	// directly defined tags; in an object module, the labels before the first .org are offsets into its relocatable section
+	int value;
+	int address = 0;
+	bool inText = object != nullptr;
+	for (size_t i = 0; i < symbols.size(); ++i)
+	{
+		const Token& symbol = symbols[i];
+		bool hasOperand = i + 1 < symbols.size();
+		const Token& operand = hasOperand ? symbols[i + 1] : symbol;
+
+		// tag definitions
+		if (symbol.kind == TokenKind::Identifier && hasOperand && operand.kind == TokenKind::LabelColon)
+		{
+			tags.placeLabel(symbol.value, address, inText);
+			LOG(LOG_DEBUG, LOG_SYMBOLS) << "ADDRESS ADDED TO TAG: " << address << "\n";
+			++i;
+			continue;
+		}
+		if (symbol.kind == TokenKind::Identifier && hasOperand && isOperator(operand, '='))
+		{
+			i += 2;
+			continue;
+		}
+		// update the address based on instruction byte-size
+		if (symbol.kind == TokenKind::Mnemonic)
+		{
+			OperandMode mode = operandMode(symbols, i);
+			const InstructionInfo& info = instructionTable[symbol.value];
+			if (mode == MODE_IMPLIED && !(info.modes & modeBit(mode)))
+			{
+				LOG(LOG_ERROR, LOG_SYMBOLS) << "ERROR: " << logger.where(symbol.line) << ": " << info.mnemonic << " needs an operand!\n";
+				return false;
+			}
+			if (!(info.modes & modeBit(mode)))
+			{
+				LOG(LOG_ERROR, LOG_SYMBOLS) << "ERROR: " << logger.where(symbol.line) << ": " << info.mnemonic << " does not take " << operandModeNames[mode] << " operand!\n";
+				return false;
+			}
+			symbols[i].detail = mode;
+			address += instructionSize(mode);
+		}
+		if ((isName(symbol, NAME_RESERVE) || isName(symbol, NAME_ORG)))
+		{
+			// later addresses depend on this, so it can only use equates and the labels placed so far
+			if (operand.kind != TokenKind::Expression)
+			{
+				LOG(LOG_ERROR, LOG_SYMBOLS) << "ERROR: " << logger.where(symbol.line) << ": " << names.text(symbol.value) << " needs a constant operand!\n";
+				return false;
+			}
+			LinearValue linear;
+			if (object && (!linearValue(exprNodes, operand.value, tags, linear, symbol.line) || !linear.isConstant()))
+			{
+				LOG(LOG_ERROR, LOG_SYMBOLS) << "ERROR: " << logger.where(symbol.line) << ": " << names.text(symbol.value) << " cannot depend on where the linker places code!\n";
+				return false;
+			}
+			if (!tags.evaluateExpression(exprNodes, operand.value, operand.line, names, value)) return false;
+			if (isName(symbol, NAME_RESERVE)) address += value;
+			else
 			{
-				symbols[i] = to_string(integer(symbols[i - 1]) + integer(symbols[i + 1]));
-				symbols.erase(symbols.begin() + i + 1);
-				symbols.erase(symbols.begin() + i - 1);
-				--i;
-				progress = true;
+				address = value;
+				inText = false;
 			}
-			if (symbols[i] == "-" && isInteger(symbols[i - 1]) && isInteger(symbols[i + 1]))
+		}
+		if (isName(symbol, NAME_BYTE) && hasOperand)
+			++address;
+		if (isName(symbol, NAME_STRING) && operand.kind == TokenKind::String)
+			address += names.text(operand.value).size() + 1;
+		if (isName(symbol, NAME_DATA))
+		{
+			// the size is how many digits the literal was written with, which an expression doesn't have
+			if (operand.kind != TokenKind::Number)
+			{
+				LOG(LOG_ERROR, LOG_SYMBOLS) << "ERROR: " << logger.where(symbol.line) << ": .data needs a number written out, not an expression!\n";
+				return false;
+			}
+			if (operand.detail > 4) address += (to_hex(string(names.text(operand.value))).size() + 1) / 2;
+			else address += operand.detail;
+		}
+	}
+
+	// indirectly defined tags, resolved in dependency order; resolving folds the equates, so object modules keep a copy to work out relocations from
+	vector<ExprNode> unfolded;
+	if (object) unfolded = exprNodes;
+	if (!tags.resolveAll(exprNodes, names)) return false;
+
+	// the fields the linker has to patch, and the tags it can link other modules against
+	vector<Relocation> relocations;
+	vector<int> fieldRelocations;
+	if (object)
+	{
+		fieldRelocations.assign(symbols.size(), -1);
+		for (size_t i = 0; i + 1 < symbols.size(); ++i)
+		{
+			const Token& symbol = symbols[i];
+			size_t field = i + 1;
+			bool isAddress = false;
+			if (symbol.kind == TokenKind::Mnemonic && symbol.detail == MODE_ADDRESS) isAddress = true;
+			else if (symbol.kind == TokenKind::Mnemonic && symbol.detail == MODE_IMMEDIATE) field = i + 2;
+			else if (isName(symbol, NAME_GLOBAL) && symbols[field].kind == TokenKind::Expression && unfolded[symbols[field].value].type == ExprNode::Tag)
+			{
+				uint32_t id = unfolded[symbols[field].value].value;
+				LinearValue linear;
+				if (tags[id].imported || !linearValue(unfolded, symbols[field].value, tags, linear, symbol.line) || linear.textCount > 1 || linear.importCount)
+				{
+					LOG(LOG_ERROR, LOG_SYMBOLS) << "ERROR: " << logger.where(symbol.line) << ": tag " << names.text(id) << " cannot be exported!\n";
+					return false;
+				}
+				object->symbols.push_back({ string(names.text(id)), linear.textCount == 1, linear.constant });
+				continue;
+			}
+			else if (!isName(symbol, NAME_BYTE)) continue;
+			if (field >= symbols.size() || symbols[field].kind != TokenKind::Expression) continue;
+
+			bool needed;
+			Relocation relocation;
+			if (!fieldRelocation(unfolded, symbols[field].value, isAddress, tags, names, symbol.line, needed, relocation))
+			{
+				LOG(LOG_ERROR, LOG_SYMBOLS) << "ERROR: " << logger.where(symbol.line) << ": this operand cannot be relocated, only an address plus a constant"
+					<< (isAddress ? "" : ", or its low or high byte,") << " can be!\n";
+				return false;
+			}
+			if (!needed) continue;
+			fieldRelocations[field] = relocations.size();
+			relocations.push_back(relocation);
+		}
+	}
+
+	// DEBUG: output all tag definitions
+	work.symbolTable.clear();
+	if (work.keepSymbolTable || logger.enabled(LOG_DEBUG, LOG_RESOLVE))
+	{
+		ostringstream symbolTable;
+		tags.dump(symbolTable, names);
+		work.symbolTable = symbolTable.str();
+	}
+	LOG(LOG_DEBUG, LOG_RESOLVE) << "TAG DEFINITIONS:\n\n" << work.symbolTable << "\n";
+
+	// evaluate the operands
+	for (Token& symbol : symbols)
+	{
+		if (symbol.kind != TokenKind::Expression) continue;
+		if (!tags.evaluateExpression(exprNodes, symbol.value, symbol.line, names, value)) return false;
+		symbol.kind = TokenKind::Number;
+		symbol.detail = 4;
+		symbol.value = value;
+	}
+	if (work.keepListing)
+	{
+		for (uint32_t id : tags.resolutionOrder())
+			if (!tags[id].imported) work.mapSymbols.push_back({ string(names.text(id)), tags[id].value, tags[id].isLabel });
+	}
+
+	// DEBUG: output code for assembly
+	if (logger.enabled(LOG_DEBUG, LOG_EMIT))
+	{
+		logger.stream << "CODE FOR ASSEMBLY: \n";
+		for (const Token& symbol : symbols)
+		{
+			if (symbol.kind == TokenKind::Mnemonic || symbol.kind == TokenKind::Directive) logger.stream << "\n";
+			printToken(symbol, names, exprNodes, logger.stream);
+			logger.stream << "\t";
+		}
+		logger.stream << "\n\n";
+	}
+
+	// assemble the machine code, an object module's relocatable section into a memory image of its own
+	MemoryImage* out = object ? &object->text : &image;
+	auto relocate = [&](size_t field)
+	{
+		if (!object || fieldRelocations[field] < 0) return;
+		Relocation relocation = relocations[fieldRelocations[field]];
+		relocation.inText = out == &object->text;
+		relocation.address = out->position();
+		object->relocations.push_back(relocation);
+	};
+	for (int i = 0; i < symbols.size(); ++i)
+	{
+		uint32_t start = out->position();
+		if (symbols[i].kind == TokenKind::Mnemonic)
+		{
+			OperandMode mode = (OperandMode)symbols[i].detail;
+			out->emit(instructionTable[symbols[i].value].opcodes[mode]);
+			if (mode == MODE_IMMEDIATE)
 			{
-				symbols[i] = to_string(integer(symbols[i - 1]) - integer(symbols[i + 1]));
-				symbols.erase(symbols.begin() + i + 1);
-				symbols.erase(symbols.begin() + i - 1);
-				--i;
-				progress = true;
+				relocate(i + 2);
+				out->emit(symbols[i + 2].value);
 			}
-			if (isInteger(symbols[i]) && i > 0 && symbols[i - 1] == "(" && i < symbols.size() - 1 && symbols[i + 1] == ")")
+			if (mode == MODE_ADDRESS)
 			{
-				symbols.erase(symbols.begin() + i + 1);
-				symbols.erase(symbols.begin() + i - 1);
-				--i;
-				progress = true;
+				relocate(i + 1);
+				out->emitAddress(symbols[i + 1].value);
 			}
 		}
 
-		if (!progress && numUndefined)
+		// memory directives
+		else if (isName(symbols[i], NAME_RESERVE) && i < symbols.size() - 1 && symbols[i + 1].kind == TokenKind::Number)
 		{
-			cout << "ERROR: " << numUndefined << " undefined tag" << (numUndefined > 1 ? "s" : "") << "!" << endl;
-			for (int i = 0; i < symbols.size(); ++i)
-			{
-				if (symbols[i] == "=") cout << "\t" << symbols[i - 1] << endl;
-			}
-			cout << endl;
-			cout << "CODE TO THIS POINT" << endl << endl;
-			for (int i = 0; i < symbols.size(); ++i)
+			out->reserve(symbols[i + 1].value);
+		}
+		else if (isName(symbols[i], NAME_ORG) && i < symbols.size() - 1 && symbols[i + 1].kind == TokenKind::Number)
+		{
+			out = &image;
+			out->org(symbols[i + 1].value);
+		}
+		else if (isName(symbols[i], NAME_BYTE) && i < symbols.size() - 1 && symbols[i + 1].kind == TokenKind::Number)
+		{
+			relocate(i + 1);
+			out->emit(symbols[i + 1].value);
+		}
+		else if (isName(symbols[i], NAME_STRING) && i < symbols.size() - 1 && symbols[i + 1].kind == TokenKind::String)
+		{
+			for (char c : names.text(symbols[i + 1].value)) out->emit(c);
+			out->emit(0); // null terminator
+		}
+		else if (isName(symbols[i], NAME_DATA) && i < symbols.size() - 1 && symbols[i + 1].kind == TokenKind::Number)
+		{
+			// data is stored big-endian, in as many bytes as the literal was written with
+			const Token& data = symbols[i + 1];
+			if (data.detail > 4)
 			{
-				cout << symbols[i] << endl;
+				string hexData = to_hex(string(names.text(data.value)));
+				if (hexData.size() % 2) hexData = "0" + hexData;
+				for (size_t digit = 0; digit < hexData.size(); digit += 2)
+					out->emit(hexValue(hexData[digit]) << 4 | hexValue(hexData[digit + 1]));
 			}
-			return "";
+			else for (int byte = data.detail - 1; byte >= 0; --byte) out->emit(data.value >> (8 * byte));
 		}
-	}
+		else continue;
 
-	// DEBUG: output all tag definitions
+		if (!out->good())
+		{
+			if (out->position() >= MemoryImage::addressSpace)
+				LOG(LOG_ERROR, LOG_EMIT) << "ERROR: " << logger.where(symbols[i].line) << ": code runs past the end of memory!\n";
+			else
+				LOG(LOG_ERROR, LOG_EMIT) << "ERROR: " << logger.where(symbols[i].line) << ": address " << out->position() << " is already in use, this would overwrite previous data!\n";
+			return false;
+		}
+		if (work.keepListing && !isName(symbols[i], NAME_ORG))
+		{
+			int16_t opcode = symbols[i].kind == TokenKind::Mnemonic ? instructionTable[symbols[i].value].opcodes[symbols[i].detail] : isName(symbols[i], NAME_RESERVE) ? -2 : -1;
+			work.listing.push_back({ start, out->position() - start, symbols[i].line, opcode });
+		}
+	}
+	return true;
+}
 
-	cout << "TAG DEFINITIONS:" << endl << endl;
-	for (auto it = tags.begin(); it != tags.end(); ++it)
-		cout << "\ttag: " << it->first << "\tdef: " << it->second << endl;
-	cout << endl;
+// the clock cycles of an instruction in the listing as text, both counts for a branch
+string cycleText(int opcode)
+{
+	if (opcode < 0) return "";
+	int cycles = cycleCounts[opcode >> 4];
+	if ((opcode >> 4) == 0xb || (opcode >> 4) == 0xc) return to_string(cycles) + "/" + to_string(cycles + branchNotTakenCycles);
+	return to_string(cycles);
+}
 
-	// remove any extra parentheses
-	for (int i = 0; i < symbols.size(); ++i)
+// the listing of a program: every source line with the address, bytes and clock cycles of the code it assembled to.
+// The lines are followed in the order their code was emitted, so an included file is listed where it was included;
+// a line that assembled to several instructions, like the use of a macro, is followed by the rest of them
+string listingText(const Workspace& work, const MemoryImage& image, string_view asmCode)
+{
+	const vector<SourceFile>& sources = work.sources;
+	vector<string> files(sources.size());
+	vector<vector<string_view>> lines(sources.size());
+	files[0] = asmCode;
+	for (size_t f = 0; f < sources.size(); ++f)
 	{
-		if (symbols[i] == "(" || symbols[i] == ")")
+		if (f > 0) loadFile(sources[f].name, files[f]);
+		string_view text = files[f];
+		for (size_t start = 0; start < text.size() || (start == 0 && text.empty());)
 		{
-			symbols.erase(symbols.begin() + i, symbols.begin() + i + 1);
+			size_t end = min(text.find('\n', start), text.size());
+			string_view line = text.substr(start, end - start);
+			if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+			lines[f].push_back(line);
+			start = end + 1;
 		}
 	}
+	vector<uint8_t> memory = image.flatten();
 
-	// reattach any hanging immediate operators
-	for (int i = 0; i < symbols.size(); ++i)
+	string listing = "addr  bytes        cycles   line  source\n";
+	char row[64];
+	vector<uint32_t> printed(sources.size(), 0);	// lines listed so far in each file
+	size_t currentFile = SIZE_MAX;
+	auto listLines = [&](size_t file, uint32_t last)
 	{
-		if (symbols[i] == "!" && i < symbols.size() - 1)
+		if (file != currentFile)
 		{
-			symbols[i] += symbols[i + 1];
-			symbols.erase(symbols.begin() + i + 1, symbols.begin() + i + 2);
+			listing += "\n; " + (sources[file].name.empty() ? string("source") : sources[file].name) + "\n";
+			currentFile = file;
 		}
-	}
+		for (; printed[file] < last && printed[file] < lines[file].size(); ++printed[file])
+		{
+			snprintf(row, sizeof(row), "%-27s%5u  ", "", printed[file] + 1);
+			listing += row;
+			listing += lines[file][printed[file]];
+			while (listing.back() == ' ') listing.pop_back();
+			listing += '\n';
+		}
+	};
 
-	// DEBUG: output code for assembly
-	cout << "CODE FOR ASSEMBLY: " << endl;
-	for (int i = 0; i < symbols.size(); ++i)
+	for (const ListingEntry& entry : work.listing)
 	{
-		if (isInstruction(symbols[i]) || isDirective(symbols[i])) cout << endl;
-		cout << symbols[i] << "\t";
-	}
-	cout << endl << endl;
+		size_t file = sources.size() - 1;
+		while (file > 0 && !(entry.line >= sources[file].firstLine && entry.line < sources[file].firstLine + sources[file].numLines)) --file;
+		uint32_t line = entry.line - sources[file].firstLine + 1;
 
-	// assemble the machine code
-	address = 0;
-	string machineCode = "";
-	for (int i = 0; i < symbols.size(); ++i)
-	{
-		if (symbols[i] == "NOP")
-		{
-			machineCode += "00";
-			++address;
-		}
-		else if (symbols[i] == "ADD")
+		// the first code of an included file comes after the line that included it
+		if (file > 0 && printed[file] == 0 && currentFile < sources.size() && currentFile != file)
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
-			{
-				machineCode += "20";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
+			for (uint32_t l = printed[currentFile]; l < lines[currentFile].size(); ++l)
 			{
-				machineCode += "40";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "30" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "10" + to_address(symbols[i + 1]);
-				address += 3;
+				if (lines[currentFile][l].find(".include") != string_view::npos)
+				{
+					listLines(currentFile, l + 1);
+					break;
+				}
 			}
 		}
-		else if (symbols[i] == "ADC")
+		listLines(file, line - 1);
+		bool first = printed[file] < line;
+
+		// four bytes to a row
+		for (uint32_t offset = 0; offset == 0 || (offset < entry.size && entry.opcode != -2); offset += 4)
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
+			string bytes;
+			if (entry.opcode == -2) bytes = "(" + to_string(entry.size) + " bytes)";
+			for (uint32_t b = offset; b < offset + 4 && b < entry.size && entry.opcode != -2; ++b)
 			{
-				machineCode += "21";
-				++address;
+				snprintf(row, sizeof(row), "%02X ", entry.address + b < memory.size() ? memory[entry.address + b] : 0);
+				bytes += row;
 			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
+			snprintf(row, sizeof(row), "%04X  %-12s %-6s  ", (entry.address + offset) & 0xffff, bytes.c_str(), offset ? "" : cycleText(entry.opcode).c_str());
+			listing += row;
+			if (first && offset == 0)
 			{
-				machineCode += "41";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "31" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "11" + to_address(symbols[i + 1]);
-				address += 3;
+				snprintf(row, sizeof(row), "%5u  ", line);
+				listing += row;
+				listing += lines[file][line - 1];
+				printed[file] = line;
 			}
+			while (listing.back() == ' ') listing.pop_back();
+			listing += '\n';
 		}
-		else if (symbols[i] == "SUB")
+	}
+	for (size_t file = 0; file < sources.size(); ++file)
+		if (printed[file] < lines[file].size()) listLines(file, lines[file].size());
+	return listing;
+}
+
+// the map of a program: its tags sorted by name, then its labels in address order with the bytes and clock cycles from
+// each to the next, counting a branch as taken for the fewest cycles and as not taken for the most
+string mapText(const Workspace& work)
+{
+	vector<MapSymbol> symbols = work.mapSymbols;
+	sort(symbols.begin(), symbols.end(), [](const MapSymbol& a, const MapSymbol& b) { return a.name < b.name; });
+	size_t width = 8;
+	for (const MapSymbol& symbol : symbols) width = max(width, symbol.name.size() + 2);
+
+	string map = "TAGS\n\n";
+	char row[64];
+	for (const MapSymbol& symbol : symbols)
+	{
+		snprintf(row, sizeof(row), "%04X  %-7s ", symbol.value & 0xffff, symbol.isLabel ? "label" : "equate");
+		map += row;
+		map += symbol.name;
+		if (!symbol.isLabel && (symbol.value < 0 || symbol.value > 0xffff)) map += " (" + to_string(symbol.value) + ")";
+		map += '\n';
+	}
+
+	vector<MapSymbol> labels;
+	for (const MapSymbol& symbol : symbols)
+		if (symbol.isLabel) labels.push_back(symbol);
+	stable_sort(labels.begin(), labels.end(), [](const MapSymbol& a, const MapSymbol& b) { return a.value < b.value; });
+	vector<ListingEntry> entries = work.listing;
+	stable_sort(entries.begin(), entries.end(), [](const ListingEntry& a, const ListingEntry& b) { return a.address < b.address; });
+
+	map += "\nLABELS\n\naddr  bytes  cycles     label\n";
+	size_t e = 0;
+	for (size_t l = 0; l < labels.size(); ++l)
+	{
+		// up to the next label further on
+		uint32_t start = labels[l].value;
+		size_t next = l + 1;
+		while (next < labels.size() && labels[next].value == labels[l].value) ++next;
+		uint32_t end = next < labels.size() ? labels[next].value : UINT32_MAX;
+
+		while (e < entries.size() && entries[e].address < start) ++e;
+		uint32_t bytes = 0;
+		uint32_t fewest = 0;
+		uint32_t most = 0;
+		for (size_t n = e; n < entries.size() && entries[n].address < end; ++n)
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
-			{
-				machineCode += "22";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
-			{
-				machineCode += "42";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "32" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "12" + to_address(symbols[i + 1]);
-				address += 3;
-			}
+			bytes += entries[n].size;
+			if (entries[n].opcode < 0) continue;
+			int cycles = cycleCounts[entries[n].opcode >> 4];
+			bool branch = (entries[n].opcode >> 4) == 0xb || (entries[n].opcode >> 4) == 0xc;
+			fewest += cycles;
+			most += cycles + (branch ? branchNotTakenCycles : 0);
 		}
-		else if (symbols[i] == "SBB")
+		string cycles = fewest == most ? to_string(fewest) : to_string(fewest) + "-" + to_string(most);
+		snprintf(row, sizeof(row), "%04X  %5u  %-9s  ", start & 0xffff, bytes, cycles.c_str());
+		map += row;
+		map += labels[l].name;
+		map += '\n';
+	}
+	return map;
+}
+
+// output file formats
+enum OutputFormat
+{
+	FORMAT_BIN,			// raw binary from address 0, holes filled with zeros
+	FORMAT_HEX,			// space separated hex bytes, for pasting into the ROM
+	FORMAT_LOGISIM,		// Logisim memory image, for loading into the ROM
+	FORMAT_IHEX,		// Intel HEX, with only the assembled segments
+	FORMAT_SREC,		// Motorola S-records, with only the assembled segments
+	NUM_OUTPUT_FORMATS
+};
+
+const char* formatNames[NUM_OUTPUT_FORMATS] = { "bin", "hex", "logisim", "ihex", "srec" };
+const char* formatSuffixes[NUM_OUTPUT_FORMATS] = { ".bin", "_hex.txt", "_logisim.txt", ".hex", ".s19" };
+
+// format machine code as space separated hex bytes, the form Logisim accepts when pasting into a ROM
+string hexDump(const vector<uint8_t>& machineCode)
+{
+	const char* digits = "0123456789ABCDEF";
+	string dump;
+	dump.reserve(machineCode.size() * 3);
+	for (uint8_t byte : machineCode)
+	{
+		dump.push_back(digits[byte >> 4]);
+		dump.push_back(digits[byte & 0xf]);
+		dump.push_back(' ');
+	}
+	if (!dump.empty()) dump.pop_back();
+	return dump;
+}
+
+// format machine code as Logisim memory values, with runs of four or more equal bytes written as count*value
+string logisimValues(const vector<uint8_t>& machineCode, int valuesPerLine, const char* newline)
+{
+	const char* digits = "0123456789abcdef";
+	string values;
+	int onLine = 0;
+	for (size_t i = 0; i < machineCode.size();)
+	{
+		size_t run = 1;
+		while (i + run < machineCode.size() && machineCode[i + run] == machineCode[i]) ++run;
+		if (run < 4) run = 1;
+		else values += to_string(run) + "*";
+		if (machineCode[i] >> 4) values.push_back(digits[machineCode[i] >> 4]);
+		values.push_back(digits[machineCode[i] & 0xf]);
+		i += run;
+		if (++onLine == valuesPerLine || i == machineCode.size())
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
-			{
-				machineCode += "23";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
-			{
-				machineCode += "43";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "33" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "13" + to_address(symbols[i + 1]);
-				address += 3;
-			}
+			values += newline;
+			onLine = 0;
 		}
-		else if (symbols[i] == "ONC")
+		else values.push_back(' ');
+	}
+	if (values.empty()) values = string("0") + newline;
+	return values;
+}
+
+// format machine code as a Logisim "v2.0 raw" memory image, 16 values per line
+string logisimImage(const vector<uint8_t>& machineCode)
+{
+	return "v2.0 raw\n" + logisimValues(machineCode, 16, "\n");
+}
+
+// replace the contents of the ROM in a Logisim circuit with machine code, a line at a time so the whole circuit is never in memory
+bool patchCircuit(string filename, const vector<uint8_t>& machineCode)
+{
+	ifstream in(filename, ios::binary);
+	if (!in.is_open())
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: could not read " << filename << "!\n";
+		return false;
+	}
+	string tempFilename = filename + ".tmp";
+	ofstream out(tempFilename, ios::binary);
+
+	// only the ROM components are patched, not the ROM tool in the library
+	bool inRom = false, skipping = false;
+	int patched = 0;
+	string line;
+	while (getline(in, line))
+	{
+		bool crlf = !line.empty() && line.back() == '\r';
+		if (skipping)
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
-			{
-				machineCode += "24";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
-			{
-				machineCode += "44";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "34" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "14" + to_address(symbols[i + 1]);
-				address += 3;
-			}
+			// drop the old contents up to the closing tag
+			size_t close = line.find("</a>");
+			if (close == string::npos) continue;
+			line.erase(0, close);
+			skipping = false;
+			++patched;
+			inRom = false;
 		}
-		else if (symbols[i] == "TWC")
+		else if (line.find("<comp ") != string::npos) inRom = line.find("name=\"ROM\"") != string::npos;
+		else if (inRom && line.find("<a name=\"contents\">") != string::npos)
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
+			// keep the addr/data header, which has the ROM's dimensions
+			size_t headerEnd = line.find("</a>");
+			out << line.substr(0, min(headerEnd, line.size() - crlf)) << (crlf ? "\r\n" : "\n");
+			out << logisimValues(machineCode, 8, crlf ? "\r\n" : "\n");
+			if (headerEnd == string::npos)
 			{
-				machineCode += "25";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
-			{
-				machineCode += "45";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "35" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "15" + to_address(symbols[i + 1]);
-				address += 3;
+				skipping = true;
+				continue;
 			}
+			line.erase(0, headerEnd);
+			++patched;
+			inRom = false;
+		}
+		out << line;
+		if (!in.eof()) out << '\n';
+	}
+	in.close();
+	out.close();
+
+	if (out.fail() || skipping || patched == 0)
+	{
+		remove(tempFilename.c_str());
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: " << (out.fail() ? "could not write " + tempFilename : "no ROM contents found in " + filename) << "!\n";
+		return false;
+	}
+
+	// swap the patched circuit in, removing the original first where rename will not overwrite
+	if (rename(tempFilename.c_str(), filename.c_str()) != 0 && (remove(filename.c_str()) != 0 || rename(tempFilename.c_str(), filename.c_str()) != 0))
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: could not replace " << filename << "!\n";
+		return false;
+	}
+	return true;
+}
+
+// format the assembled segments as Intel HEX data records, skipping the holes
+string intelHex(const MemoryImage& image)
+{
+	const char* digits = "0123456789ABCDEF";
+	string hex;
+	auto putByte = [&](uint8_t byte, uint8_t& checksum)
+	{
+		hex.push_back(digits[byte >> 4]);
+		hex.push_back(digits[byte & 0xf]);
+		checksum += byte;
+	};
+	for (const Segment& segment : image.segmentList())
+	{
+		for (size_t offset = 0; offset < segment.bytes.size(); offset += 16)
+		{
+			uint8_t count = min<size_t>(16, segment.bytes.size() - offset);
+			uint32_t address = segment.base + offset;
+			uint8_t checksum = 0;
+			hex.push_back(':');
+			putByte(count, checksum);
+			putByte(address >> 8, checksum);
+			putByte(address, checksum);
+			putByte(0x00, checksum);
+			for (size_t i = 0; i < count; ++i) putByte(segment.bytes[offset + i], checksum);
+			putByte(-checksum, checksum);
+			hex.push_back('\n');
 		}
-		else if (symbols[i] == "AND")
+	}
+	hex += ":00000001FF\n";
+	return hex;
+}
+
+// format the assembled segments as Motorola S1 records with 16-bit addresses, skipping the holes
+string sRecords(const MemoryImage& image)
+{
+	const char* digits = "0123456789ABCDEF";
+	string srec;
+	auto putByte = [&](uint8_t byte, uint8_t& checksum)
+	{
+		srec.push_back(digits[byte >> 4]);
+		srec.push_back(digits[byte & 0xf]);
+		checksum += byte;
+	};
+	// the count covers the address, data and checksum, and the checksum is the complement of the sum
+	auto putRecord = [&](char type, uint32_t address, const uint8_t* data, size_t count)
+	{
+		uint8_t checksum = 0;
+		srec.push_back('S');
+		srec.push_back(type);
+		putByte(count + 3, checksum);
+		putByte(address >> 8, checksum);
+		putByte(address, checksum);
+		for (size_t i = 0; i < count; ++i) putByte(data[i], checksum);
+		putByte(~checksum, checksum);
+		srec.push_back('\n');
+	};
+	putRecord('0', 0, nullptr, 0);
+	for (const Segment& segment : image.segmentList())
+		for (size_t offset = 0; offset < segment.bytes.size(); offset += 16)
+			putRecord('1', segment.base + offset, segment.bytes.data() + offset, min<size_t>(16, segment.bytes.size() - offset));
+	putRecord('9', 0, nullptr, 0);
+	return srec;
+}
+
+// write a memory image to a file in the given format, in one go
+bool writeFile(string filename, const MemoryImage& image, OutputFormat format)
+{
+	string text;
+	vector<uint8_t> machineCode;
+	if (format != FORMAT_IHEX && format != FORMAT_SREC) machineCode = image.flatten();
+	if (format == FORMAT_HEX) text = hexDump(machineCode);
+	else if (format == FORMAT_LOGISIM) text = logisimImage(machineCode);
+	else if (format == FORMAT_IHEX) text = intelHex(image);
+	else if (format == FORMAT_SREC) text = sRecords(image);
+
+	ofstream fout(filename, ios::binary);
+	if (format == FORMAT_BIN) fout.write((const char*)machineCode.data(), machineCode.size());
+	else fout.write(text.data(), text.size());
+	fout.close();
+	return !fout.fail();
+}
+
+// format an object module as text: the sections as hex, then the exported tags and the relocations
+string objectText(const ObjectModule& module)
+{
+	const char* digits = "0123456789abcdef";
+	string text = "chasm object 1\n";
+	auto putSection = [&](string header, const Segment& segment)
+	{
+		text += header + " " + to_string(segment.bytes.size()) + "\n";
+		for (size_t i = 0; i < segment.bytes.size(); ++i)
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
-			{
-				machineCode += "26";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
-			{
-				machineCode += "46";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "36" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "16" + to_address(symbols[i + 1]);
-				address += 3;
-			}
+			text.push_back(digits[segment.bytes[i] >> 4]);
+			text.push_back(digits[segment.bytes[i] & 0xf]);
+			text.push_back(i % 32 == 31 || i + 1 == segment.bytes.size() ? '\n' : ' ');
 		}
-		else if (symbols[i] == "OR")
+	};
+
+	// the relocatable section is flattened, since its holes still take up room
+	Segment textSection = { 0, module.text.flatten() };
+	putSection("text", textSection);
+	for (const Segment& segment : module.absolute.segmentList()) putSection("org " + to_string(segment.base), segment);
+	for (const ObjectSymbol& symbol : module.symbols)
+		text += "global " + symbol.name + (symbol.inText ? " text " : " abs ") + to_string(symbol.value) + "\n";
+	for (const Relocation& relocation : module.relocations)
+	{
+		text += string("reloc ") + (relocation.inText ? "text " : "abs ") + to_string(relocation.address) + " " + relocationTypeNames[relocation.type] + " " +
+			(relocation.target.empty() ? "text" : "tag " + relocation.target) + " " + to_string(relocation.addend) + "\n";
+	}
+	text += "end\n";
+	return text;
+}
+
+bool writeObject(string filename, const ObjectModule& module)
+{
+	string text = objectText(module);
+	ofstream fout(filename, ios::binary);
+	fout.write(text.data(), text.size());
+	fout.close();
+	return !fout.fail();
+}
+
+// read an object module in the form objectText writes, up to and including its end line
+bool parseObject(istream& fin, ObjectModule& module)
+{
+	string word, version;
+	fin >> word >> version;
+	bool valid = word == "chasm" && version == "object" && fin >> version && version == "1";
+	auto readSection = [&](MemoryImage& image, uint32_t base)
+	{
+		size_t size;
+		if (!(fin >> size) || base + size > MemoryImage::addressSpace) return false;
+		image.org(base);
+		for (size_t i = 0; i < size; ++i)
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
-			{
-				machineCode += "27";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
-			{
-				machineCode += "47";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "37" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "17" + to_address(symbols[i + 1]);
-				address += 3;
-			}
+			string byte;
+			if (!(fin >> byte) || byte.size() != 2 || hexValue(byte[0]) < 0 || hexValue(byte[1]) < 0) return false;
+			image.emit(hexValue(byte[0]) << 4 | hexValue(byte[1]));
 		}
-		else if (symbols[i] == "XOR")
+		return image.good();
+	};
+	while (valid && fin >> word && word != "end")
+	{
+		if (word == "text") valid = readSection(module.text, 0);
+		else if (word == "org")
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
-			{
-				machineCode += "28";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
-			{
-				machineCode += "48";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "38" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "18" + to_address(symbols[i + 1]);
-				address += 3;
-			}
+			uint32_t base;
+			valid = fin >> base && readSection(module.absolute, base);
 		}
-		else if (symbols[i] == "LSL")
+		else if (word == "global")
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
-			{
-				machineCode += "29";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
-			{
-				machineCode += "49";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "39" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "19" + to_address(symbols[i + 1]);
-				address += 3;
-			}
+			ObjectSymbol symbol;
+			string section;
+			valid = fin >> symbol.name >> section >> symbol.value && (section == "text" || section == "abs");
+			symbol.inText = section == "text";
+			module.symbols.push_back(symbol);
 		}
-		else if (symbols[i] == "LSR")
+		else if (word == "reloc")
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
-			{
-				machineCode += "2a";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
-			{
-				machineCode += "4a";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "3a" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "1a" + to_address(symbols[i + 1]);
-				address += 3;
-			}
+			Relocation relocation;
+			string section, type, target;
+			valid = fin >> section >> relocation.address >> type >> target && (section == "text" || section == "abs");
+			relocation.inText = section == "text";
+			int t = 0;
+			while (t < NUM_RELOCATION_TYPES && type != relocationTypeNames[t]) ++t;
+			relocation.type = (RelocationType)t;
+			if (valid && target == "tag") valid = (bool)(fin >> relocation.target);
+			else valid = valid && target == "text";
+			valid = valid && t < NUM_RELOCATION_TYPES && fin >> relocation.addend;
+			module.relocations.push_back(relocation);
 		}
-		else if (symbols[i] == "ROL")
+		else valid = false;
+	}
+	return valid && word == "end";
+}
+
+bool readObject(string filename, ObjectModule& module)
+{
+	ifstream fin(filename);
+	if (!fin.is_open())
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: could not read " << filename << "!\n";
+		return false;
+	}
+	module = ObjectModule();
+	module.name = filename;
+	if (!parseObject(fin, module))
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: " << filename << " is not a valid object file!\n";
+		return false;
+	}
+	return true;
+}
+
+// the build this assembler was compiled from; any change to the assembler gives a new one, so nothing stale is reused
+const char assemblerBuild[] = "chasm " __DATE__ " " __TIME__;
+
+// 64-bit FNV-1a hash, continuing from a previous hash
+uint64_t hashBytes(string_view bytes, uint64_t hash = 0xcbf29ce484222325)
+{
+	for (char c : bytes) hash = (hash ^ (uint8_t)c) * 0x100000001b3;
+	return hash;
+}
+
+// assembled modules on disk, keyed by a hash of the assembler build, the options that change the output and the source; an entry also lists the
+// files the source included with the hashes of their contents, since they can change without the source changing
+class BuildCache
+{
+public:
+	BuildCache(string directory) : directory(directory) {}
+
+	// fill in the module, symbol table, listing and map of an unchanged source, false if it has to be assembled
+	bool lookup(const string& input, string_view source, const string& mode, ObjectModule& module, Workspace& work)
+	{
+		ifstream fin(entryFilename(input, source, mode));
+		module = ObjectModule();
+		bool hit = fin.is_open() && parseObject(fin, module);
+
+		string line;
+		size_t sourceSize = source.size();
+		work.symbolTable.clear();
+		work.listingText.clear();
+		work.mapText.clear();
+		while (hit && getline(fin, line))
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
-			{
-				machineCode += "2b";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
+			if (line.empty()) continue;
+			else if (line.compare(0, 8, "include ") == 0 && line.size() > 25)
 			{
-				machineCode += "4b";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "3b" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "1b" + to_address(symbols[i + 1]);
-				address += 3;
+				// an included file that has changed since, or gone, means the source has to be assembled again
+				string code;
+				hit = loadFile(line.substr(25), code) && hexHash(hashBytes(code)) == line.substr(8, 16);
+				sourceSize += code.size();
 			}
+			else if (line[0] == '\t') work.symbolTable += line + "\n";
+			else if (line.compare(0, 2, "L ") == 0) work.listingText += line.substr(2) + "\n";
+			else if (line.compare(0, 2, "M ") == 0) work.mapText += line.substr(2) + "\n";
+			else hit = false;
 		}
-		else if (symbols[i] == "ROR")
+
+		if (hit)
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
-			{
-				machineCode += "2c";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
-			{
-				machineCode += "4c";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "3c" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "1c" + to_address(symbols[i + 1]);
-				address += 3;
-			}
+			++hits;
+			bytesSaved += sourceSize;
 		}
-		else if (symbols[i] == "RCL")
+		else ++misses;
+		return hit;
+	}
+
+	// keep a freshly assembled module, along with the files the source included
+	void store(const string& input, string_view source, const string& mode, const ObjectModule& module, const Workspace& work)
+	{
+		const vector<SourceFile>& sources = work.sources;
+		string entry = objectText(module);
+		for (size_t i = 1; i < sources.size(); ++i)
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
-			{
-				machineCode += "2d";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
-			{
-				machineCode += "4d";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "3d" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "1d" + to_address(symbols[i + 1]);
-				address += 3;
-			}
+			string code;
+			if (!loadFile(sources[i].name, code)) return;
+			entry += "include " + hexHash(hashBytes(code)) + " " + sources[i].name + "\n";
 		}
-		else if (symbols[i] == "ROR")
+		entry += work.symbolTable;
+		auto keepLines = [&](const string& text, const char* prefix)
 		{
-			if (i == symbols.size() - 1 || symbols[i + 1] == "#a_reg")
+			for (size_t start = 0; start < text.size();)
 			{
-				machineCode += "2f";
-				++address;
-			}
-			else if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
-			{
-				machineCode += "4f";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "3f" + to_immediate(symbols[i + 1]);
-				address += 2;
-			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
-			{
-				machineCode += "1f" + to_address(symbols[i + 1]);
-				address += 3;
+				size_t end = min(text.find('\n', start), text.size());
+				entry += prefix + text.substr(start, end - start) + "\n";
+				start = end + 1;
 			}
+		};
+		keepLines(work.listingText, "L ");
+		keepLines(work.mapText, "M ");
+
+		// written under a temporary name of its own first, so an interrupted run or another thread storing the same file
+		// cannot leave half an entry behind
+		error_code error;
+		filesystem::create_directories(directory, error);
+		string filename = entryFilename(input, source, mode);
+		string temporary = filename + "." + to_string(hash<thread::id>()(this_thread::get_id())) + ".tmp";
+		ofstream fout(temporary, ios::binary);
+		fout.write(entry.data(), entry.size());
+		fout.close();
+		if (fout.fail() || (rename(temporary.c_str(), filename.c_str()) != 0 &&
+			(remove(filename.c_str()) != 0 || rename(temporary.c_str(), filename.c_str()) != 0)))
+		{
+			LOG(LOG_VERBOSE, LOG_GENERAL) << "could not write to the cache in " << directory << "\n";
+			remove(temporary.c_str());
 		}
-		else if (symbols[i] == "LOD")
+	}
+
+	string directory;
+	atomic<size_t> hits = 0;
+	atomic<size_t> misses = 0;
+	atomic<size_t> bytesSaved = 0;	// bytes of source and included files that did not have to be assembled
+
+private:
+	static string hexHash(uint64_t hash)
+	{
+		char text[17];
+		snprintf(text, sizeof(text), "%016llx", (unsigned long long)hash);
+		return text;
+	}
+
+	// the path is part of the key, since included files are found relative to it
+	string entryFilename(const string& input, string_view source, const string& mode) const
+	{
+		uint64_t hash = hashBytes(assemblerBuild);
+		hash = hashBytes(mode + '\0', hash);
+		hash = hashBytes(input + '\0', hash);
+		hash = hashBytes(source, hash);
+		return directory + "/" + hexHash(hash);
+	}
+};
+
+// link object modules into a program: code placed with .org stays where it is, each relocatable section goes in the
+// first gap big enough for it, in the order the modules were given, and then every relocation is patched
+bool link(const vector<ObjectModule>& modules, MemoryImage& image)
+{
+	// the ranges taken by absolute code, which the relocatable sections have to fit around
+	vector<pair<uint32_t, uint32_t>> taken;
+	for (const ObjectModule& module : modules)
+		for (const Segment& segment : module.absolute.segmentList()) taken.push_back({ segment.base, segment.end() });
+
+	vector<uint32_t> bases;
+	for (const ObjectModule& module : modules)
+	{
+		uint32_t size = module.text.size();
+		uint32_t base = 0;
+		for (bool moved = true; moved;)
 		{
-			if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
+			moved = false;
+			for (const auto& range : taken)
 			{
-				machineCode += "90";
-				++address;
-			}
-			else if (i < symbols.size() && symbols[i + 1][0] == '!')
-			{
-				machineCode += "60" + to_immediate(symbols[i + 1]);
-				address += 2;
+				if (size && base < range.second && range.first < base + size)
+				{
+					base = range.second;
+					moved = true;
+				}
 			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
+		}
+		if (base + size > MemoryImage::addressSpace)
+		{
+			LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: there is no room left for the code of " << module.name << "!\n";
+			return false;
+		}
+		bases.push_back(base);
+		if (size) taken.push_back({ base, base + size });
+	}
+
+	// every exported tag, with its final address
+	unordered_map<string, pair<int, size_t>> globals;
+	for (size_t m = 0; m < modules.size(); ++m)
+	{
+		for (const ObjectSymbol& symbol : modules[m].symbols)
+		{
+			auto inserted = globals.insert({ symbol.name, { symbol.value + (symbol.inText ? (int)bases[m] : 0), m } });
+			if (!inserted.second)
 			{
-				machineCode += "50" + to_address(symbols[i + 1]);
-				address += 3;
+				LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: tag " << symbol.name << " is exported by both " << modules[inserted.first->second.second].name
+					<< " and " << modules[m].name << "!\n";
+				return false;
 			}
 		}
-		else if (symbols[i] == "STO")
+	}
+
+	// patch each module's code, then place it
+	for (size_t m = 0; m < modules.size(); ++m)
+	{
+		const ObjectModule& module = modules[m];
+		vector<uint8_t> text = module.text.flatten();
+		vector<Segment> absolute = module.absolute.segmentList();
+		for (const Relocation& relocation : module.relocations)
 		{
-			if (i < symbols.size() - 1 && symbols[i + 1] == "#stack")
+			int value = bases[m];
+			if (!relocation.target.empty())
 			{
-				machineCode += "80";
-				++address;
+				auto global = globals.find(relocation.target);
+				if (global == globals.end())
+				{
+					LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: " << module.name << ": undefined tag " << relocation.target << "!\n";
+					return false;
+				}
+				value = global->second.first;
 			}
-			else if (i < symbols.size() - 1 && isInteger(symbols[i + 1]))
+			value += relocation.addend;
+
+			// find the bytes of the field
+			int size = relocation.type == RELOC_ADDRESS ? 2 : 1;
+			uint8_t* field = nullptr;
+			if (relocation.inText && relocation.address + size <= text.size()) field = &text[relocation.address];
+			for (Segment& segment : absolute)
+				if (!relocation.inText && relocation.address >= segment.base && relocation.address + size <= segment.end()) field = &segment.bytes[relocation.address - segment.base];
+			if (!field)
 			{
-				machineCode += "70" + to_address(symbols[i + 1]);
-				address += 3;
+				LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: " << module.name << ": relocation at " << relocation.address << " is outside the code!\n";
+				return false;
 			}
+			if (relocation.type == RELOC_HIGH) field[0] = value >> 8;
+			else field[0] = value;
+			if (relocation.type == RELOC_ADDRESS) field[1] = value >> 8;
 		}
-		else if (symbols[i] == "PSH")
-		{
-			machineCode += "80";
-			++address;
-		}
-		else if (symbols[i] == "POP")
-		{
-			machineCode += "90";
-			++address;
-		}
-		else if (symbols[i] == "JMP" && i < symbols.size() - 1)
+
+		image.org(bases[m]);
+		for (uint8_t byte : text) image.emit(byte);
+		for (const Segment& segment : absolute)
 		{
-			machineCode += "a0" + to_address(symbols[i + 1]);
-			address += 3;
+			image.org(segment.base);
+			for (uint8_t byte : segment.bytes) image.emit(byte);
 		}
-		else if (symbols[i] == "BRC" && i < symbols.size() - 1)
+		if (!image.good())
 		{
-			machineCode += "b1" + to_address(symbols[i + 1]);
-			address += 3;
+			LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: " << module.name << " overlaps code from another module at address " << image.position() << "!\n";
+			return false;
 		}
-		else if (symbols[i] == "BRZ" && i < symbols.size() - 1)
+	}
+	return true;
+}
+
+// a range the boot loader moves from where it was packed to where the program expects it
+struct BootMove
+{
+	uint32_t source;
+	uint32_t destination;
+	uint32_t count;
+};
+
+// assembly for a boot loader at the given address; it makes each move with a self-modifying copy loop, then puts back
+// the first three bytes of the program, which hold the jump to the loader, and starts the program at the entry point
+string bootLoaderSource(uint32_t loader, const vector<BootMove>& moves, const uint8_t first[3], uint32_t entry)
+{
+	auto lowHigh = [](string label, uint32_t value)
+	{
+		return "\tLOD !" + to_string(value & 0xff) + "\n\tSTO " + label + "\n\tLOD !" + to_string(value >> 8 & 0xff) + "\n\tSTO " + label + " + 1\n";
+	};
+	string code = "// boot loader generated by chasm\n\n.org " + to_string(loader) + "\n";
+	for (size_t i = 0; i < moves.size(); ++i)
+	{
+		string next = "boot_next_" + to_string(i);
+		code += lowHigh("boot_load + 1", moves[i].source);
+		code += lowHigh("boot_store + 1", moves[i].destination);
+		code += lowHigh("boot_count", moves[i].count);
+		code += "\tLOD !(" + next + " % 256)\n\tSTO boot_return + 1\n\tLOD !(" + next + " / 256)\n\tSTO boot_return + 2\n";
+		code += "\tJMP boot_copy\n" + next + ":\n";
+	}
+	for (int i = 0; i < 3; ++i) code += "\tLOD !" + to_string(first[i]) + "\n\tSTO " + to_string(i) + "\n";
+	code += "\tJMP " + to_string(entry) + "\n\n";
+
+	// copy boot_count bytes, then jump to the address stored in boot_return
+	code += "boot_copy:\nboot_load:\n\tLOD 0\nboot_store:\n\tSTO 0\n";
+	for (string pointer : { "boot_load", "boot_store" })
+		code += "\tLOD " + pointer + " + 1\n\tADD !1\n\tSTO " + pointer + " + 1\n\tLOD " + pointer + " + 2\n\tADC !0\n\tSTO " + pointer + " + 2\n";
+	code += "\tLOD boot_count\n\tSUB !1\n\tSTO boot_count\n\tLOD boot_count + 1\n\tSBB !0\n\tSTO boot_count + 1\n";
+	code += "\tOR boot_count\n\tBNZ boot_copy\nboot_return:\n\tJMP 0\nboot_count: .reserve 2\n";
+	return code;
+}
+
+// rearrange a program so HRD RST only has to copy as far as it reaches: the segments at the bottom of memory stay where
+// they are, the rest are packed right after them and moved into place by a boot loader; the image is left as it is when
+// that would not load any faster
+bool bootImage(const MemoryImage& image, Workspace& work, MemoryImage& boot, uint32_t& loader)
+{
+	// the loader modifies itself, so it is assembled as written
+	work.optimize = false;
+	const vector<Segment>& segments = image.segmentList();
+	vector<uint8_t> low = image.flatten();
+	low.resize(max<size_t>(low.size(), 3));
+	uint8_t first[3] = { low[0], low[1], low[2] };
+
+	// without the loader the CPU runs through the zeros (NOPs) up to the first segment, so a program that does not start
+	// at the bottom of memory is entered there rather than at 0, where the packed copies now are
+	uint32_t entry = !segments.empty() && segments[0].base >= 3 ? segments[0].base : 0;
+
+	// the loader only grows with the number of moves, so measure it once for every count
+	auto loaderSize = [&](size_t numMoves, uint32_t& size)
+	{
+		MemoryImage loader;
+		if (!assemble(bootLoaderSource(0, vector<BootMove>(numMoves, { 0, 0, 0 }), first, entry), "", work, loader)) return false;
+		size = loader.size();
+		return true;
+	};
+
+	// keep the first k segments in place, picking whichever k lets HRD RST stop soonest
+	size_t bestKept = segments.size();
+	uint32_t bestEnd = image.size();
+	uint32_t packed = 0;
+	for (size_t k = segments.size(); k-- > 0;)
+	{
+		packed += segments[k].bytes.size();
+		uint32_t keptEnd = max<uint32_t>(3, k ? segments[k - 1].end() : 0);
+		uint32_t size = 0;
+		if (!loaderSize(segments.size() - k, size)) return false;
+		uint32_t end = keptEnd + packed + size;
+		if (end <= segments[k].base && end < bestEnd)
 		{
-			machineCode += "b2" + to_address(symbols[i + 1]);
-			address += 3;
+			bestKept = k;
+			bestEnd = end;
 		}
-		else if (symbols[i] == "BRN" && i < symbols.size() - 1)
+	}
+	loader = 0;
+	if (bestKept == segments.size())
+	{
+		boot = image;
+		return true;
+	}
+
+	// the kept segments, with a jump to the loader over the first three bytes
+	uint32_t keptEnd = max<uint32_t>(3, bestKept ? segments[bestKept - 1].end() : 0);
+	loader = keptEnd;
+	for (size_t i = bestKept; i < segments.size(); ++i) loader += segments[i].bytes.size();
+	boot = MemoryImage();
+	boot.emit(0xa0);
+	boot.emitAddress(loader);
+	for (size_t i = 0; i < bestKept; ++i)
+	{
+		const Segment& segment = segments[i];
+		uint32_t start = max<uint32_t>(segment.base, 3);
+		boot.org(start);
+		for (uint32_t address = start; address < segment.end(); ++address) boot.emit(segment.bytes[address - segment.base]);
+	}
+
+	// the packed segments, then the loader that moves them
+	vector<BootMove> moves;
+	boot.org(keptEnd);
+	for (size_t i = bestKept; i < segments.size(); ++i)
+	{
+		moves.push_back({ boot.position(), segments[i].base, (uint32_t)segments[i].bytes.size() });
+		for (uint8_t byte : segments[i].bytes) boot.emit(byte);
+	}
+	MemoryImage loaderImage;
+	if (!assemble(bootLoaderSource(loader, moves, first, entry), "", work, loaderImage)) return false;
+	for (const Segment& segment : loaderImage.segmentList())
+	{
+		boot.org(segment.base);
+		for (uint8_t byte : segment.bytes) boot.emit(byte);
+	}
+	boot.org(loaderImage.size());
+	if (!boot.good() || boot.size() != bestEnd)
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: the boot loader does not fit!\n";
+		return false;
+	}
+	return true;
+}
+
+// describe what HRD RST has to load: the highest address it must reach and the ranges that hold the program
+string loadManifest(const string& input, const MemoryImage& image, const MemoryImage& loaded, uint32_t loader)
+{
+	char line[80];
+	string manifest = "// load manifest for " + input + "\n\n";
+	snprintf(line, sizeof(line), "highest address: 0x%04x\nload cycles: %u\n", loaded.size() - 1, loaded.size());
+	manifest += line;
+	if (loader)
+	{
+		snprintf(line, sizeof(line), "boot loader: 0x%04x\n", loader);
+		manifest += line;
+	}
+	manifest += "ranges:\n";
+	for (const Segment& segment : image.segmentList())
+	{
+		snprintf(line, sizeof(line), "\t0x%04x - 0x%04x (%zu bytes)\n", segment.base, segment.end() - 1, segment.bytes.size());
+		manifest += line;
+	}
+	return manifest;
+}
+
+// generate a synthetic program of at least targetSize bytes for benchmarking
+string syntheticProgram(size_t targetSize)
+{
+	string code = "// synthetic benchmark program\n\nconsole = 0xfeff\nstep_0 = 1\n\n";
+	for (int n = 0; code.size() < targetSize; ++n)
+	{
+		string id = to_string(n);
+		code += "step_" + to_string(n + 1) + " = step_" + id + " + 1 // running constant\n";
+		code += "block_" + id + ":\n";
+		code += "\tLOD !(text_" + id + " % 256)\n";
+		code += "\tSTO ptr_" + id + "\n";
+		code += "\tLOD !(text_" + id + " / 256)\n";
+		code += "\tSTO ptr_" + id + " + 1\n";
+		code += "\tLOD ptr_" + id + "\n";
+		code += "\tADD !step_" + id + "\n";
+		code += "\tBNC skip_" + id + "\n";
+		code += "\tSTO console\n";
+		code += "skip_" + id + ":\n";
+		code += "\tXOR #stack\n";
+		code += "\tJSR block_" + id + "\n";
+		code += "\t/* per-block storage */\n";
+		code += "ptr_" + id + ": .reserve 2\n";
+		code += "text_" + id + ": .string \"block " + id + "\\n\"\n\n";
+	}
+	code += "\tHLT\n";
+	return code;
+}
+
+// the preprocessing and split into symbols that tokenize() replaced, kept so the benchmark can show the difference:
+// it erased and inserted characters in the source one at a time.  The old block comment loop erased everything after
+// the first "/*", which is fixed here so both go through the same program; returns the number of symbols
+size_t legacySplit(string asmCode)
+{
+	auto escaped = [&](size_t index)
+	{
+		size_t n = 0;
+		for (size_t i = index; i > 0 && asmCode[i - 1] == '\\'; --i) ++n;
+		return n % 2 == 1;
+	};
+
+	// remove single-line and block comments
+	for (size_t i = 0; i + 1 < asmCode.length(); ++i)
+		if (asmCode[i] == '/' && asmCode[i + 1] == '/')
+			while (i < asmCode.size() && asmCode[i] != '\n') asmCode.erase(i, 1);
+	for (size_t i = 0; i + 1 < asmCode.length(); ++i)
+		if (asmCode[i] == '/' && asmCode[i + 1] == '*')
 		{
-			machineCode += "b4" + to_address(symbols[i + 1]);
-			address += 3;
+			while (i + 1 < asmCode.size() && (asmCode[i] != '*' || asmCode[i + 1] != '/')) asmCode.erase(i, 1);
+			asmCode.erase(i, 2);
 		}
-		else if (symbols[i] == "BRV" && i < symbols.size() - 1)
+
+	// remove unneccessary whitespace
+	bool inQuotes = false;
+	for (size_t i = 0; i < asmCode.length(); ++i)
+	{
+		if (asmCode[i] == '"' && !escaped(i)) inQuotes = !inQuotes;
+		if (!inQuotes && (asmCode[i] == '\n' || asmCode[i] == '\t' || asmCode[i] == '\r')) asmCode[i] = ' ';
+	}
+	inQuotes = false;
+	for (size_t i = 0; i + 1 < asmCode.length(); ++i)
+	{
+		if (asmCode[i] == '"' && !escaped(i)) inQuotes = !inQuotes;
+		if (!inQuotes && asmCode[i] == ' ') while (i + 1 < asmCode.length() && asmCode[i + 1] == ' ') asmCode.erase(i + 1, 1);
+	}
+
+	// make sure all mathematical symbols are separated by a space
+	inQuotes = false;
+	for (size_t i = 1; i + 1 < asmCode.length(); ++i)
+	{
+		if (asmCode[i] == '"' && !escaped(i)) inQuotes = !inQuotes;
+		if (inQuotes || string_view(":=+-*/()%").find(asmCode[i]) == string_view::npos) continue;
+		if (asmCode[i + 1] != ' ') asmCode.insert(i + 1, " ");
+		if (asmCode[i - 1] != ' ') asmCode.insert(i, " ");
+	}
+
+	// split on the spaces, keeping strings whole
+	vector<string> symbols;
+	for (size_t i = 0; i < asmCode.length(); ++i)
+	{
+		if (asmCode[i] == ' ') continue;
+		string symbol;
+		if (asmCode[i] == '"')
 		{
-			machineCode += "b8" + to_address(symbols[i + 1]);
-			address += 3;
+			do symbol += asmCode[i++];
+			while (i < asmCode.length() && (asmCode[i] != '"' || escaped(i)));
+			symbol += '"';
 		}
-		else if (symbols[i] == "BNC" && i < symbols.size() - 1)
+		else while (i < asmCode.length() && asmCode[i] != ' ') symbol += asmCode[i++];
+		symbols.push_back(symbol);
+	}
+	return symbols.size();
+}
+
+// time the lexer against the passes it replaced, and a full assembly of a synthetic 64 KB program
+void runBenchmark()
+{
+	string source = syntheticProgram(64 * 1024);
+
+	// lexer throughput
+	const int lexRuns = 20;
+	size_t numTokens = 0;
+	auto start = chrono::steady_clock::now();
+	for (int run = 0; run < lexRuns; ++run)
+	{
+		StringInterner names;
+		vector<Token> tokens;
+		tokenize(source, names, tokens);
+		numTokens = tokens.size();
+	}
+	double lexSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count() / lexRuns;
+
+	// the old preprocessing is quadratic, so it only gets one run
+	start = chrono::steady_clock::now();
+	size_t numSymbols = legacySplit(source);
+	double legacySeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	// full assembly, with the debug output discarded
+	Workspace work;
+	LogLevel level = logger.level;
+	logger.level = LOG_ERROR;
+	start = chrono::steady_clock::now();
+	MemoryImage image;
+	assemble(source, "", work, image);
+	double assembleSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	logger.level = level;
+
+	LOG(LOG_INFO, LOG_GENERAL) << "BENCHMARK: " << source.size() << " bytes of source, " << numTokens << " tokens\n";
+	LOG(LOG_INFO, LOG_GENERAL) << "\tbefore:   " << legacySeconds * 1e3 << " ms (" << numSymbols / legacySeconds << " symbols/s, the old erase/insert preprocessing)\n";
+	LOG(LOG_INFO, LOG_GENERAL) << "\tlexer:    " << lexSeconds * 1e3 << " ms (" << numTokens / lexSeconds << " tokens/s, " << legacySeconds / lexSeconds << "x faster)\n";
+	LOG(LOG_INFO, LOG_GENERAL) << "\tassemble: " << assembleSeconds * 1e3 << " ms (" << numTokens / assembleSeconds << " tokens/s, "
+		<< image.size() << " bytes)\n";
+}
+
+void printUsage()
+{
+	ostream& out = logger.stream;
+	out << "usage: chasm [options] input.asm...\n\n";
+	out << "options:\n";
+	out << "\t-o <path>        output file, or output directory when assembling several files\n";
+	out << "\t--format=<fmt>   bin (default), hex, logisim, ihex or srec\n";
+	out << "\t--circ=<file>    also load the program into the ROM of a Logisim circuit\n";
+	out << "\t--boot           pack the program behind a boot loader so HRD RST has less to copy\n";
+	out << "\t--manifest       also write the highest address and ranges HRD RST has to load to <output>_load.txt\n";
+	out << "\t--listing        also write the address, bytes and clock cycles of every line to <output>.lst\n";
+	out << "\t--map            also write the tags and the bytes and clock cycles from each label on to <output>.map\n";
+	out << "\t-c               write relocatable object files (.obj) for the linker instead of programs\n";
+	out << "\t--link           link every input into one program; implied when an input is an .obj file\n";
+	out << "\t-O               remove redundant instructions with a peephole optimizer\n";
+	out << "\t--cache[=<dir>]  reuse what unchanged files assembled to last time, kept in dir (.chasm-cache)\n";
+	out << "\t--jobs <n>       assemble up to n files at once, 0 for one per core\n";
+	out << "\t--batch <list>   also assemble every file named in list, one per line (- reads stdin)\n";
+	out << "\t-q               only print errors\n";
+	out << "\t-v, -vv          print the memory layout and timings, or the full dumps of every stage\n";
+	out << "\t--log=<list>     limit -v and -vv to some of general, lexer, symbols, resolve and emit\n";
+	out << "\t--bench          time the assembler on a synthetic program\n";
+}
+
+// output path for an input file: next to it, or in the output directory, with the given suffix in place of its extension
+string outputFilename(const string& input, const string& outputDir, const string& suffix)
+{
+	size_t nameStart = input.find_last_of("/\\") + 1;
+	size_t extension = input.find_last_of('.');
+	string stem = input.substr(0, extension == string::npos || extension < nameStart ? string::npos : extension);
+	if (!outputDir.empty()) stem = outputDir + "/" + stem.substr(nameStart);
+	return stem + suffix;
+}
+
+// what to write for each assembled file
+struct OutputOptions
+{
+	OutputFormat format = FORMAT_BIN;
+	string circuit;				// Logisim circuit whose ROM gets the program, if any
+	bool boot = false;			// pack the program behind a boot loader so HRD RST finishes sooner
+	bool manifest = false;		// also write a load manifest next to the output
+	bool object = false;		// write object modules for the linker instead of programs (-c)
+	bool link = false;			// link every input into a single program
+	bool optimize = false;		// run the peephole optimizer (-O)
+	bool listing = false;		// also write a listing with the address, bytes and cycles of every line (--listing)
+	bool map = false;			// also write a map of the tags and what each label's code costs (--map)
+	BuildCache* cache = nullptr;	// where to look for files assembled before (--cache)
+};
+
+// load and assemble one file, into a program or into an object module, unless the cache has it already
+bool assembleSource(const string& input, Workspace& work, MemoryImage& image, ObjectModule* object, const OutputOptions& options)
+{
+	BuildCache* cache = options.cache;
+	bool listing = !object && (options.listing || options.map);
+	string mode = string(object ? "object" : "program") + (options.optimize ? " -O" : "") + (listing ? " -l" : "");
+	string asmCode;
+	if (!loadFile(input, asmCode))
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: could not read " << input << "!\n";
+		return false;
+	}
+
+	ObjectModule cached;
+	if (cache && cache->lookup(input, asmCode, mode, cached, work))
+	{
+		if (object) *object = move(cached);
+		else image = move(cached.absolute);
+		LOG(LOG_VERBOSE, LOG_EMIT) << input << ": unchanged, taken from the cache\n";
+		LOG(LOG_DEBUG, LOG_RESOLVE) << "TAG DEFINITIONS:\n\n" << work.symbolTable << "\n";
+		return true;
+	}
+
+	auto start = chrono::steady_clock::now();
+	work.keepSymbolTable = cache != nullptr;
+	work.optimize = options.optimize;
+	work.keepListing = listing;
+	bool assembled = assemble(asmCode, input, work, image, object);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	if (!assembled)
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: " << input << " failed to assemble!\n";
+		return false;
+	}
+	LOG(LOG_VERBOSE, LOG_EMIT) << input << ": assembled in " << seconds * 1e3 << " ms\n";
+	work.listingText = listing ? listingText(work, image, asmCode) : "";
+	work.mapText = listing ? mapText(work) : "";
+
+	if (cache)
+	{
+		if (object) cache->store(input, asmCode, mode, *object, work);
+		else
 		{
-			machineCode += "c1" + to_address(symbols[i + 1]);
-			address += 3;
+			cached.absolute = image;
+			cache->store(input, asmCode, mode, cached, work);
 		}
-		else if (symbols[i] == "BNZ" && i < symbols.size() - 1)
+	}
+	return true;
+}
+
+// write a text file that goes along with the output
+bool writeTextFile(const string& filename, const string& text)
+{
+	ofstream fout(filename, ios::binary);
+	fout.write(text.data(), text.size());
+	fout.close();
+	if (fout.fail())
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: could not write " << filename << "!\n";
+		return false;
+	}
+	return true;
+}
+
+// write out an assembled or linked program in every form asked for
+bool writeProgram(const string& input, const string& output, const MemoryImage& image, const OutputOptions& options, Workspace& work)
+{
+	// memory layout
+	if (logger.enabled(LOG_VERBOSE, LOG_EMIT))
+	{
+		logger.stream << "SEGMENTS:\n";
+		for (const Segment& segment : image.segmentList())
+			logger.stream << "\t" << segment.base << " - " << segment.end() - 1 << " (" << segment.bytes.size() << " bytes)\n";
+		logger.stream << "\n";
+	}
+
+	// DEBUG: output the hex code so we can paste it into logisim if desired
+	if (logger.enabled(LOG_DEBUG, LOG_EMIT))
+	{
+		vector<uint8_t> machineCode = image.flatten();
+		logger.stream << "HEX DUMP: " << machineCode.size() << " bytes\n\n" << hexDump(machineCode) << "\n\n";
+	}
+
+	// what HRD RST loads: the program itself, or the program packed behind a boot loader
+	MemoryImage boot;
+	uint32_t loader = 0;
+	if (options.boot && !bootImage(image, work, boot, loader))
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: could not build the boot loader for " << input << "!\n";
+		return false;
+	}
+	const MemoryImage& loaded = options.boot ? boot : image;
+	if (options.boot)
+	{
+		LOG(LOG_VERBOSE, LOG_EMIT) << (loader ? "boot loader at " + to_string(loader) + ", " : "no boot loader needed, ")
+			<< "HRD RST has to copy " << loaded.size() << " of " << image.size() << " bytes\n";
+	}
+
+	// write the resulting machine code to a file
+	if (!writeFile(output, loaded, options.format))
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: could not write " << output << "!\n";
+		return false;
+	}
+	LOG(LOG_INFO, LOG_GENERAL) << input << " -> " << output << " (" << loaded.size() << " bytes)\n";
+
+	// the manifest goes next to the output, in place of its extension
+	if (options.manifest && !writeTextFile(outputFilename(output, "", "_load.txt"), loadManifest(input, image, loaded, loader))) return false;
+
+	// and so do the listing and the map
+	if (options.listing && !writeTextFile(outputFilename(output, "", ".lst"), work.listingText)) return false;
+	if (options.map && !writeTextFile(outputFilename(output, "", ".map"), work.mapText)) return false;
+
+	// load the program straight into the ROM of the circuit
+	if (!options.circuit.empty())
+	{
+		if (!patchCircuit(options.circuit, loaded.flatten())) return false;
+		LOG(LOG_INFO, LOG_GENERAL) << input << " -> " << options.circuit << " ROM\n";
+	}
+	return true;
+}
+
+// assemble one file and write it out, reusing the workspace of the previous file
+bool assembleFile(const string& input, const string& output, const OutputOptions& options, Workspace& work)
+{
+	if (options.object)
+	{
+		ObjectModule module;
+		if (!assembleSource(input, work, module.absolute, &module, options)) return false;
+		if (!writeObject(output, module))
 		{
-			machineCode += "c2" + to_address(symbols[i + 1]);
-			address += 3;
+			LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: could not write " << output << "!\n";
+			return false;
 		}
-		else if (symbols[i] == "BNN" && i < symbols.size() - 1)
+		LOG(LOG_INFO, LOG_GENERAL) << input << " -> " << output << " (" << module.text.size() << " relocatable bytes, " << module.symbols.size() << " exported tags, "
+			<< module.relocations.size() << " relocations)\n";
+		return true;
+	}
+
+	MemoryImage image;
+	return assembleSource(input, work, image, nullptr, options) && writeProgram(input, output, image, options, work);
+}
+
+// link every input into one program; sources are assembled as object modules first, object files are read as they are
+bool linkFiles(const vector<string>& inputs, const string& output, const OutputOptions& options, Workspace& work)
+{
+	vector<ObjectModule> modules(inputs.size());
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		const string& input = inputs[i];
+		bool isObject = input.size() > 4 && input.compare(input.size() - 4, 4, ".obj") == 0;
+		if (isObject && !readObject(input, modules[i])) return false;
+		if (!isObject && !assembleSource(input, work, modules[i].absolute, &modules[i], options)) return false;
+		modules[i].name = input;
+	}
+
+	MemoryImage image;
+	if (!link(modules, image))
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: " << output << " failed to link!\n";
+		return false;
+	}
+	return writeProgram(inputs[0], output, image, options, work);
+}
+
+// assemble independent files on several threads, each handed the next file as it finishes the last and reusing its own
+// workspace; the messages of each file are held back until those of the files before it are out, so the output reads
+// the same as with a single thread
+int assembleInParallel(const vector<string>& inputs, const vector<string>& outputs, const OutputOptions& options, unsigned jobs)
+{
+	struct Job
+	{
+		string log;
+		bool failed = false;
+		bool done = false;
+	};
+	vector<Job> results(inputs.size());
+	atomic<size_t> next = 0;
+	mutex doneMutex;
+	condition_variable doneChanged;
+	LogLevel level = logger.level;
+	unsigned categories = logger.categories;
+
+	auto worker = [&]()
+	{
+		logger.level = level;
+		logger.categories = categories;
+		Workspace work;
+		for (size_t i = next++; i < inputs.size(); i = next++)
 		{
-			machineCode += "c4" + to_address(symbols[i + 1]);
-			address += 3;
+			logger.capture = &results[i].log;
+			bool assembled = assembleFile(inputs[i], outputs[i], options, work);
+			logger.flush();
+			logger.capture = nullptr;
+
+			lock_guard<mutex> lock(doneMutex);
+			results[i].failed = !assembled;
+			results[i].done = true;
+			doneChanged.notify_one();
 		}
-		else if (symbols[i] == "BNV" && i < symbols.size() - 1)
+	};
+	vector<thread> threads;
+	for (unsigned t = 0; t < jobs; ++t) threads.emplace_back(worker);
+
+	// print the messages of each file in order, as soon as it is done
+	int failures = 0;
+	for (Job& job : results)
+	{
+		unique_lock<mutex> lock(doneMutex);
+		doneChanged.wait(lock, [&] { return job.done; });
+		lock.unlock();
+		logger.stream.write(job.log.data(), job.log.size());
+		string().swap(job.log);
+		failures += job.failed;
+	}
+	for (thread& t : threads) t.join();
+	return failures;
+}
+
+int main(int argc, char* argv[])
+{
+	vector<string> inputs;
+	string output;
+	OutputOptions options;
+	unique_ptr<BuildCache> cache;
+	unsigned jobs = 1;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "--bench")
 		{
-			machineCode += "c8" + to_address(symbols[i + 1]);
-			address += 3;
+			runBenchmark();
+			return 0;
 		}
-		else if (symbols[i] == "JSR" && i < symbols.size() - 1)
+		else if (arg == "-h" || arg == "--help")
 		{
-			machineCode += "d0" + to_address(symbols[i + 1]);
-			address += 3;
+			printUsage();
+			return 0;
 		}
-		else if (symbols[i] == "RSR")
+		else if (arg == "-q") logger.level = LOG_ERROR;
+		else if (arg == "-v") logger.level = LOG_VERBOSE;
+		else if (arg == "-vv") logger.level = LOG_DEBUG;
+		else if (arg.compare(0, 6, "--log=") == 0)
 		{
-			machineCode += "e0";
-			++address;
+			// comma separated category names
+			logger.categories = 0;
+			for (size_t start = 6; start <= arg.size();)
+			{
+				size_t end = min(arg.find(',', start), arg.size());
+				int c = 0;
+				while (c < numLogCategories && arg.compare(start, end - start, logCategoryNames[c]) != 0) ++c;
+				if (c == numLogCategories)
+				{
+					LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: unknown log category " << arg.substr(start, end - start) << "!\n";
+					return 2;
+				}
+				logger.categories |= 1 << c;
+				start = end + 1;
+			}
 		}
-		else if (symbols[i] == "HLT")
+		else if (arg == "-o" && i + 1 < argc) output = argv[++i];
+		else if (arg.compare(0, 9, "--format=") == 0)
 		{
-			machineCode += "ff";
-			++address;
+			int f = 0;
+			while (f < NUM_OUTPUT_FORMATS && arg.compare(9, string::npos, formatNames[f]) != 0) ++f;
+			if (f == NUM_OUTPUT_FORMATS)
+			{
+				LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: unknown format " << arg.substr(9) << "!\n";
+				return 2;
+			}
+			options.format = (OutputFormat)f;
 		}
-
-		// memory directives
-		else if (symbols[i] == ".reserve" && i < symbols.size() - 1 && isInteger(symbols[i + 1]))
+		else if (arg.compare(0, 7, "--circ=") == 0) options.circuit = arg.substr(7);
+		else if (arg == "--boot") options.boot = true;
+		else if (arg == "--manifest") options.manifest = true;
+		else if (arg == "--listing") options.listing = true;
+		else if (arg == "--map") options.map = true;
+		else if (arg == "-c") options.object = true;
+		else if (arg == "--link") options.link = true;
+		else if (arg == "-O") options.optimize = true;
+		else if (arg == "--cache" || arg.compare(0, 8, "--cache=") == 0) cache = make_unique<BuildCache>(arg.size() > 8 ? arg.substr(8) : ".chasm-cache");
+		else if ((arg == "--jobs" && i + 1 < argc) || arg.compare(0, 7, "--jobs=") == 0)
 		{
-			int numBytes = integer(symbols[i + 1]);
-			for (int i = 0; i < numBytes; ++i)
+			// 0 uses a thread for every core
+			string count = arg == "--jobs" ? argv[++i] : arg.substr(7);
+			if (count.empty() || count.find_first_not_of("0123456789") != string::npos)
 			{
-				machineCode += "00";
-				++address;
+				LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: --jobs needs a number of threads!\n";
+				return 2;
 			}
+			jobs = stoul(count);
+			if (jobs == 0) jobs = max(thread::hardware_concurrency(), 1u);
 		}
-		else if (symbols[i] == ".org" && i < symbols.size() - 1 && isInteger(symbols[i + 1]))
+		else if (arg == "--batch" && i + 1 < argc)
 		{
-			int newAddress = integer(symbols[i + 1]);
-			if (newAddress < address)
+			// one filename per line, blank lines and // comments skipped
+			string listFilename = argv[++i];
+			ifstream listFile;
+			if (listFilename != "-") listFile.open(listFilename);
+			if (listFilename != "-" && !listFile)
 			{
-				cout << "ERROR: .org " << symbols[i + 1] << " is invalid because it would overwrite previous data!" << endl;
-				return "";
+				LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: could not read " << listFilename << "!\n";
+				return 2;
 			}
-			while (address != newAddress)
+			istream& list = listFilename == "-" ? cin : listFile;
+			string line;
+			while (getline(list, line))
 			{
-				machineCode += "00";
-				++address;
+				while (!line.empty() && isspace((unsigned char)line.back())) line.pop_back();
+				size_t start = line.find_first_not_of(" \t");
+				if (start == string::npos || line.compare(start, 2, "//") == 0) continue;
+				inputs.push_back(line.substr(start));
 			}
 		}
-		else if (symbols[i] == ".byte" && i < symbols.size() - 1 && isInteger(symbols[i + 1]))
+		else if (arg.size() > 1 && arg[0] == '-')
 		{
-			machineCode += to_immediate(symbols[i + 1]);
-			++address;
+			LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: unknown option " << arg << "!\n";
+			printUsage();
+			return 2;
 		}
-		else if (symbols[i] == ".string" && i < symbols.size() - 1 && symbols[i + 1][0] == '"' && symbols[i + 1].back() == '"')
-		{
-			string str = symbols[i + 1];
-			str.erase(0, 1);
-			str.pop_back();
+		else inputs.push_back(arg);
+	}
+	if (inputs.empty())
+	{
+		printUsage();
+		return 2;
+	}
+	// object files can only be linked
+	for (const string& input : inputs)
+		if (input.size() > 4 && input.compare(input.size() - 4, 4, ".obj") == 0) options.link = true;
+	if (options.object && options.link)
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: -c writes object files, they cannot be linked in the same run!\n";
+		return 2;
+	}
+	if ((options.listing || options.map) && (options.object || options.link))
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: --listing and --map only work for programs that are not linked!\n";
+		return 2;
+	}
+	if (!options.circuit.empty() && inputs.size() > 1 && !options.link)
+	{
+		LOG(LOG_ERROR, LOG_GENERAL) << "ERROR: --circ takes a single program!\n";
+		return 2;
+	}
 
-			for (int i = 0; i < str.length(); ++i)
-			{
-				if (str[i] == '\\' && i < str.length() - 1)
-				{
-					str.erase(i, 1);
-					if (str[i] == 'a') str[i] = '\a';
-					if (str[i] == 'b') str[i] = '\b';
-					if (str[i] == 'f') str[i] = '\f';
-					if (str[i] == 'n') str[i] = '\n';
-					if (str[i] == 'r') str[i] = '\r';
-					if (str[i] == 't') str[i] = '\t';
-					if (str[i] == 'v') str[i] = '\v';
-				}
-				machineCode += to_immediate(to_string(str[i]));
-				++address;
-			}
-			machineCode += "00"; // null terminator
-			++address;
+	options.cache = cache.get();
+
+	// linking makes one program out of every input
+	Workspace work;
+	string suffix = options.object ? ".obj" : formatSuffixes[options.format];
+	int failures = 0;
+	if (options.link) failures = !linkFiles(inputs, output.empty() ? outputFilename(inputs[0], "", suffix) : output, options, work);
+	else
+	{
+		// with several inputs, -o names the directory the outputs go in
+		bool outputIsFile = !output.empty() && inputs.size() == 1;
+		string outputDir = outputIsFile ? "" : output;
+		vector<string> outputs;
+		for (const string& input : inputs) outputs.push_back(outputIsFile ? output : outputFilename(input, outputDir, suffix));
+
+		// assemble every file, carrying on past failures so one run reports them all
+		auto start = chrono::steady_clock::now();
+		clock_t cpuStart = clock();
+		jobs = min<size_t>(jobs, inputs.size());
+		if (jobs > 1) failures = assembleInParallel(inputs, outputs, options, jobs);
+		else
+		{
+			for (size_t i = 0; i < inputs.size(); ++i)
+				if (!assembleFile(inputs[i], outputs[i], options, work)) ++failures;
+		}
+		if (failures && inputs.size() > 1)
+		{
+			LOG(LOG_INFO, LOG_GENERAL) << failures << " of " << inputs.size() << " files failed\n";
 		}
-		else if (symbols[i] == ".data" && i < symbols.size() - 1 && isInteger(symbols[i + 1]))
+		if (jobs > 1)
 		{
-			string hexData = to_hex(symbols[i + 1]);
-			if (hexData.size() % 2) hexData = "0" + hexData;
-			machineCode += hexData;
-			address += hexData.size() / 2;
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			double cpuSeconds = double(clock() - cpuStart) / CLOCKS_PER_SEC;
+			LOG(LOG_INFO, LOG_GENERAL) << inputs.size() << " files in " << seconds * 1e3 << " ms on " << jobs << " threads, "
+				<< cpuSeconds * 1e3 << " ms of CPU time (" << cpuSeconds / max(seconds, 1e-9) << " cores busy)\n";
 		}
 	}
-	return machineCode;
-}
 
-// function to write machine code from a string to a binary file
-void writeFile(string filename, string machineCode)
-{
-	ofstream fout(filename, ios::binary);
-
-	for (int i = 0; i < machineCode.length() - 1; i += 2)
+	if (cache)
 	{
-		string byteString = "0x";
-		byteString.push_back(machineCode[i]);
-		byteString.push_back(machineCode[i + 1]);
-		unsigned char byte = integer(byteString);
-		fout << byte;
+		LOG(LOG_VERBOSE, LOG_GENERAL) << "CACHE: " << cache->hits << " hits, " << cache->misses << " misses, "
+			<< cache->bytesSaved << " bytes of source not assembled\n";
 	}
 
-	fout.close();
-}
-
-int main()
-{
-	// get the source filename
-	string sourceFilename;
-	cout << "source filename: ";
-	getline(cin, sourceFilename);
-
-	// get the destination filename
-	string destFilename;
-	cout << "destination filename: ";
-	getline(cin, destFilename);
-
-	// load the file
-	string asmCode = loadFile(sourceFilename);
-
-	// assemble into binary machine code
-	string machineCode = assemble(asmCode);
-	if (machineCode.empty()) return 0;
-
-	// cout the hex code so we can paste it into logisim if desired
-
-	cout << "HEX DUMP: " << machineCode.length() / 2 << " bytes" << endl << endl;
-	for (int i = 0; i < machineCode.size() - 1; i += 2)
-		cout << (char)machineCode[i] << (char)machineCode[i + 1] << " ";
-	cout << endl << endl;
-
-	// write the resulting machine code to a file
-	writeFile(destFilename, machineCode);
-
 	// end program
-	return 0;
+	return failures ? 1 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,1558 @@
+/*
+
+An instruction-set emulator for the Chameleon CPU
+
+Runs the assembler's output natively instead of in Logisim.  The machine is modelled as the circuit
+sees it after a reset: 64K of RAM holding the program at address 0, an 8-bit accumulator, the CZNV
+flags register and an 8-bit stack pointer into page 0xff.  Every instruction takes the same number
+of clock cycles as in the circuit, counting the fetch:
+
+	NOP, LDI, ALI, ALA, PSH, HLT:  2 cycles
+	ALS, POP:                      3 cycles
+	LOD, ALM, STO, JMP:            4 cycles
+	BR, BN:                        4 cycles if taken, 6 if not
+	JSR, RSR:                      6 cycles
+
+Stack:
+	PSH writes the accumulator to 0xff00 + SP, then increments SP
+	POP and ALS decrement SP, then read 0xff00 + SP
+	JSR pushes the address of its operand (low byte first), RSR pops it and returns just past it
+
+Devices:
+	0xfeff: console, a store writes the low 7 bits to the terminal
+
+Engines:
+	switch:    fetches and decodes every instruction from memory as it runs it
+	threaded:  decodes each instruction once into a handler address and operand, and jumps from one
+	           handler straight to the next (computed goto, GCC and Clang only).  Programs patch their
+	           own operands, so a store to a byte that has been decoded drops the instructions that
+	           could cover it, and they are decoded again when they next run
+	jit:       translates each basic block, up to a jump, branch, JSR, RSR or HLT, to x86-64 code with the
+	           accumulator and flags kept in host registers, and links blocks that jump to each other so
+	           they run without returning to the dispatcher.  A store to a byte a block was translated from
+	           leaves it and drops the block; operands that have been patched before are read as the block
+	           runs from then on, and blocks that keep changing, code in the stack page and anything on a
+	           machine other than x86-64 are left to the interpreters
+*/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <cstddef>
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+// condition flags, in the same order as the low nibble of BR and BN
+enum ConditionFlag : uint8_t
+{
+	FLAG_C = 0x1,
+	FLAG_Z = 0x2,
+	FLAG_N = 0x4,
+	FLAG_V = 0x8
+};
+
+// high nibble of each opcode
+enum Operation : uint8_t
+{
+	OP_NOP, OP_ALM, OP_ALA, OP_ALI, OP_ALS, OP_LOD, OP_LDI, OP_STO,
+	OP_PSH, OP_POP, OP_JMP, OP_BR, OP_BN, OP_JSR, OP_RSR, OP_HLT
+};
+
+// ALU operations, the low nibble of ALM, ALA, ALI and ALS
+enum AluOperation : uint8_t
+{
+	ALU_ADD, ALU_ADC, ALU_SUB, ALU_SBB, ALU_ONC, ALU_TWC, ALU_AND, ALU_OR,
+	ALU_XOR, ALU_LSL, ALU_LSR, ALU_ASR, ALU_ROL, ALU_ROR, ALU_RCL, ALU_RCR
+};
+
+// clock cycles taken by each operation, including the fetch
+constexpr uint8_t cycleCounts[16] = { 2, 4, 2, 2, 3, 4, 2, 4, 2, 3, 4, 4, 4, 6, 6, 2 };
+
+// extra cycles a branch takes when it falls through
+constexpr uint8_t branchNotTakenCycles = 2;
+
+constexpr uint32_t memorySize = 0x10000;
+constexpr uint16_t stackPage = 0xff00;
+constexpr uint16_t consoleAddress = 0xfeff;
+
+// ways of running a program, from the simplest to the fastest
+enum Engine : uint8_t
+{
+	ENGINE_SWITCH,
+	ENGINE_THREADED,
+	ENGINE_JIT
+};
+
+const char* engineNames[] = { "switch", "threaded", "jit" };
+constexpr int numEngines = sizeof(engineNames) / sizeof(engineNames[0]);
+
+// bytes taken by each operation, including the opcode
+constexpr uint8_t instructionLengths[16] = { 1, 3, 1, 2, 1, 3, 2, 3, 1, 1, 3, 3, 3, 3, 1, 1 };
+
+// an instruction as the threaded interpreter keeps it
+struct DecodedInstruction
+{
+	const void* handler;	// code that runs it, or the decoder if it has not been decoded since it was last written
+	uint16_t operand;		// address, immediate value or branch target
+	uint8_t condition;		// flags a branch tests
+};
+
+// result of an ALU operation along with the new flags
+struct AluResult
+{
+	uint8_t value;
+	uint8_t flags;
+};
+
+// the second operand comes from memory, the accumulator, an immediate value or the stack, the unary operations only use it
+inline AluResult alu(uint8_t operation, uint8_t a, uint8_t b, uint8_t flags)
+{
+	unsigned carryIn = flags & FLAG_C;
+	unsigned result;
+	uint8_t carry = 0, overflow = 0;
+
+	switch (operation)
+	{
+	case ALU_ADD:
+		carryIn = 0;
+		// fall through
+	case ALU_ADC:
+		result = a + b + carryIn;
+		carry = result >> 8;
+		overflow = ~(a ^ b) & (a ^ result) & 0x80;
+		break;
+	case ALU_SUB:
+		carryIn = 1;
+		// fall through
+	case ALU_SBB:
+		// subtraction adds the complement, so carry set means no borrow
+		result = a + (uint8_t)~b + carryIn;
+		carry = result >> 8;
+		overflow = (a ^ b) & (a ^ result) & 0x80;
+		break;
+	case ALU_ONC:
+		result = (uint8_t)~b;
+		break;
+	case ALU_TWC:
+		result = (uint8_t)~b + 1;
+		carry = result >> 8;
+		overflow = b == 0x80;
+		break;
+	case ALU_AND:
+		result = a & b;
+		break;
+	case ALU_OR:
+		result = a | b;
+		break;
+	case ALU_XOR:
+		result = a ^ b;
+		break;
+	case ALU_LSL:
+		result = b << 1;
+		carry = b >> 7;
+		break;
+	case ALU_LSR:
+		result = b >> 1;
+		carry = b & 1;
+		break;
+	case ALU_ASR:
+		result = (b >> 1) | (b & 0x80);
+		carry = b & 1;
+		break;
+	case ALU_ROL:
+		result = (b << 1) | (b >> 7);
+		carry = b >> 7;
+		break;
+	case ALU_ROR:
+		result = (b >> 1) | (b << 7);
+		carry = b & 1;
+		break;
+	case ALU_RCL:
+		result = (b << 1) | carryIn;
+		carry = b >> 7;
+		break;
+	default: // ALU_RCR
+		result = (b >> 1) | (carryIn << 7);
+		carry = b & 1;
+		break;
+	}
+
+	uint8_t value = (uint8_t)result;
+	return { value, (uint8_t)((carry ? FLAG_C : 0) | (value == 0 ? FLAG_Z : 0) | (value & 0x80 ? FLAG_N : 0) | (overflow ? FLAG_V : 0)) };
+}
+
+class Jit;
+
+// state of the CPU and its memory
+struct Machine
+{
+	uint8_t memory[memorySize] = {};
+	uint16_t pc = 0;
+	uint8_t a = 0;
+	uint8_t flags = 0;
+	uint8_t sp = 0;
+	bool halted = false;
+	uint64_t cycles = 0;
+	uint64_t instructions = 0;
+	string console;			// characters written to the console and not yet flushed
+	unique_ptr<DecodedInstruction[]> decoded;	// the threaded interpreter's copy of memory, one entry per address
+	unique_ptr<uint8_t[]> covered;				// which byte of a decoded instruction each address is, 0 for none
+	vector<uint16_t> coveredAddresses;			// the addresses covered is set for, so the next run only clears those
+	unique_ptr<Jit> jit;						// translations of the program to native code
+
+	// clears the registers and counters, memory is kept like in the circuit
+	void reset()
+	{
+		pc = 0;
+		a = 0;
+		flags = 0;
+		sp = 0;
+		halted = false;
+		cycles = 0;
+		instructions = 0;
+	}
+
+	bool load(const vector<uint8_t>& program)
+	{
+		if (program.size() > memorySize) return false;
+		memset(memory, 0, sizeof(memory));
+		memcpy(memory, program.data(), program.size());
+		reset();
+		return true;
+	}
+
+	void flushConsole()
+	{
+		fwrite(console.data(), 1, console.size(), stdout);
+		fflush(stdout);
+		console.clear();
+	}
+
+	// runs until HLT or until the cycle limit is reached, returns true if the program halted
+	bool run(uint64_t maxCycles);
+	bool runThreaded(uint64_t maxCycles);
+	bool runJit(uint64_t maxCycles);
+
+	bool run(uint64_t maxCycles, Engine engine)
+	{
+		if (engine == ENGINE_JIT) return runJit(maxCycles);
+		return engine == ENGINE_THREADED ? runThreaded(maxCycles) : run(maxCycles);
+	}
+};
+
+// the sixteen opcodes sharing a high nibble
+#define CASES16(operation) \
+	case operation << 4 | 0x0: case operation << 4 | 0x1: case operation << 4 | 0x2: case operation << 4 | 0x3: \
+	case operation << 4 | 0x4: case operation << 4 | 0x5: case operation << 4 | 0x6: case operation << 4 | 0x7: \
+	case operation << 4 | 0x8: case operation << 4 | 0x9: case operation << 4 | 0xa: case operation << 4 | 0xb: \
+	case operation << 4 | 0xc: case operation << 4 | 0xd: case operation << 4 | 0xe: case operation << 4 | 0xf
+
+// one case for each operand mode of an ALU operation, so the operation is a constant in each of them
+#define ALU_CASES(operation) \
+	case OP_ALM << 4 | operation: \
+		aluResult = alu(operation, a, mem[(uint16_t)(mem[(uint16_t)(pc + 1)] | (mem[(uint16_t)(pc + 2)] << 8))], flags); \
+		pc += 3; \
+		goto aluDone; \
+	case OP_ALA << 4 | operation: \
+		aluResult = alu(operation, a, a, flags); \
+		pc += 1; \
+		goto aluDone; \
+	case OP_ALI << 4 | operation: \
+		aluResult = alu(operation, a, mem[(uint16_t)(pc + 1)], flags); \
+		pc += 2; \
+		goto aluDone; \
+	case OP_ALS << 4 | operation: \
+		aluResult = alu(operation, a, mem[stackPage | --sp], flags); \
+		pc += 1; \
+		goto aluDone
+
+bool Machine::run(uint64_t maxCycles)
+{
+	// work on locals so the compiler can keep them in registers
+	uint16_t pc = this->pc;
+	uint8_t a = this->a, flags = this->flags, sp = this->sp;
+	uint64_t cycles = this->cycles, instructions = this->instructions;
+	uint8_t* mem = memory;
+	AluResult aluResult;
+
+	if (halted) return true;
+	while (cycles < maxCycles)
+	{
+		// dispatching on the whole opcode lets each ALU operation be inlined with its mode
+		uint8_t opcode = mem[pc];
+		cycles += cycleCounts[opcode >> 4];
+		++instructions;
+
+		switch (opcode)
+		{
+		ALU_CASES(ALU_ADD);
+		ALU_CASES(ALU_ADC);
+		ALU_CASES(ALU_SUB);
+		ALU_CASES(ALU_SBB);
+		ALU_CASES(ALU_ONC);
+		ALU_CASES(ALU_TWC);
+		ALU_CASES(ALU_AND);
+		ALU_CASES(ALU_OR);
+		ALU_CASES(ALU_XOR);
+		ALU_CASES(ALU_LSL);
+		ALU_CASES(ALU_LSR);
+		ALU_CASES(ALU_ASR);
+		ALU_CASES(ALU_ROL);
+		ALU_CASES(ALU_ROR);
+		ALU_CASES(ALU_RCL);
+		ALU_CASES(ALU_RCR);
+		aluDone:
+			a = aluResult.value;
+			flags = aluResult.flags;
+			break;
+		CASES16(OP_NOP):
+			pc += 1;
+			break;
+		CASES16(OP_LOD):
+			a = mem[(uint16_t)(mem[(uint16_t)(pc + 1)] | (mem[(uint16_t)(pc + 2)] << 8))];
+			pc += 3;
+			break;
+		CASES16(OP_LDI):
+			a = mem[(uint16_t)(pc + 1)];
+			pc += 2;
+			break;
+		CASES16(OP_STO):
+		{
+			uint16_t address = mem[(uint16_t)(pc + 1)] | (mem[(uint16_t)(pc + 2)] << 8);
+			mem[address] = a;
+			if (address == consoleAddress) console += (char)(a & 0x7f);
+			pc += 3;
+			break;
+		}
+		CASES16(OP_PSH):
+			mem[stackPage | sp++] = a;
+			pc += 1;
+			break;
+		CASES16(OP_POP):
+			a = mem[stackPage | --sp];
+			pc += 1;
+			break;
+		CASES16(OP_BR):
+			// the condition is met if any of the flags in the low nibble are set
+			if (flags & opcode) goto jump;
+			cycles += branchNotTakenCycles;
+			pc += 3;
+			break;
+		CASES16(OP_BN):
+			if (!(flags & opcode & 0xf)) goto jump;
+			cycles += branchNotTakenCycles;
+			pc += 3;
+			break;
+		CASES16(OP_JMP):
+		jump:
+			pc = mem[(uint16_t)(pc + 1)] | (mem[(uint16_t)(pc + 2)] << 8);
+			break;
+		CASES16(OP_JSR):
+		{
+			uint16_t ret = pc + 1;
+			mem[stackPage | sp++] = (uint8_t)ret;
+			mem[stackPage | sp++] = ret >> 8;
+			pc = mem[ret] | (mem[(uint16_t)(ret + 1)] << 8);
+			break;
+		}
+		CASES16(OP_RSR):
+		{
+			uint16_t ret = mem[stackPage | --sp] << 8;
+			ret |= mem[stackPage | --sp];
+			pc = ret + 2;
+			break;
+		}
+		CASES16(OP_HLT):
+			halted = true;
+			goto done;
+		}
+	}
+
+done:
+	this->pc = pc;
+	this->a = a;
+	this->flags = flags;
+	this->sp = sp;
+	this->cycles = cycles;
+	this->instructions = instructions;
+	return halted;
+}
+
+#if defined(__GNUC__)
+
+// the four handlers of an ALU operation, one for each operand mode
+#define THREADED_ALU_HANDLERS(operation) \
+	alm_##operation: \
+		cycles += cycleCounts[OP_ALM]; \
+		aluResult = alu(operation, a, mem[entry->operand], flags); \
+		a = aluResult.value; \
+		flags = aluResult.flags; \
+		pc += 3; \
+		DISPATCH(); \
+	ala_##operation: \
+		cycles += cycleCounts[OP_ALA]; \
+		aluResult = alu(operation, a, a, flags); \
+		a = aluResult.value; \
+		flags = aluResult.flags; \
+		pc += 1; \
+		DISPATCH(); \
+	ali_##operation: \
+		cycles += cycleCounts[OP_ALI]; \
+		aluResult = alu(operation, a, (uint8_t)entry->operand, flags); \
+		a = aluResult.value; \
+		flags = aluResult.flags; \
+		pc += 2; \
+		DISPATCH(); \
+	als_##operation: \
+		cycles += cycleCounts[OP_ALS]; \
+		aluResult = alu(operation, a, mem[stackPage | --sp], flags); \
+		a = aluResult.value; \
+		flags = aluResult.flags; \
+		pc += 1; \
+		DISPATCH()
+
+#define ALU_HANDLER_ROW(mode) \
+	{ &&mode##_ALU_ADD, &&mode##_ALU_ADC, &&mode##_ALU_SUB, &&mode##_ALU_SBB, &&mode##_ALU_ONC, &&mode##_ALU_TWC, &&mode##_ALU_AND, &&mode##_ALU_OR, \
+	  &&mode##_ALU_XOR, &&mode##_ALU_LSL, &&mode##_ALU_LSR, &&mode##_ALU_ASR, &&mode##_ALU_ROL, &&mode##_ALU_ROR, &&mode##_ALU_RCL, &&mode##_ALU_RCR }
+
+#define STRINGIFY2(x) #x
+#define STRINGIFY(x) STRINGIFY2(x)
+
+// the next instruction.  The empty asm statement differs in each handler, which stops the compiler from merging them
+// all into one shared indirect jump that the branch predictor cannot tell apart
+#define DISPATCH() \
+	do \
+	{ \
+		entry = &code[pc]; \
+		++instructions; \
+		const void* target = entry->handler; \
+		asm volatile("# dispatch " STRINGIFY(__COUNTER__) : "+r"(target)); \
+		goto *target; \
+	} while (0)
+
+// the next instruction, unless the run is close enough to the cycle limit that it has to be checked before every one.
+// Only NOP, the jumps and the decoder check, which is enough as the others all move on to the next address: at most one
+// instruction per byte of memory can run before reaching one that checks.  A store that changes code needs no check of
+// its own, since whatever it changed goes back through the decoder
+#define DISPATCH_CHECKED() \
+	do \
+	{ \
+		if (__builtin_expect(cycles >= limit, 0)) goto slow; \
+		DISPATCH(); \
+	} while (0)
+
+// a store that keeps the decoded instructions in step with memory.  covered holds which byte of a decoded instruction
+// the address is: a new opcode drops the instruction starting there and the two before it, while a new operand byte is
+// written straight into the instruction it belongs to, so code that patches its own addresses never goes back through
+// the decoder.  Any other instruction that could overlap the byte is dropped
+#define WRITE(address, value) \
+	do \
+	{ \
+		uint16_t at = address; \
+		uint8_t written = value; \
+		mem[at] = written; \
+		switch (covered[at]) \
+		{ \
+		case 0: \
+			break; \
+		case 2: \
+			code[(uint16_t)(at - 1)].operand = (code[(uint16_t)(at - 1)].operand & 0xff00) | written; \
+			code[at].handler = &&decode; \
+			code[(uint16_t)(at - 2)].handler = &&decode; \
+			break; \
+		case 3: \
+			code[(uint16_t)(at - 2)].operand = (code[(uint16_t)(at - 2)].operand & 0x00ff) | (written << 8); \
+			code[at].handler = &&decode; \
+			code[(uint16_t)(at - 1)].handler = &&decode; \
+			break; \
+		default: \
+			code[at].handler = &&decode; \
+			code[(uint16_t)(at - 1)].handler = &&decode; \
+			code[(uint16_t)(at - 2)].handler = &&decode; \
+		} \
+	} while (0)
+
+bool Machine::runThreaded(uint64_t maxCycles)
+{
+	static const void* const aluHandlers[4][16] = { ALU_HANDLER_ROW(alm), ALU_HANDLER_ROW(ala), ALU_HANDLER_ROW(ali), ALU_HANDLER_ROW(als) };
+	static const void* const handlers[16] = { &&nop, nullptr, nullptr, nullptr, nullptr, &&lod, &&ldi, &&sto, &&psh, &&pop, &&jmp, &&br, &&bn, &&jsr, &&rsr, &&hlt };
+
+	if (halted) return true;
+
+	// nothing is decoded yet, since memory may have changed since the last run; only an address covered by a decoded
+	// instruction can hold one, so those are all that have to be cleared
+	if (!decoded)
+	{
+		decoded.reset(new DecodedInstruction[memorySize]);
+		covered.reset(new uint8_t[memorySize]);
+		for (uint32_t address = 0; address < memorySize; ++address) decoded[address] = { &&decode, 0, 0 };
+		memset(covered.get(), 0, memorySize);
+	}
+	DecodedInstruction* code = decoded.get();
+	for (uint16_t address : coveredAddresses)
+	{
+		code[address].handler = &&decode;
+		covered[address] = 0;
+	}
+	coveredAddresses.clear();
+
+	uint16_t pc = this->pc;
+	uint8_t a = this->a, flags = this->flags, sp = this->sp;
+	uint64_t cycles = this->cycles, instructions = this->instructions;
+	uint8_t* mem = memory;
+	uint8_t* covered = this->covered.get();
+	const DecodedInstruction* entry;
+	AluResult aluResult;
+
+	// the longest an instruction can take, times one more than the instructions that can run between two checks
+	const uint64_t slack = (memorySize + 1) * (cycleCounts[OP_JSR] + branchNotTakenCycles);
+	uint64_t limit = maxCycles > slack ? maxCycles - slack : 0;
+	bool nearLimit = false;
+	DISPATCH_CHECKED();
+
+decode:
+	{
+		if (__builtin_expect(cycles >= limit, 0))
+		{
+			// the instruction has not run yet
+			--instructions;
+			goto slow;
+		}
+
+		// the decoder stands in for an instruction until it runs
+		uint8_t opcode = mem[pc];
+		uint8_t operation = opcode >> 4;
+		uint8_t length = instructionLengths[operation];
+		DecodedInstruction& instruction = code[pc];
+		const void* handler = operation >= OP_ALM && operation <= OP_ALS ? aluHandlers[operation - OP_ALM][opcode & 0xf] : handlers[operation];
+		instruction.operand = length == 2 ? mem[(uint16_t)(pc + 1)] : mem[(uint16_t)(pc + 1)] | (mem[(uint16_t)(pc + 2)] << 8);
+		instruction.condition = opcode & 0xf;
+
+		// one that runs off the end of memory carries on at 0 without a jump, so it is decoded every time to check the limit
+		if (pc + length < memorySize)
+		{
+			instruction.handler = handler;
+			for (uint8_t i = 0; i < length; ++i)
+			{
+				uint16_t at = pc + i;
+				if (!covered[at]) coveredAddresses.push_back(at);
+				covered[at] = i + 1;
+			}
+		}
+		entry = &instruction;
+		goto *handler;
+	}
+
+	THREADED_ALU_HANDLERS(ALU_ADD);
+	THREADED_ALU_HANDLERS(ALU_ADC);
+	THREADED_ALU_HANDLERS(ALU_SUB);
+	THREADED_ALU_HANDLERS(ALU_SBB);
+	THREADED_ALU_HANDLERS(ALU_ONC);
+	THREADED_ALU_HANDLERS(ALU_TWC);
+	THREADED_ALU_HANDLERS(ALU_AND);
+	THREADED_ALU_HANDLERS(ALU_OR);
+	THREADED_ALU_HANDLERS(ALU_XOR);
+	THREADED_ALU_HANDLERS(ALU_LSL);
+	THREADED_ALU_HANDLERS(ALU_LSR);
+	THREADED_ALU_HANDLERS(ALU_ASR);
+	THREADED_ALU_HANDLERS(ALU_ROL);
+	THREADED_ALU_HANDLERS(ALU_ROR);
+	THREADED_ALU_HANDLERS(ALU_RCL);
+	THREADED_ALU_HANDLERS(ALU_RCR);
+
+nop:
+	cycles += cycleCounts[OP_NOP];
+	pc += 1;
+	DISPATCH_CHECKED();
+lod:
+	cycles += cycleCounts[OP_LOD];
+	a = mem[entry->operand];
+	pc += 3;
+	DISPATCH();
+ldi:
+	cycles += cycleCounts[OP_LDI];
+	a = (uint8_t)entry->operand;
+	pc += 2;
+	DISPATCH();
+sto:
+	cycles += cycleCounts[OP_STO];
+	{
+		// the address is kept, since the store may patch its own operand
+		uint16_t address = entry->operand;
+		WRITE(address, a);
+		if (address == consoleAddress) console += (char)(a & 0x7f);
+		pc += 3;
+		DISPATCH();
+	}
+psh:
+	cycles += cycleCounts[OP_PSH];
+	WRITE(stackPage | sp++, a);
+	pc += 1;
+	DISPATCH();
+pop:
+	cycles += cycleCounts[OP_POP];
+	a = mem[stackPage | --sp];
+	pc += 1;
+	DISPATCH();
+br:
+	cycles += cycleCounts[OP_BR];
+	if (flags & entry->condition) goto jump;
+	cycles += branchNotTakenCycles;
+	pc += 3;
+	DISPATCH_CHECKED();
+bn:
+	cycles += cycleCounts[OP_BN];
+	if (!(flags & entry->condition)) goto jump;
+	cycles += branchNotTakenCycles;
+	pc += 3;
+	DISPATCH_CHECKED();
+jmp:
+	cycles += cycleCounts[OP_JMP];
+jump:
+	pc = entry->operand;
+	DISPATCH_CHECKED();
+jsr:
+	cycles += cycleCounts[OP_JSR];
+	{
+		// the target is read after the return address is pushed, in case the push overwrote it
+		uint16_t ret = pc + 1;
+		WRITE(stackPage | sp++, (uint8_t)ret);
+		WRITE(stackPage | sp++, ret >> 8);
+		pc = mem[ret] | (mem[(uint16_t)(ret + 1)] << 8);
+		DISPATCH_CHECKED();
+	}
+rsr:
+	cycles += cycleCounts[OP_RSR];
+	{
+		uint16_t ret = mem[stackPage | --sp] << 8;
+		ret |= mem[stackPage | --sp];
+		pc = ret + 2;
+		DISPATCH_CHECKED();
+	}
+hlt:
+	cycles += cycleCounts[OP_HLT];
+	halted = true;
+	goto done;
+slow:
+	// the switch interpreter finishes the run, since it checks the limit before every instruction
+	nearLimit = true;
+done:
+	this->pc = pc;
+	this->a = a;
+	this->flags = flags;
+	this->sp = sp;
+	this->cycles = cycles;
+	this->instructions = instructions;
+	return nearLimit ? run(maxCycles) : halted;
+}
+
+#undef THREADED_ALU_HANDLERS
+#undef ALU_HANDLER_ROW
+#undef DISPATCH
+#undef DISPATCH_CHECKED
+#undef STRINGIFY
+#undef STRINGIFY2
+#undef WRITE
+
+#else
+
+// computed goto is a GNU extension, other compilers use the switch interpreter
+bool Machine::runThreaded(uint64_t maxCycles)
+{
+	return run(maxCycles);
+}
+
+#endif
+
+#if defined(__x86_64__) && defined(__unix__)
+
+// why the translated code handed control back to the dispatcher
+enum JitExit : uint32_t
+{
+	JIT_EXIT_JUMP,		// to an address that has not been translated yet
+	JIT_EXIT_WRITE,		// a store changed translated code
+	JIT_EXIT_HALT,
+	JIT_EXIT_BUDGET		// the next block could run past the cycle limit
+};
+
+// what the translated code works on, addressed from r12
+struct JitContext
+{
+	uint64_t cycles;
+	uint64_t instructions;
+	uint64_t maxCycles;
+	uint8_t* memory;
+	Machine* machine;
+	uint32_t pc;
+	uint32_t exitReason;
+	uint32_t writeAddress;
+	uint8_t a;
+	uint8_t flags;
+	uint8_t sp;
+	uint16_t codeCounts[memorySize];	// blocks translated from each byte, a store to a byte with any has to drop them
+	const void* blockAt[memorySize];	// translation of the block starting at each address
+};
+
+// a translated block, and the bytes it was translated from
+struct JitBlock
+{
+	uint16_t start;
+	bool valid;
+	vector<uint16_t> bytes;
+};
+
+// a jump from the end of one block to the start of another, which goes through a stub back to the dispatcher until the
+// other block is translated
+struct JitLink
+{
+	uint32_t site;		// offset of the jump's rel32
+	uint32_t stub;
+	int32_t next;		// next link to the same address
+};
+
+// an instruction of the block being translated
+struct JitInstruction
+{
+	uint16_t pc;
+	uint8_t opcode;
+	uint16_t operand;
+	bool dynamicOperand;	// the address is read when the instruction runs, since the program keeps patching it
+};
+
+// how the flags of an ALU operation come out of the host's flags
+enum JitFlags : uint8_t
+{
+	JIT_FLAGS_DIRECT,		// C, Z, N and V are the host's CF, ZF, SF and OF
+	JIT_FLAGS_BORROW,		// the same but C is the inverse of CF, since the host subtracts with a borrow
+	JIT_FLAGS_NO_OVERFLOW,	// V is clear, the host sets OF differently
+	JIT_FLAGS_TEST			// Z and N come from testing the result, the host rotations leave ZF and SF alone
+};
+
+static void jitConsole(Machine* machine, uint32_t a);
+
+// translates the basic blocks of a program to x86-64 code, which keeps the accumulator in r14, the flags in r15, the
+// stack pointer in rbp, the cycle and instruction counts in r13 and r11 and memory in rbx
+class Jit
+{
+public:
+	static constexpr size_t codeSize = 16 << 20;
+	static constexpr size_t maxBlockInstructions = 64;
+	static constexpr int maxInvalidations = 16;		// a block changed this often is left to the interpreter
+
+	JitContext context;
+
+	Jit(Machine* machine)
+	{
+		void* buffer = mmap(nullptr, codeSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		code = buffer == MAP_FAILED ? nullptr : (uint8_t*)buffer;
+		context.machine = machine;
+		context.memory = machine->memory;
+		if (code) emitEntry();
+	}
+
+	~Jit()
+	{
+		if (code) munmap(code, codeSize);
+	}
+
+	bool available() const { return code != nullptr; }
+
+	// forget everything translated and learned about the program, its memory may have changed completely
+	void reset()
+	{
+		flush();
+		memset(patchCounts, 0, sizeof(patchCounts));
+		memset(invalidations, 0, sizeof(invalidations));
+	}
+
+	// runs translated code from the start of a block until it exits
+	void enter(const void* block)
+	{
+		((void (*)(JitContext*, const void*))code)(&context, block);
+	}
+
+	const void* lookup(uint16_t pc)
+	{
+		return context.blockAt[pc] ? context.blockAt[pc] : translate(pc);
+	}
+
+	// drops the blocks translated from a byte that has been stored to
+	void invalidate(uint16_t address)
+	{
+		if (!context.codeCounts[address]) return;
+		if (patchCounts[address] < 255) ++patchCounts[address];
+		for (uint32_t id : pageBlocks[address >> 8])
+		{
+			JitBlock& block = blocks[id];
+			if (block.valid && find(block.bytes.begin(), block.bytes.end(), address) != block.bytes.end()) invalidateBlock(block);
+		}
+	}
+
+private:
+	uint8_t* code;
+	size_t used = 0;
+	size_t entrySize = 0;			// the entry and exit code at the start of the buffer, which is kept when it is flushed
+	uint32_t epilogue = 0;
+	vector<JitBlock> blocks;
+	vector<uint32_t> pageBlocks[memorySize >> 8];
+	vector<JitLink> links;
+	int32_t firstLink[memorySize];
+	uint8_t patchCounts[memorySize];	// times each byte of code has been stored to
+	uint8_t invalidations[memorySize];	// times the block starting at each address has been dropped
+	vector<JitInstruction> instructions;
+
+	void flush()
+	{
+		used = entrySize;
+		blocks.clear();
+		links.clear();
+		for (auto& page : pageBlocks) page.clear();
+		memset(context.codeCounts, 0, sizeof(context.codeCounts));
+		memset(context.blockAt, 0, sizeof(context.blockAt));
+		memset(firstLink, 0xff, sizeof(firstLink));
+	}
+
+	void invalidateBlock(JitBlock& block)
+	{
+		block.valid = false;
+		context.blockAt[block.start] = nullptr;
+		for (uint16_t address : block.bytes) --context.codeCounts[address];
+		for (int32_t link = firstLink[block.start]; link >= 0; link = links[link].next) patch(links[link].site, links[link].stub);
+		if (++invalidations[block.start] > maxInvalidations) invalidations[block.start] = maxInvalidations + 1;
+	}
+
+	// machine code
+	void byte(uint8_t value) { code[used++] = value; }
+	void bytes(initializer_list<uint8_t> values) { for (uint8_t value : values) code[used++] = value; }
+	void u32(uint32_t value) { memcpy(code + used, &value, 4); used += 4; }
+	void u64(uint64_t value) { memcpy(code + used, &value, 8); used += 8; }
+	void patch(uint32_t site, uint32_t target) { int32_t offset = target - (site + 4); memcpy(code + site, &offset, 4); }
+	void patch8(uint32_t site) { code[site] = used - (site + 1); }
+
+	// [r12 + field] and [rbx + rbp + stack page] as the memory operand of an instruction whose register field is reg
+	void field(uint8_t reg, size_t offset) { bytes({ (uint8_t)(0x84 | (reg & 7) << 3), 0x24 }); u32(offset); }
+	void stackTop(uint8_t reg) { bytes({ (uint8_t)(0x84 | (reg & 7) << 3), 0x2b }); u32(stackPage); }
+
+	// the code at the start of the buffer, which enters a block with the registers loaded from the context and
+	// stores them back when a block exits
+	void emitEntry()
+	{
+		bytes({ 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });	// push rbx, rbp, r12, r13, r14, r15
+		bytes({ 0x48, 0x83, 0xec, 0x08 });										// sub rsp, 8
+		bytes({ 0x49, 0x89, 0xfc });											// mov r12, rdi
+		bytes({ 0x49, 0x8b }); field(3, offsetof(JitContext, memory));		// mov rbx, [memory]
+		bytes({ 0x4d, 0x8b }); field(13, offsetof(JitContext, cycles));		// mov r13, [cycles]
+		bytes({ 0x4d, 0x8b }); field(11, offsetof(JitContext, instructions));	// mov r11, [instructions]
+		bytes({ 0x45, 0x0f, 0xb6 }); field(14, offsetof(JitContext, a));		// movzx r14d, byte [a]
+		bytes({ 0x45, 0x0f, 0xb6 }); field(15, offsetof(JitContext, flags));	// movzx r15d, byte [flags]
+		bytes({ 0x41, 0x0f, 0xb6 }); field(5, offsetof(JitContext, sp));		// movzx ebp, byte [sp]
+		bytes({ 0xff, 0xe6 });													// jmp rsi
+
+		epilogue = used;
+		bytes({ 0x4d, 0x89 }); field(13, offsetof(JitContext, cycles));		// mov [cycles], r13
+		bytes({ 0x4d, 0x89 }); field(11, offsetof(JitContext, instructions));	// mov [instructions], r11
+		bytes({ 0x45, 0x88 }); field(14, offsetof(JitContext, a));			// mov [a], r14b
+		bytes({ 0x45, 0x88 }); field(15, offsetof(JitContext, flags));		// mov [flags], r15b
+		bytes({ 0x41, 0x88 }); field(5, offsetof(JitContext, sp));			// mov [sp], bpl
+		bytes({ 0x48, 0x83, 0xc4, 0x08 });										// add rsp, 8
+		bytes({ 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, 0xc3 });	// pop r15, r14, r13, r12, rbp, rbx; ret
+		entrySize = used;
+		flush();
+	}
+
+	// counts the cycles and instructions run so far in the block
+	void emitCount(uint32_t cycles, uint32_t count)
+	{
+		bytes({ 0x49, 0x81, 0xc5 }); u32(cycles);							// add r13, cycles
+		bytes({ 0x49, 0x81, 0xc3 }); u32(count);							// add r11, count
+	}
+
+	void emitExit(JitExit reason, uint32_t pc)
+	{
+		bytes({ 0x41, 0xc7 }); field(0, offsetof(JitContext, pc)); u32(pc);				// mov dword [pc], pc
+		bytes({ 0x41, 0xc7 }); field(0, offsetof(JitContext, exitReason)); u32(reason);	// mov dword [exitReason], reason
+		byte(0xe9); u32(0); patch(used - 4, epilogue);										// jmp epilogue
+	}
+
+	// a jump to another block, linked straight to it once it has been translated
+	void emitChain(uint16_t target, uint32_t cycles, uint32_t count)
+	{
+		emitCount(cycles, count);
+		byte(0xe9); u32(0);		// jmp stub
+		JitLink link = { (uint32_t)used - 4, (uint32_t)used, firstLink[target] };
+		emitExit(JIT_EXIT_JUMP, target);
+		firstLink[target] = links.size();
+		links.push_back(link);
+		if (context.blockAt[target]) patch(link.site, (const uint8_t*)context.blockAt[target] - code);
+	}
+
+	// a store to memory with the address in eax or constant, which leaves the block if it changed translated code
+	void emitStore(const JitInstruction& instruction, uint32_t cycles, uint32_t count)
+	{
+		if (instruction.dynamicOperand)
+		{
+			bytes({ 0x0f, 0xb7, 0x83 }); u32(instruction.pc + 1);				// movzx eax, word [rbx + operand]
+			bytes({ 0x44, 0x88, 0x34, 0x03 });									// mov [rbx + rax], r14b
+			bytes({ 0x3d }); u32(consoleAddress);								// cmp eax, console
+			bytes({ 0x75, 0 });													// jne skip
+			uint32_t skip = used - 1;
+			emitConsole();
+			bytes({ 0xb8 }); u32(consoleAddress);								// mov eax, console
+			patch8(skip);
+			bytes({ 0x66, 0x41, 0x83, 0xbc, 0x44 }); u32(offsetof(JitContext, codeCounts)); byte(0);	// cmp word [codeCounts + rax * 2], 0
+		}
+		else
+		{
+			bytes({ 0x44, 0x88, 0xb3 }); u32(instruction.operand);			// mov [rbx + address], r14b
+			if (instruction.operand == consoleAddress) emitConsole();
+			bytes({ 0x66, 0x41, 0x83 }); field(7, offsetof(JitContext, codeCounts) + 2 * instruction.operand); byte(0);	// cmp word [codeCounts + address * 2], 0
+		}
+		bytes({ 0x74, 0 });														// je done
+		uint32_t done = used - 1;
+		if (instruction.dynamicOperand)
+		{
+			bytes({ 0x41, 0x89 }); field(0, offsetof(JitContext, writeAddress));		// mov [writeAddress], eax
+		}
+		else
+		{
+			bytes({ 0x41, 0xc7 }); field(0, offsetof(JitContext, writeAddress)); u32(instruction.operand);	// mov dword [writeAddress], address
+		}
+		emitCount(cycles, count);
+		emitExit(JIT_EXIT_WRITE, instruction.pc + 3);
+		patch8(done);
+	}
+
+	void emitConsole()
+	{
+		bytes({ 0x49, 0x8b }); field(7, offsetof(JitContext, machine));	// mov rdi, [machine]
+		bytes({ 0x44, 0x89, 0xf6 });										// mov esi, r14d
+		bytes({ 0x48, 0xb8 }); u64((uint64_t)&jitConsole);					// mov rax, jitConsole
+		bytes({ 0x41, 0x53, 0x48, 0x83, 0xec, 0x08 });						// push r11; sub rsp, 8
+		bytes({ 0xff, 0xd0 });												// call rax
+		bytes({ 0x48, 0x83, 0xc4, 0x08, 0x41, 0x5b });						// add rsp, 8; pop r11
+	}
+
+	// the second operand of an ALU operation into cl
+	void emitOperand(const JitInstruction& instruction)
+	{
+		switch (instruction.opcode >> 4)
+		{
+		case OP_ALM:
+			if (instruction.dynamicOperand)
+			{
+				bytes({ 0x0f, 0xb7, 0x83 }); u32(instruction.pc + 1);	// movzx eax, word [rbx + operand]
+				bytes({ 0x0f, 0xb6, 0x0c, 0x03 });						// movzx ecx, byte [rbx + rax]
+			}
+			else
+			{
+				bytes({ 0x0f, 0xb6, 0x8b }); u32(instruction.operand);	// movzx ecx, byte [rbx + address]
+			}
+			break;
+		case OP_ALA:
+			bytes({ 0x44, 0x89, 0xf1 });								// mov ecx, r14d
+			break;
+		case OP_ALI:
+			bytes({ 0xb1, (uint8_t)instruction.operand });				// mov cl, value
+			break;
+		default:
+			bytes({ 0x40, 0xfe, 0xcd });								// dec bpl
+			bytes({ 0x0f, 0xb6 }); stackTop(1);							// movzx ecx, byte [rbx + rbp + stack page]
+			break;
+		}
+	}
+
+	void emitAlu(const JitInstruction& instruction, bool flagsUsed)
+	{
+		emitOperand(instruction);
+		if (flagsUsed) bytes({ 0x31, 0xd2, 0x31, 0xf6, 0x31, 0xff, 0x45, 0x31, 0xc0 });	// xor edx, edx; xor esi, esi; xor edi, edi; xor r8d, r8d
+		bytes({ 0x44, 0x89, 0xf0 });		// mov eax, r14d
+		JitFlags kind = JIT_FLAGS_DIRECT;
+		uint8_t operation = instruction.opcode & 0xf;
+		if (operation == ALU_ADC || operation == ALU_SBB || operation == ALU_RCL || operation == ALU_RCR) bytes({ 0x41, 0x0f, 0xba, 0xe7, 0x00 });	// bt r15d, 0
+		switch (operation)
+		{
+		case ALU_ADD: bytes({ 0x00, 0xc8 }); break;							// add al, cl
+		case ALU_ADC: bytes({ 0x10, 0xc8 }); break;							// adc al, cl
+		case ALU_SUB: bytes({ 0x28, 0xc8 }); kind = JIT_FLAGS_BORROW; break;	// sub al, cl
+		case ALU_SBB: bytes({ 0xf5, 0x18, 0xc8 }); kind = JIT_FLAGS_BORROW; break;	// cmc; sbb al, cl
+		case ALU_ONC: bytes({ 0x88, 0xc8, 0xf6, 0xd0, 0x84, 0xc0 }); break;	// mov al, cl; not al; test al, al
+		case ALU_TWC: bytes({ 0x88, 0xc8, 0xf6, 0xd8 }); kind = JIT_FLAGS_BORROW; break;	// mov al, cl; neg al
+		case ALU_AND: bytes({ 0x20, 0xc8 }); break;							// and al, cl
+		case ALU_OR: bytes({ 0x08, 0xc8 }); break;							// or al, cl
+		case ALU_XOR: bytes({ 0x30, 0xc8 }); break;							// xor al, cl
+		case ALU_LSL: bytes({ 0x88, 0xc8, 0xd0, 0xe0 }); kind = JIT_FLAGS_NO_OVERFLOW; break;	// mov al, cl; shl al, 1
+		case ALU_LSR: bytes({ 0x88, 0xc8, 0xd0, 0xe8 }); kind = JIT_FLAGS_NO_OVERFLOW; break;	// mov al, cl; shr al, 1
+		case ALU_ASR: bytes({ 0x88, 0xc8, 0xd0, 0xf8 }); break;				// mov al, cl; sar al, 1
+		case ALU_ROL: bytes({ 0x88, 0xc8, 0xd0, 0xc0 }); kind = JIT_FLAGS_TEST; break;	// mov al, cl; rol al, 1
+		case ALU_ROR: bytes({ 0x88, 0xc8, 0xd0, 0xc8 }); kind = JIT_FLAGS_TEST; break;	// mov al, cl; ror al, 1
+		case ALU_RCL: bytes({ 0x88, 0xc8, 0xd0, 0xd0 }); kind = JIT_FLAGS_TEST; break;	// mov al, cl; rcl al, 1
+		default: bytes({ 0x88, 0xc8, 0xd0, 0xd8 }); kind = JIT_FLAGS_TEST; break;		// mov al, cl; rcr al, 1
+		}
+
+		// the flags are gathered in registers cleared before the operation, so that no partial register has to be merged
+		if (flagsUsed)
+		{
+			bytes({ 0x0f, (uint8_t)(kind == JIT_FLAGS_BORROW ? 0x93 : 0x92), 0xc2 });	// setc dl (setnc for a borrow)
+			if (kind == JIT_FLAGS_TEST) bytes({ 0x84, 0xc0 });						// test al, al
+			bytes({ 0x40, 0x0f, 0x94, 0xc6 });										// setz sil
+			bytes({ 0x40, 0x0f, 0x98, 0xc7 });										// sets dil
+			bytes({ 0x8d, 0x14, 0x72 });											// lea edx, [rdx + rsi * 2]
+			if (kind == JIT_FLAGS_DIRECT || kind == JIT_FLAGS_BORROW)
+			{
+				bytes({ 0x41, 0x0f, 0x90, 0xc0 });									// seto r8b
+				bytes({ 0x8d, 0x14, 0xba });										// lea edx, [rdx + rdi * 4]
+				bytes({ 0x46, 0x8d, 0x3c, 0xc2 });									// lea r15d, [rdx + r8 * 8]
+			}
+			else bytes({ 0x44, 0x8d, 0x3c, 0xba });									// lea r15d, [rdx + rdi * 4]
+		}
+		bytes({ 0x44, 0x0f, 0xb6, 0xf0 });		// movzx r14d, al
+	}
+
+	// translates the block starting at an address, null if it has to be interpreted
+	const void* translate(uint16_t start)
+	{
+		if (invalidations[start] > maxInvalidations) return nullptr;
+		const uint8_t* mem = context.memory;
+		instructions.clear();
+		for (uint32_t pc = start; instructions.size() < maxBlockInstructions;)
+		{
+			uint8_t opcode = mem[pc];
+			uint8_t operation = opcode >> 4;
+			uint32_t length = instructionLengths[operation];
+			// code in the stack page is left to the interpreter, so pushes never have to check for code
+			if (pc + length > stackPage) break;
+			JitInstruction instruction = { (uint16_t)pc, opcode, 0, false };
+			if (length == 2) instruction.operand = mem[pc + 1];
+			if (length == 3) instruction.operand = mem[pc + 1] | (mem[pc + 2] << 8);
+			if (length == 3 && (operation == OP_ALM || operation == OP_LOD || operation == OP_STO) && (patchCounts[pc + 1] || patchCounts[pc + 2]))
+				instruction.dynamicOperand = true;
+			instructions.push_back(instruction);
+			pc += length;
+			if (operation >= OP_JMP) break;
+		}
+		if (instructions.empty()) return nullptr;
+		if (used + instructions.size() * 160 + 256 > codeSize) flush();
+
+		// the flags an ALU operation sets are only worked out if something can look at them before the next one replaces them
+		vector<bool> flagsUsed(instructions.size());
+		bool live = true;
+		for (size_t i = instructions.size(); i-- > 0;)
+		{
+			uint8_t operation = instructions[i].opcode >> 4;
+			uint8_t aluOperation = instructions[i].opcode & 0xf;
+			flagsUsed[i] = live;
+			if (operation >= OP_ALM && operation <= OP_ALS)
+				live = aluOperation == ALU_ADC || aluOperation == ALU_SBB || aluOperation == ALU_RCL || aluOperation == ALU_RCR;
+			else if (operation == OP_STO || operation >= OP_JMP) live = true;
+		}
+
+		uint32_t begin = used;
+		uint32_t prefixCycles = 0;
+		for (size_t i = 0; i + 1 < instructions.size(); ++i) prefixCycles += cycleCounts[instructions[i].opcode >> 4];
+		bytes({ 0x49, 0x8d, 0x85 }); u32(prefixCycles);										// lea rax, [r13 + cycles before the last instruction]
+		bytes({ 0x49, 0x3b }); field(0, offsetof(JitContext, maxCycles));					// cmp rax, [maxCycles]
+		bytes({ 0x0f, 0x83 }); u32(0);														// jae budget
+		uint32_t budget = used - 4;
+
+		uint32_t cycles = 0;
+		uint32_t count = 0;
+		bool ended = false;
+		for (size_t i = 0; i < instructions.size(); ++i)
+		{
+			const JitInstruction& instruction = instructions[i];
+			uint8_t operation = instruction.opcode >> 4;
+			cycles += cycleCounts[operation];
+			++count;
+			switch (operation)
+			{
+			case OP_NOP:
+				break;
+			case OP_ALM: case OP_ALA: case OP_ALI: case OP_ALS:
+				emitAlu(instruction, flagsUsed[i]);
+				break;
+			case OP_LOD:
+				if (instruction.dynamicOperand)
+				{
+					bytes({ 0x0f, 0xb7, 0x83 }); u32(instruction.pc + 1);	// movzx eax, word [rbx + operand]
+					bytes({ 0x44, 0x0f, 0xb6, 0x34, 0x03 });				// movzx r14d, byte [rbx + rax]
+				}
+				else
+				{
+					bytes({ 0x44, 0x0f, 0xb6, 0xb3 }); u32(instruction.operand);	// movzx r14d, byte [rbx + address]
+				}
+				break;
+			case OP_LDI:
+				bytes({ 0x41, 0xbe }); u32(instruction.operand);			// mov r14d, value
+				break;
+			case OP_STO:
+				emitStore(instruction, cycles, count);
+				break;
+			case OP_PSH:
+				bytes({ 0x44, 0x88 }); stackTop(14);							// mov [rbx + rbp + stack page], r14b
+				bytes({ 0x40, 0xfe, 0xc5 });								// inc bpl
+				break;
+			case OP_POP:
+				bytes({ 0x40, 0xfe, 0xcd });								// dec bpl
+				bytes({ 0x44, 0x0f, 0xb6 }); stackTop(14);						// movzx r14d, byte [rbx + rbp + stack page]
+				break;
+			case OP_JMP:
+				emitChain(instruction.operand, cycles, count);
+				ended = true;
+				break;
+			case OP_BR:
+			case OP_BN:
+			{
+				bytes({ 0x41, 0xf6, 0xc7, (uint8_t)(instruction.opcode & 0xf) });	// test r15b, condition
+				bytes({ 0x0f, (uint8_t)(operation == OP_BR ? 0x84 : 0x85) }); u32(0);	// jz (jnz for BN) not taken
+				uint32_t notTaken = used - 4;
+				emitChain(instruction.operand, cycles, count);
+				patch(notTaken, used);
+				emitChain(instruction.pc + 3, cycles + branchNotTakenCycles, count);
+				ended = true;
+				break;
+			}
+			case OP_JSR:
+			{
+				uint16_t ret = instruction.pc + 1;
+				bytes({ 0xc6 }); stackTop(0); byte((uint8_t)ret);				// mov byte [rbx + rbp + stack page], low byte
+				bytes({ 0x40, 0xfe, 0xc5 });								// inc bpl
+				bytes({ 0xc6 }); stackTop(0); byte(ret >> 8);					// mov byte [rbx + rbp + stack page], high byte
+				bytes({ 0x40, 0xfe, 0xc5 });								// inc bpl
+				emitChain(instruction.operand, cycles, count);
+				ended = true;
+				break;
+			}
+			case OP_RSR:
+			{
+				bytes({ 0x40, 0xfe, 0xcd });								// dec bpl
+				bytes({ 0x0f, 0xb6 }); stackTop(0);							// movzx eax, byte [rbx + rbp + stack page]
+				bytes({ 0xc1, 0xe0, 0x08, 0x40, 0xfe, 0xcd });				// shl eax, 8; dec bpl
+				bytes({ 0x0f, 0xb6 }); stackTop(1);							// movzx ecx, byte [rbx + rbp + stack page]
+				bytes({ 0x09, 0xc8, 0x83, 0xc0, 0x02, 0x0f, 0xb7, 0xc0 });	// or eax, ecx; add eax, 2; movzx eax, ax
+				emitCount(cycles, count);
+
+				// straight on to the block returned to if it has been translated
+				bytes({ 0x41, 0x89 }); field(0, offsetof(JitContext, pc));	// mov [pc], eax
+				bytes({ 0x49, 0x8b, 0x94, 0xc4 }); u32(offsetof(JitContext, blockAt));	// mov rdx, [blockAt + rax * 8]
+				bytes({ 0x48, 0x85, 0xd2, 0x74, 0x02, 0xff, 0xe2 });		// test rdx, rdx; jz exit; jmp rdx
+				bytes({ 0x41, 0xc7 }); field(0, offsetof(JitContext, exitReason)); u32(JIT_EXIT_JUMP);	// exit: mov dword [exitReason], jump
+				byte(0xe9); u32(0); patch(used - 4, epilogue);		// jmp epilogue
+				ended = true;
+				break;
+			}
+			default:	// OP_HLT
+				emitCount(cycles, count);
+				emitExit(JIT_EXIT_HALT, instruction.pc);
+				ended = true;
+				break;
+			}
+		}
+		if (!ended)
+		{
+			const JitInstruction& last = instructions.back();
+			emitChain(last.pc + instructionLengths[last.opcode >> 4], cycles, count);
+		}
+		patch(budget, used);
+		emitExit(JIT_EXIT_BUDGET, start);
+
+		// the bytes of the block are watched for stores, except for the operands that are read as the block runs
+		JitBlock block = { start, true, {} };
+		for (const JitInstruction& instruction : instructions)
+		{
+			uint32_t length = instructionLengths[instruction.opcode >> 4];
+			for (uint32_t b = 0; b < (instruction.dynamicOperand ? 1 : length); ++b) block.bytes.push_back(instruction.pc + b);
+		}
+		for (uint16_t address : block.bytes) ++context.codeCounts[address];
+		for (uint32_t page = block.bytes.front() >> 8; page <= (uint32_t)block.bytes.back() >> 8; ++page) pageBlocks[page].push_back(blocks.size());
+		blocks.push_back(move(block));
+
+		context.blockAt[start] = code + begin;
+		for (int32_t link = firstLink[start]; link >= 0; link = links[link].next) patch(links[link].site, begin);
+		return code + begin;
+	}
+};
+
+static void jitConsole(Machine* machine, uint32_t a)
+{
+	machine->console += (char)(a & 0x7f);
+}
+
+bool Machine::runJit(uint64_t maxCycles)
+{
+	if (halted) return true;
+	if (!jit) jit.reset(new Jit(this));
+	if (!jit->available()) return runThreaded(maxCycles);
+
+	// nothing is translated yet, since memory may have changed since the last run
+	jit->reset();
+	JitContext& context = jit->context;
+	context.maxCycles = maxCycles;
+	while (!halted && cycles < maxCycles)
+	{
+		const void* block = jit->lookup(pc);
+		if (!block)
+		{
+			// the interpreter runs what cannot be translated, one instruction at a time, and drops any code it stores to
+			uint8_t opcode = memory[pc];
+			uint16_t address = memory[(uint16_t)(pc + 1)] | (memory[(uint16_t)(pc + 2)] << 8);
+			run(cycles + 1);
+			if ((opcode >> 4) == OP_STO) jit->invalidate(address);
+			continue;
+		}
+
+		context.pc = pc;
+		context.a = a;
+		context.flags = flags;
+		context.sp = sp;
+		context.cycles = cycles;
+		context.instructions = instructions;
+		jit->enter(block);
+		pc = context.pc;
+		a = context.a;
+		flags = context.flags;
+		sp = context.sp;
+		cycles = context.cycles;
+		instructions = context.instructions;
+
+		if (context.exitReason == JIT_EXIT_WRITE) jit->invalidate(context.writeAddress);
+		else if (context.exitReason == JIT_EXIT_HALT) halted = true;
+		else if (context.exitReason == JIT_EXIT_BUDGET) return run(maxCycles);
+	}
+	return halted;
+}
+
+#else
+
+// the translator only generates x86-64 code, other machines use the threaded interpreter
+class Jit
+{
+};
+
+bool Machine::runJit(uint64_t maxCycles)
+{
+	return runThreaded(maxCycles);
+}
+
+#endif
+
+int hexValue(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// places a record's data in the program, growing it to cover the record
+bool placeRecord(vector<uint8_t>& program, uint32_t address, const uint8_t* data, size_t count)
+{
+	if (address + count > memorySize) return false;
+	if (program.size() < address + count) program.resize(address + count);
+	copy(data, data + count, program.begin() + address);
+	return true;
+}
+
+// loads Intel HEX or Motorola S-records, the gaps between the records are left as zeros
+bool loadRecords(const string& data, const string& filename, vector<uint8_t>& program)
+{
+	vector<uint8_t> record;
+	size_t lineNumber = 0;
+	for (size_t start = 0; start < data.size(); ++lineNumber)
+	{
+		size_t end = min(data.find('\n', start), data.size());
+		string line = data.substr(start, end - start);
+		start = end + 1;
+		while (!line.empty() && isspace((unsigned char)line.back())) line.pop_back();
+		if (line.empty()) continue;
+
+		// every record is a start character (and type for S-records) followed by hex bytes
+		bool intel = line[0] == ':';
+		size_t first = intel ? 1 : 2;
+		record.clear();
+		bool valid = (intel || (line[0] == 'S' && line.size() > 1)) && (line.size() - first) % 2 == 0;
+		for (size_t i = first; valid && i < line.size(); i += 2)
+		{
+			int high = hexValue(line[i]), low = hexValue(line[i + 1]);
+			valid = high >= 0 && low >= 0;
+			record.push_back((uint8_t)(high << 4 | low));
+		}
+		uint8_t checksum = 0;
+		for (uint8_t byte : record) checksum += byte;
+		if (intel) valid = valid && record.size() >= 5 && record[0] == record.size() - 5 && checksum == 0;
+		else valid = valid && record.size() >= 3 && record[0] == record.size() - 1 && checksum == 0xff;
+		if (!valid)
+		{
+			cerr << "ERROR: line " << lineNumber + 1 << " of " << filename << " is not a valid record!\n";
+			return false;
+		}
+
+		bool placed = true;
+		if (intel)
+		{
+			// data, end of file, or extended and start addresses, which only matter beyond 64K
+			uint8_t type = record[3];
+			if (type == 0x00) placed = placeRecord(program, record[1] << 8 | record[2], &record[4], record[0]);
+			else if (type == 0x01) break;
+			else if (type == 0x02 || type == 0x04) placed = record[4] == 0 && record[5] == 0;
+		}
+		else if (line[1] >= '1' && line[1] <= '3')
+		{
+			// S1, S2 and S3 hold data with 2, 3 and 4 byte addresses, the other records are headers, counts and start addresses
+			size_t addressSize = line[1] - '0' + 1;
+			if (record.size() < addressSize + 2)
+			{
+				cerr << "ERROR: line " << lineNumber + 1 << " of " << filename << " is not a valid record!\n";
+				return false;
+			}
+			uint32_t address = 0;
+			for (size_t i = 1; i <= addressSize; ++i) address = address << 8 | record[i];
+			placed = placeRecord(program, address, &record[addressSize + 1], record.size() - addressSize - 2);
+		}
+		if (!placed)
+		{
+			cerr << "ERROR: " << filename << " does not fit in memory!\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// loads a program written by the assembler: raw binary, its space separated hex text, Intel HEX or S-records
+bool loadProgram(string filename, vector<uint8_t>& program)
+{
+	ifstream file(filename, ios::binary);
+	if (!file.is_open())
+	{
+		cerr << "ERROR: could not open " << filename << "!\n";
+		return false;
+	}
+	string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+	// the format is told by the extension, since a binary can start with any byte
+	string extension = filename.substr(min(filename.find_last_of('.'), filename.size()));
+	for (char& c : extension) c = tolower((unsigned char)c);
+	program.clear();
+	if (extension == ".hex" || extension == ".ihex" || extension == ".s19" || extension == ".srec")
+		return loadRecords(data, filename, program);
+	if (extension == ".txt")
+	{
+		for (size_t i = 0; i < data.size(); ++i)
+		{
+			if (isspace((unsigned char)data[i])) continue;
+			int high = hexValue(data[i]);
+			int low = i + 1 < data.size() ? hexValue(data[i + 1]) : -1;
+			if (high < 0 || low < 0)
+			{
+				cerr << "ERROR: " << filename << " is not a hex dump!\n";
+				return false;
+			}
+			program.push_back((uint8_t)(high << 4 | low));
+			++i;
+		}
+	}
+	else program.assign(data.begin(), data.end());
+
+	if (program.size() > memorySize)
+	{
+		cerr << "ERROR: " << filename << " does not fit in memory!\n";
+		return false;
+	}
+	return true;
+}
+
+// programs the engines are timed on, each loops 256 x 256 times
+struct BenchmarkProgram
+{
+	const char* name;
+	vector<uint8_t> code;
+};
+
+const BenchmarkProgram benchmarkPrograms[] =
+{
+	// a countdown of two-instruction loops, with the outer counter kept in memory
+	{ "countdown", {
+		0x60, 0x00,			// 0000: LDI !0
+		0x32, 0x01,			// 0002: SUB !1
+		0xc2, 0x02, 0x00,	// 0004: BNZ 0x0002
+		0x50, 0x00, 0x01,	// 0007: LOD 0x0100
+		0x32, 0x01,			// 000a: SUB !1
+		0x70, 0x00, 0x01,	// 000c: STO 0x0100
+		0xc2, 0x00, 0x00,	// 000f: BNZ 0x0000
+		0xff				// 0012: HLT
+	} },
+
+	// a 16-bit sum of the counter, with every variable in memory
+	{ "memory", {
+		0x50, 0x28, 0x00,	// 0000: LOD 0x0028
+		0x10, 0x2a, 0x00,	// 0003: ADD 0x002a
+		0x70, 0x28, 0x00,	// 0006: STO 0x0028
+		0x50, 0x29, 0x00,	// 0009: LOD 0x0029
+		0x31, 0x00,			// 000c: ADC !0
+		0x70, 0x29, 0x00,	// 000e: STO 0x0029
+		0x50, 0x2a, 0x00,	// 0011: LOD 0x002a
+		0x32, 0x01,			// 0014: SUB !1
+		0x70, 0x2a, 0x00,	// 0016: STO 0x002a
+		0xc2, 0x00, 0x00,	// 0019: BNZ 0x0000
+		0x50, 0x2b, 0x00,	// 001c: LOD 0x002b
+		0x32, 0x01,			// 001f: SUB !1
+		0x70, 0x2b, 0x00,	// 0021: STO 0x002b
+		0xc2, 0x00, 0x00,	// 0024: BNZ 0x0000
+		0xff				// 0027: HLT
+	} },
+
+	// a subroutine call every time round, with the counter saved on the stack
+	{ "calls", {
+		0x50, 0x29, 0x00,	// 0000: LOD 0x0029
+		0x80,				// 0003: PSH
+		0xd0, 0x1c, 0x00,	// 0004: JSR 0x001c
+		0x90,				// 0007: POP
+		0x32, 0x01,			// 0008: SUB !1
+		0x70, 0x29, 0x00,	// 000a: STO 0x0029
+		0xc2, 0x00, 0x00,	// 000d: BNZ 0x0000
+		0x50, 0x2a, 0x00,	// 0010: LOD 0x002a
+		0x32, 0x01,			// 0013: SUB !1
+		0x70, 0x2a, 0x00,	// 0015: STO 0x002a
+		0xc2, 0x00, 0x00,	// 0018: BNZ 0x0000
+		0xff,				// 001b: HLT
+		0x50, 0x28, 0x00,	// 001c: LOD 0x0028
+		0x38, 0x5a,			// 001f: XOR !0x5a
+		0x2c,				// 0021: ROL
+		0x30, 0x07,			// 0022: ADD !7
+		0x70, 0x28, 0x00,	// 0024: STO 0x0028
+		0xe0				// 0027: RSR
+	} },
+
+	// an increment of each byte of a page, through a load and store whose addresses the loop patches
+	{ "patching", {
+		0x50, 0x28, 0x00,	// 0000: LOD 0x0028
+		0x70, 0x0a, 0x00,	// 0003: STO 0x000a
+		0x70, 0x0f, 0x00,	// 0006: STO 0x000f
+		0x50, 0x00, 0x01,	// 0009: LOD 0x0100
+		0x30, 0x01,			// 000c: ADD !1
+		0x70, 0x00, 0x01,	// 000e: STO 0x0100
+		0x50, 0x28, 0x00,	// 0011: LOD 0x0028
+		0x30, 0x01,			// 0014: ADD !1
+		0x70, 0x28, 0x00,	// 0016: STO 0x0028
+		0xc2, 0x00, 0x00,	// 0019: BNZ 0x0000
+		0x50, 0x29, 0x00,	// 001c: LOD 0x0029
+		0x32, 0x01,			// 001f: SUB !1
+		0x70, 0x29, 0x00,	// 0021: STO 0x0029
+		0xc2, 0x00, 0x00,	// 0024: BNZ 0x0000
+		0xff				// 0027: HLT
+	} }
+};
+
+// times each engine on each benchmark program
+int runBenchmark()
+{
+	unique_ptr<Machine> machine(new Machine);
+	for (const BenchmarkProgram& program : benchmarkPrograms)
+	{
+		double switchMips = 0;
+		for (int engine = 0; engine < numEngines; ++engine)
+		{
+			uint64_t instructions = 0, cycles = 0;
+			auto start = chrono::steady_clock::now();
+			double seconds = 0;
+			while (seconds < 0.25)
+			{
+				machine->load(program.code);
+				machine->run(UINT64_MAX, (Engine)engine);
+				instructions += machine->instructions;
+				cycles += machine->cycles;
+				seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			}
+			double mips = instructions / seconds / 1e6;
+			if (engine == ENGINE_SWITCH) switchMips = mips;
+			printf("%-10s %-9s %llu instructions, %llu cycles in %.3f s: %.1f MIPS (%.2fx)\n", program.name, engineNames[engine], (unsigned long long)instructions,
+				(unsigned long long)cycles, seconds, mips, mips / switchMips);
+		}
+	}
+	return 0;
+}
+
+void printUsage()
+{
+	cerr << "usage: emulator [options] program\n"
+		"  program            binary, _hex.txt, Intel HEX or S-record file written by the assembler\n"
+		"  --cycles=N         stop after N clock cycles (default 1000000000, 0 for no limit)\n"
+		"  --engine=E         switch, threaded or jit (default), how the program is run\n"
+		"  -q                 do not print the statistics when the program stops\n"
+		"  --bench            time the emulator on a built in program\n";
+}
+
+int main(int argc, char* argv[])
+{
+	string input;
+	uint64_t maxCycles = 1000000000;
+	bool quiet = false;
+	Engine engine = ENGINE_JIT;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "--bench") return runBenchmark();
+		else if (arg == "-q") quiet = true;
+		else if (arg.compare(0, 9, "--cycles=") == 0)
+		{
+			maxCycles = strtoull(arg.c_str() + 9, nullptr, 0);
+			if (maxCycles == 0) maxCycles = UINT64_MAX;
+		}
+		else if (arg.compare(0, 9, "--engine=") == 0)
+		{
+			auto name = find(engineNames, engineNames + numEngines, arg.substr(9));
+			if (name == engineNames + numEngines)
+			{
+				cerr << "ERROR: unknown engine " << arg.substr(9) << "!\n";
+				return 2;
+			}
+			engine = (Engine)(name - engineNames);
+		}
+		else if (arg == "-h" || arg == "--help")
+		{
+			printUsage();
+			return 0;
+		}
+		else if (arg[0] == '-' || !input.empty())
+		{
+			cerr << "ERROR: unexpected argument " << arg << "!\n";
+			printUsage();
+			return 2;
+		}
+		else input = arg;
+	}
+	if (input.empty())
+	{
+		printUsage();
+		return 2;
+	}
+
+	vector<uint8_t> program;
+	if (!loadProgram(input, program)) return 1;
+
+	unique_ptr<Machine> machine(new Machine);
+	machine->load(program);
+	auto start = chrono::steady_clock::now();
+	bool halted = machine->run(maxCycles, engine);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	machine->flushConsole();
+
+	if (!quiet)
+	{
+		fprintf(stderr, "\n%s at 0x%04x after %llu instructions, %llu cycles (%.3f ms)\n", halted ? "halted" : "cycle limit reached",
+			machine->pc, (unsigned long long)machine->instructions, (unsigned long long)machine->cycles, seconds * 1000);
+		fprintf(stderr, "A=0x%02x SP=0x%02x flags=%c%c%c%c\n", machine->a, machine->sp,
+			machine->flags & FLAG_C ? 'C' : '-', machine->flags & FLAG_Z ? 'Z' : '-', machine->flags & FLAG_N ? 'N' : '-', machine->flags & FLAG_V ? 'V' : '-');
+	}
+	return halted ? 0 : 1;
+}
\ No newline at end of file
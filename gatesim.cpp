@@ -0,0 +1,2507 @@
+/*
+
+A gate-level simulator for the Chameleon CPU
+
+Runs the CPU the way Logisim does, from the gates and wires of the main circuit in Chameleon CPU.circ,
+rather than from the instruction set like the emulator, so it picks up every change made to the
+circuit.  The circuit is read into a netlist:
+
+	wires:       wire segments that share an end point are one net, as are the ports of components
+	             that meet at the same point
+	splitters:   join each bit of a bus to the net on the end it is fanned out to, so every bit
+	             of the circuit is a node
+	drivers:     a node driven by one gate takes that gate's value; a node with more drivers (the
+	             open collector NANDs, the ROM, RAM and buffers on the buses) or a pull resistor is a
+	             bus, which is 0 if anything pulls it low, 1 if anything drives it high, and the
+	             pull resistor's value (0 without one) if nothing drives it
+
+Each gate and device becomes an operation, and the operations are levelized: sorted so each one
+comes after the operations whose outputs it reads.  Feedback (the NOR latches that hold every
+register, and the buses they drive) can't be sorted that way, so each loop of operations is run
+over and over until none of its outputs change.  Only the operations whose inputs have changed are
+run again, which is most of the speed, since a clock edge only changes a few hundred nodes.  A
+clock cycle is the clock going high, the circuit settling, the clock going low and the circuit
+settling again.  Gates switch with no delay, so where two signals race (like the clock being
+stopped by HLT) the order of the operations decides the winner, which can put the count of cycles
+one off from Logisim's.
+
+Devices:
+	clock:       driven by the simulator, high then low for each cycle
+	buttons:     HRD RST is held down for two cycles at power on, then after the program has been
+	             copied from ROM into RAM SFT RST is held down for two cycles to start it
+	pins:        input pins are left floating, except two-state ones, which are 0
+	ROM, RAM:    the RAM has one asynchronous port, storing what is on the bus while it is selected
+	             and not reading
+	TTY:         prints the low 7 bits of its input on a rising clock when it is enabled
+	keyboard:    never has a key available
+
+Every node can also be a 64 bit word, with each bit a separate copy of the CPU running its own
+program (--lanes, or more than one program), so the gates are worked out for 64 CPUs at once.  Only
+the ROM, RAM and text display are handled a lane at a time.  Each lane stops when its clock does,
+and what it printed is shown when they all have.
+
+The levelized operations can be written out as straight-line C++ with --emit=file, and compiling the
+simulator with -DCOMPILED_CIRCUIT='"file"' builds them in, which settles the circuit a little
+faster than interpreting them.
+
+--check runs the programs next to a model of the instruction set (the same as the emulator's) and
+stops at the first instruction after which they differ: A, the flags and SP, the memory either of
+them stored to, what was printed, and the address and cycle the circuit fetches the next instruction
+in.  The circuit doesn't say which latches are the registers, so they are found first by running a
+program on it and keeping the nodes that follow each bit.  --random=N checks N random programs
+instead, 64 at a time, and --skip leaves out instructions the circuit is known to get wrong so the
+rest can still be checked.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <random>
+
+using namespace std;
+
+constexpr uint32_t memorySize = 0x10000;
+
+// cycles each reset button is held down for
+constexpr int resetCycles = 2;
+
+// passes over a loop of operations before it is taken to be oscillating
+constexpr int settleLimit = 1000;
+
+// a component of the circuit as it is saved
+struct Component
+{
+	string name;
+	int x = 0, y = 0;
+	vector<pair<string, string>> attributes;
+
+	string attribute(const string& key, const string& fallback = "") const
+	{
+		for (const auto& attribute : attributes)
+			if (attribute.first == key) return attribute.second;
+		return fallback;
+	}
+
+	int number(const string& key, int fallback) const
+	{
+		string value = attribute(key);
+		return value.empty() ? fallback : (int)strtol(value.c_str(), nullptr, 0);
+	}
+};
+
+struct Wire
+{
+	int x0, y0, x1, y1;
+};
+
+// the value of an XML attribute, with the entities Logisim writes turned back into characters
+string xmlAttribute(const string& tag, const string& key)
+{
+	size_t start = tag.find(" " + key + "=\"");
+	if (start == string::npos) return "";
+	start += key.size() + 3;
+	string value = tag.substr(start, tag.find('"', start) - start);
+	const char* entities[][2] = { { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" }, { "&amp;", "&" } };
+	for (auto& entity : entities)
+		for (size_t at = value.find(entity[0]); at != string::npos; at = value.find(entity[0], at + 1))
+			value.replace(at, strlen(entity[0]), entity[1]);
+	return value;
+}
+
+// reads a "(x,y)" location
+bool parseLocation(const string& text, int& x, int& y)
+{
+	return sscanf(text.c_str(), "(%d,%d)", &x, &y) == 2;
+}
+
+// reads the components and wires of the circuit Logisim opens the file with
+bool readCircuit(const string& filename, vector<Component>& components, vector<Wire>& wires)
+{
+	ifstream file(filename, ios::binary);
+	if (!file.is_open())
+	{
+		cerr << "ERROR: could not open " << filename << "!\n";
+		return false;
+	}
+	string xml((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+	size_t mainTag = xml.find("<main ");
+	string mainName = mainTag == string::npos ? "main" : xmlAttribute(xml.substr(mainTag, xml.find('>', mainTag) - mainTag), "name");
+	size_t start = xml.find("<circuit name=\"" + mainName + "\"");
+	if (start == string::npos)
+	{
+		cerr << "ERROR: " << filename << " has no circuit named " << mainName << "!\n";
+		return false;
+	}
+	size_t end = min(xml.find("</circuit>", start), xml.size());
+
+	for (size_t at = xml.find('<', start + 1); at < end; at = xml.find('<', at + 1))
+	{
+		size_t close = xml.find('>', at);
+		if (close == string::npos) break;
+		string tag = xml.substr(at, close - at);
+		if (tag.compare(0, 6, "<wire ") == 0)
+		{
+			Wire wire;
+			if (!parseLocation(xmlAttribute(tag, "from"), wire.x0, wire.y0) || !parseLocation(xmlAttribute(tag, "to"), wire.x1, wire.y1))
+			{
+				cerr << "ERROR: " << filename << " has a wire without both ends!\n";
+				return false;
+			}
+			wires.push_back(wire);
+		}
+		else if (tag.compare(0, 6, "<comp ") == 0)
+		{
+			Component component;
+			component.name = xmlAttribute(tag, "name");
+			if (!parseLocation(xmlAttribute(tag, "loc"), component.x, component.y))
+			{
+				cerr << "ERROR: " << filename << " has a " << component.name << " without a location!\n";
+				return false;
+			}
+			if (tag.back() != '/')
+			{
+				// the attributes that differ from the defaults, up to the closing tag
+				size_t compEnd = min(xml.find("</comp>", close), end);
+				for (size_t a = xml.find("<a ", close); a < compEnd; a = xml.find("<a ", a + 1))
+				{
+					size_t aClose = xml.find('>', a);
+					string aTag = xml.substr(a, aClose - a);
+					string key = xmlAttribute(aTag, "name");
+					if (aTag.back() == '/' || aTag.find(" val=\"") != string::npos) component.attributes.push_back({ key, xmlAttribute(aTag, "val") });
+					else component.attributes.push_back({ key, xml.substr(aClose + 1, xml.find("</a>", aClose) - aClose - 1) });
+				}
+				close = compEnd;
+			}
+			components.push_back(component);
+		}
+		at = close;
+	}
+	return true;
+}
+
+// how a component connects to the net at one of its ports
+enum PortKind : uint8_t
+{
+	PORT_INPUT,		// only reads the net
+	PORT_OUTPUT,	// drives the net, or leaves it floating
+	PORT_PULL,		// pull resistor
+	PORT_SPLIT		// one end of a splitter, joined bit by bit to the other end
+};
+
+struct Port
+{
+	int x, y;
+	int width;
+	PortKind kind;
+};
+
+// moves an offset given for a component facing east round to the way it faces
+void rotatePort(const string& facing, int& dx, int& dy)
+{
+	int x = dx, y = dy;
+	if (facing == "west") dx = -x, dy = -y;
+	else if (facing == "south") dx = -y, dy = x;
+	else if (facing == "north") dx = y, dy = -x;
+}
+
+// offsets of the inputs of a gate facing east, the way Logisim 2.7 lays them out
+vector<pair<int, int>> gateInputs(const Component& component)
+{
+	bool negated = component.name == "NAND Gate" || component.name == "NOR Gate" || component.name == "XNOR Gate";
+	bool exclusive = component.name == "XOR Gate" || component.name == "XNOR Gate";
+	int inputs = component.number("inputs", 5);
+	int size = component.number("size", 50);
+	int length = size + (negated ? 10 : 0) + (exclusive ? 10 : 0);
+
+	int skipStart, skipDistance, skipLowerEven;
+	if (inputs <= 3)
+	{
+		if (size < 40) skipStart = -5, skipDistance = 10, skipLowerEven = 10;
+		else if (size < 60 || inputs <= 2) skipStart = -10, skipDistance = 20, skipLowerEven = 20;
+		else skipStart = -15, skipDistance = 30, skipLowerEven = 30;
+	}
+	else if (inputs == 4 && size >= 60) skipStart = -5, skipDistance = 20, skipLowerEven = 0;
+	else skipStart = -5, skipDistance = 10, skipLowerEven = 10;
+
+	vector<pair<int, int>> offsets;
+	for (int i = 0; i < inputs; ++i)
+	{
+		int dy;
+		if (inputs & 1) dy = skipStart * (inputs - 1) + skipDistance * i;
+		else dy = skipStart * inputs + skipDistance * i + (i >= inputs / 2 ? skipLowerEven : 0);
+		offsets.push_back({ -length, dy });
+	}
+	return offsets;
+}
+
+// the end of a splitter each bit of the combined end goes to, 0 for none, spread evenly by default
+vector<int> splitterBits(const Component& component)
+{
+	int fanout = component.number("fanout", 2);
+	int incoming = component.number("incoming", 2);
+	vector<int> ends(incoming);
+	int perEnd = incoming / fanout, extra = incoming % fanout;
+	for (int bit = 0, end = 0, left = 0; bit < incoming; ++bit)
+	{
+		if (fanout >= incoming) end = bit + 1;
+		else if (left == 0)
+		{
+			++end;
+			left = perEnd + (extra-- > 0 ? 1 : 0);
+		}
+		ends[bit] = end;
+		--left;
+	}
+	for (int bit = 0; bit < incoming; ++bit)
+	{
+		string end = component.attribute("bit" + to_string(bit));
+		if (end == "none") ends[bit] = 0;
+		else if (!end.empty()) ends[bit] = atoi(end.c_str()) + 1;
+	}
+	return ends;
+}
+
+// the ports of a component where Logisim 2.7 puts them, in the order the simulator expects them;
+// returns false for components it does not know
+bool componentPorts(const Component& component, vector<Port>& ports)
+{
+	const string& name = component.name;
+	string facing = component.attribute("facing", "east");
+	auto add = [&](int dx, int dy, int width, PortKind kind)
+	{
+		rotatePort(facing, dx, dy);
+		ports.push_back({ component.x + dx, component.y + dy, width, kind });
+	};
+	auto addFixed = [&](int dx, int dy, int width, PortKind kind)
+	{
+		ports.push_back({ component.x + dx, component.y + dy, width, kind });
+	};
+
+	ports.clear();
+	if (name == "AND Gate" || name == "OR Gate" || name == "NAND Gate" || name == "NOR Gate" || name == "XOR Gate" || name == "XNOR Gate")
+	{
+		// output, then the inputs
+		int width = component.number("width", 1);
+		add(0, 0, width, PORT_OUTPUT);
+		for (auto offset : gateInputs(component)) add(offset.first, offset.second, width, PORT_INPUT);
+	}
+	else if (name == "NOT Gate" || name == "Buffer")
+	{
+		int width = component.number("width", 1);
+		add(0, 0, width, PORT_OUTPUT);
+		add(name == "NOT Gate" ? -component.number("size", 30) : -20, 0, width, PORT_INPUT);
+	}
+	else if (name == "Controlled Buffer" || name == "Controlled Inverter")
+	{
+		// output, input, then the control line on the right of the way it faces unless it is left handed
+		int width = component.number("width", 1);
+		add(0, 0, width, PORT_OUTPUT);
+		add(-20, 0, width, PORT_INPUT);
+		add(-10, component.attribute("control") == "left" ? -10 : 10, 1, PORT_INPUT);
+	}
+	else if (name == "Pin")
+	{
+		bool output = component.attribute("output") == "true";
+		addFixed(0, 0, component.number("width", 1), output ? PORT_INPUT : PORT_OUTPUT);
+	}
+	else if (name == "Clock" || name == "Button") addFixed(0, 0, 1, PORT_OUTPUT);
+	else if (name == "Constant") addFixed(0, 0, component.number("width", 1), PORT_OUTPUT);
+	else if (name == "Pull Resistor") addFixed(0, 0, 1, PORT_PULL);
+	else if (name == "Splitter")
+	{
+		// combined end, then each split end from the top or left
+		int fanout = component.number("fanout", 2);
+		vector<int> bits = splitterBits(component);
+		string appear = component.attribute("appear", "left");
+		int justify = appear == "center" || appear == "legacy" ? 0 : appear == "right" ? 1 : -1;
+		int dx, dy, stepX, stepY;
+		if (facing == "north" || facing == "south")
+		{
+			int m = facing == "north" ? 1 : -1;
+			dx = justify == 0 ? 10 * ((fanout + 1) / 2 - 1) : m * justify < 0 ? -10 : 10 * fanout;
+			dy = -m * 20;
+			stepX = -10, stepY = 0;
+		}
+		else
+		{
+			int m = facing == "west" ? -1 : 1;
+			dx = m * 20;
+			dy = justify == 0 ? -10 * (fanout / 2) : m * justify > 0 ? 10 : -10 * fanout;
+			stepX = 0, stepY = 10;
+		}
+		addFixed(0, 0, (int)bits.size(), PORT_SPLIT);
+		for (int end = 1; end <= fanout; ++end)
+			addFixed(dx + stepX * (end - 1), dy + stepY * (end - 1), (int)count(bits.begin(), bits.end(), end), PORT_SPLIT);
+	}
+	else if (name == "Comparator")
+	{
+		// A, B, then A > B, A = B and A < B
+		int width = component.number("width", 8);
+		addFixed(-40, -10, width, PORT_INPUT);
+		addFixed(-40, 10, width, PORT_INPUT);
+		addFixed(0, -10, 1, PORT_OUTPUT);
+		addFixed(0, 0, 1, PORT_OUTPUT);
+		addFixed(0, 10, 1, PORT_OUTPUT);
+	}
+	else if (name == "ROM" || name == "RAM")
+	{
+		// data, address, select, then for RAM with one asynchronous port the load and clear lines
+		if (name == "RAM" && component.attribute("bus") != "asynch") return false;
+		if (component.number("dataWidth", 8) > 8) return false;
+		addFixed(0, 0, component.number("dataWidth", 8), PORT_OUTPUT);
+		addFixed(-140, 0, component.number("addrWidth", 8), PORT_INPUT);
+		addFixed(-90, 40, 1, PORT_INPUT);
+		if (name == "RAM")
+		{
+			addFixed(-50, 40, 1, PORT_INPUT);
+			addFixed(-30, 40, 1, PORT_INPUT);
+		}
+	}
+	else if (name == "TTY")
+	{
+		// data, clock, write enable, clear
+		addFixed(0, -10, 7, PORT_INPUT);
+		addFixed(0, 0, 1, PORT_INPUT);
+		addFixed(10, 10, 1, PORT_INPUT);
+		addFixed(20, 10, 1, PORT_INPUT);
+	}
+	else if (name == "Keyboard")
+	{
+		// clock, read enable, clear, available, data
+		addFixed(0, 0, 1, PORT_INPUT);
+		addFixed(10, 10, 1, PORT_INPUT);
+		addFixed(20, 10, 1, PORT_INPUT);
+		addFixed(130, 10, 1, PORT_OUTPUT);
+		addFixed(140, 10, 7, PORT_OUTPUT);
+	}
+	else return name == "Text";
+	return true;
+}
+
+// what an operation computes from its operands
+enum OperationType : uint8_t
+{
+	OP_AND,
+	OP_OR,
+	OP_NAND,
+	OP_NOR,
+	OP_XOR,
+	OP_XNOR,
+	OP_BUFFER,
+	OP_NOT,
+	OP_BUS,			// operands are pairs of an enable and the value driven while it is set
+	OP_DEVICE		// a ROM, RAM or comparator, looked up in the devices
+};
+
+const char* operationNames[] = { "AND", "OR", "NAND", "NOR", "XOR", "XNOR", "buffer", "NOT", "bus", "device" };
+
+struct Operation
+{
+	OperationType type;
+	uint8_t pull;			// value of a bus that nothing drives
+	uint32_t output;		// node written, or the device for OP_DEVICE
+	uint32_t first;			// first operand
+	uint32_t count;			// number of operands
+};
+
+// a run of levelized operations, run once or, for a loop, until it settles
+struct Block
+{
+	uint32_t first;
+	uint32_t count;
+	bool loop;
+};
+
+enum DeviceType : uint8_t
+{
+	DEVICE_ROM,
+	DEVICE_RAM,
+	DEVICE_COMPARATOR,
+	DEVICE_TTY,
+	DEVICE_KEYBOARD
+};
+
+// a component simulated by the program rather than from gates, with the nodes of each of its ports
+struct Device
+{
+	DeviceType type;
+	string label;
+	vector<uint32_t> data;		// data lines, or A of a comparator
+	vector<uint32_t> address;	// address lines, or B of a comparator
+	vector<uint32_t> outputs;	// the value driven onto the data lines, or A > B, A = B and A < B
+	uint32_t select = 0;		// chip select, or the TTY and keyboard clock
+	uint32_t enable = 0;		// RAM load, TTY write or keyboard read enable
+	uint32_t clear = 0;
+	uint32_t driving = 0;		// whether the RAM drives the data lines
+	bool twosComplement = true;
+	vector<uint8_t> memory;
+};
+
+// constant nodes, used as operands
+constexpr uint32_t nodeLow = 0;
+constexpr uint32_t nodeHigh = 1;
+
+// the circuit, reduced to nodes and the operations that compute them
+struct Netlist
+{
+	vector<Component> components;
+	vector<Wire> wires;
+	uint32_t numNets = 0;
+	uint32_t numNodes = 2;
+	vector<Operation> operations;
+	vector<uint32_t> operands;
+	vector<Block> blocks;
+	vector<Device> devices;
+	uint32_t levels = 0;
+	vector<uint32_t> readerStart;	// where each node's list of the operations that read it starts in readers
+	vector<uint32_t> readers;
+	uint32_t clock = UINT32_MAX;
+	uint32_t hardReset = UINT32_MAX;
+	uint32_t softReset = UINT32_MAX;
+	vector<pair<uint32_t, uint8_t>> fixed;	// nodes held at a value, from constants and two-state pins
+	vector<pair<string, uint32_t>> labels;	// the output of each labelled gate, to watch control signals by name
+
+	uint32_t signal(const string& label) const
+	{
+		for (auto& labelled : labels)
+			if (labelled.first == label) return labelled.second;
+		return UINT32_MAX;
+	}
+
+	bool build(const string& filename);
+	uint64_t checksum() const;
+	string emit(const string& filename) const;
+};
+
+// joins the points, nets and nodes that are connected
+struct UnionFind
+{
+	vector<uint32_t> parent;
+
+	uint32_t add()
+	{
+		parent.push_back((uint32_t)parent.size());
+		return (uint32_t)parent.size() - 1;
+	}
+
+	uint32_t find(uint32_t i)
+	{
+		while (parent[i] != i) i = parent[i] = parent[parent[i]];
+		return i;
+	}
+
+	void join(uint32_t a, uint32_t b)
+	{
+		parent[find(a)] = find(b);
+	}
+};
+
+// orders the operations of a loop so as few as possible read an output that is only written after them
+// (Eades, Lin and Smyth's heuristic): operations nothing else in the loop reads go last, ones that read
+// nothing from the loop go first, and otherwise the one whose output is read most more than it reads
+// goes next
+void orderLoop(uint32_t* members, uint32_t size, const vector<vector<uint32_t>>& readers)
+{
+	unordered_map<uint32_t, uint32_t> position;
+	for (uint32_t i = 0; i < size; ++i) position[members[i]] = i;
+	vector<vector<uint32_t>> successors(size), predecessors(size);
+	for (uint32_t i = 0; i < size; ++i)
+		for (uint32_t to : readers[members[i]])
+		{
+			auto found = position.find(to);
+			if (found == position.end() || found->second == i) continue;
+			successors[i].push_back(found->second);
+			predecessors[found->second].push_back(i);
+		}
+	vector<int> in(size), out(size);
+	vector<uint8_t> placed(size, 0);
+	for (uint32_t i = 0; i < size; ++i)
+	{
+		in[i] = (int)predecessors[i].size();
+		out[i] = (int)successors[i].size();
+	}
+	vector<uint32_t> front, back;
+	auto place = [&](uint32_t i, vector<uint32_t>& list)
+	{
+		placed[i] = 1;
+		list.push_back(i);
+		for (uint32_t to : successors[i]) --in[to];
+		for (uint32_t from : predecessors[i]) --out[from];
+	};
+	for (uint32_t left = size; left > 0;)
+	{
+		bool found = true;
+		while (found)
+		{
+			found = false;
+			for (uint32_t i = 0; i < size; ++i)
+			{
+				if (placed[i]) continue;
+				if (out[i] == 0) place(i, back);
+				else if (in[i] == 0) place(i, front);
+				else continue;
+				--left;
+				found = true;
+			}
+		}
+		if (left == 0) break;
+		uint32_t best = UINT32_MAX;
+		for (uint32_t i = 0; i < size; ++i)
+			if (!placed[i] && (best == UINT32_MAX || out[i] - in[i] > out[best] - in[best])) best = i;
+		place(best, front);
+		--left;
+	}
+	vector<uint32_t> sorted;
+	for (uint32_t i : front) sorted.push_back(members[i]);
+	for (size_t i = back.size(); i-- > 0;) sorted.push_back(members[back[i]]);
+	copy(sorted.begin(), sorted.end(), members);
+}
+
+bool Netlist::build(const string& filename)
+{
+	if (!readCircuit(filename, components, wires)) return false;
+
+	// every wire end and port is a point, and wires and ports at the same point are on the same net
+	unordered_map<uint64_t, uint32_t> points;
+	UnionFind nets;
+	auto point = [&](int x, int y)
+	{
+		uint64_t key = (uint64_t)(uint32_t)x << 32 | (uint32_t)y;
+		auto found = points.find(key);
+		if (found != points.end()) return found->second;
+		uint32_t net = nets.add();
+		points[key] = net;
+		return net;
+	};
+	for (const Wire& wire : wires) nets.join(point(wire.x0, wire.y0), point(wire.x1, wire.y1));
+
+	vector<vector<Port>> ports(components.size());
+	vector<vector<uint32_t>> portNets(components.size());
+	for (size_t c = 0; c < components.size(); ++c)
+	{
+		if (!componentPorts(components[c], ports[c]))
+		{
+			cerr << "ERROR: the simulator does not know " << components[c].name << " at (" << components[c].x << "," << components[c].y << ")!\n";
+			return false;
+		}
+		for (const Port& port : ports[c]) portNets[c].push_back(point(port.x, port.y));
+	}
+
+	// number the nets, giving each one a node for every bit
+	vector<uint32_t> netIndex(nets.parent.size(), UINT32_MAX), netWidth;
+	for (uint32_t i = 0; i < nets.parent.size(); ++i)
+	{
+		uint32_t root = nets.find(i);
+		if (netIndex[root] == UINT32_MAX)
+		{
+			netIndex[root] = numNets++;
+			netWidth.push_back(0);
+		}
+		netIndex[i] = netIndex[root];
+	}
+	for (size_t c = 0; c < components.size(); ++c)
+		for (size_t p = 0; p < ports[c].size(); ++p)
+		{
+			uint32_t& width = netWidth[netIndex[portNets[c][p]]];
+			if (ports[c][p].width == 0) continue;
+			if (width != 0 && width != (uint32_t)ports[c][p].width)
+			{
+				cerr << "ERROR: a " << ports[c][p].width << " bit port of " << components[c].name << " at (" << ports[c][p].x << "," << ports[c][p].y
+					<< ") is on a " << width << " bit net!\n";
+				return false;
+			}
+			width = ports[c][p].width;
+		}
+	vector<uint32_t> netBits(numNets + 1, 0);
+	for (uint32_t n = 0; n < numNets; ++n) netBits[n + 1] = netBits[n] + netWidth[n];
+
+	// splitters join the bits of their combined end to the bits of the split ends
+	UnionFind bits;
+	for (uint32_t b = 0; b < netBits[numNets]; ++b) bits.add();
+	auto bitOf = [&](size_t c, size_t p, int bit) { return netBits[netIndex[portNets[c][p]]] + bit; };
+	for (size_t c = 0; c < components.size(); ++c)
+	{
+		if (components[c].name != "Splitter") continue;
+		vector<int> ends = splitterBits(components[c]);
+		vector<int> used(ports[c].size(), 0);
+		for (size_t bit = 0; bit < ends.size(); ++bit)
+			if (ends[bit]) bits.join(bitOf(c, 0, (int)bit), bitOf(c, ends[bit], used[ends[bit]]++));
+	}
+	vector<uint32_t> nodeOf(bits.parent.size(), UINT32_MAX);
+	for (uint32_t b = 0; b < bits.parent.size(); ++b)
+	{
+		uint32_t root = bits.find(b);
+		if (nodeOf[root] == UINT32_MAX) nodeOf[root] = numNodes++;
+		nodeOf[b] = nodeOf[root];
+	}
+	auto nodes = [&](size_t c, size_t p)
+	{
+		vector<uint32_t> list;
+		for (int bit = 0; bit < ports[c][p].width; ++bit) list.push_back(nodeOf[bitOf(c, p, bit)]);
+		return list;
+	};
+
+	// what drives each node: operations whose output is the node itself if it has no other driver, and
+	// pairs of an enable and a value for the buses
+	vector<vector<uint32_t>> drivingOperations(numNodes);
+	vector<vector<pair<uint32_t, uint32_t>>> busDrivers(numNodes);
+	vector<int> pulls(numNodes, -1);
+	vector<uint8_t> external(numNodes, 0);
+	auto newNode = [&]()
+	{
+		drivingOperations.emplace_back();
+		busDrivers.emplace_back();
+		pulls.push_back(-1);
+		external.push_back(0);
+		return numNodes++;
+	};
+	auto addOperation = [&](OperationType type, const vector<uint32_t>& inputs, uint32_t output)
+	{
+		operations.push_back({ type, 0, output, (uint32_t)operands.size(), (uint32_t)inputs.size() });
+		operands.insert(operands.end(), inputs.begin(), inputs.end());
+		return (uint32_t)operations.size() - 1;
+	};
+
+	for (size_t c = 0; c < components.size(); ++c)
+	{
+		const Component& component = components[c];
+		const string& name = component.name;
+		string label = component.attribute("label");
+		if (!label.empty() && !ports[c].empty() && ports[c][0].width == 1 && ports[c][0].kind == PORT_OUTPUT) labels.push_back({ label, nodes(c, 0)[0] });
+		if ((name.size() > 5 && name.compare(name.size() - 5, 5, " Gate") == 0) || name == "Buffer")
+		{
+			// one operation per bit, open collector outputs only ever pull their output low
+			static const pair<const char*, OperationType> gateTypes[] = { { "AND Gate", OP_AND }, { "OR Gate", OP_OR }, { "NAND Gate", OP_NAND },
+				{ "NOR Gate", OP_NOR }, { "XOR Gate", OP_XOR }, { "XNOR Gate", OP_XNOR }, { "Buffer", OP_BUFFER }, { "NOT Gate", OP_NOT } };
+			OperationType type = OP_BUFFER;
+			for (auto& gateType : gateTypes)
+				if (name == gateType.first) type = gateType.second;
+			string out = component.attribute("out", "01");
+			for (int bit = 0; bit < ports[c][0].width; ++bit)
+			{
+				vector<uint32_t> inputs;
+				for (size_t p = 1; p < ports[c].size(); ++p) inputs.push_back(nodes(c, p)[bit]);
+				uint32_t output = nodes(c, 0)[bit];
+				if (out == "01") drivingOperations[output].push_back(addOperation(type, inputs, output));
+				else
+				{
+					// "0Z" only drives 0 and "Z1" only drives 1, so the gate is turned round to give when that happens
+					static const OperationType opposite[] = { OP_NAND, OP_NOR, OP_AND, OP_OR, OP_XNOR, OP_XOR, OP_NOT, OP_BUFFER };
+					uint32_t when = newNode();
+					addOperation(out == "0Z" ? opposite[type] : type, inputs, when);
+					busDrivers[output].push_back({ when, out == "0Z" ? nodeLow : nodeHigh });
+				}
+			}
+		}
+		else if (name == "Controlled Buffer" || name == "Controlled Inverter")
+		{
+			vector<uint32_t> outputs = nodes(c, 0), inputs = nodes(c, 1);
+			uint32_t control = nodes(c, 2)[0];
+			for (size_t bit = 0; bit < outputs.size(); ++bit)
+			{
+				uint32_t value = inputs[bit];
+				if (name == "Controlled Inverter")
+				{
+					value = newNode();
+					addOperation(OP_NOT, { inputs[bit] }, value);
+				}
+				busDrivers[outputs[bit]].push_back({ control, value });
+			}
+		}
+		else if (name == "Pull Resistor")
+		{
+			string pull = component.attribute("pull", "0");
+			pulls[nodes(c, 0)[0]] = pull == "1" ? 1 : 0;
+		}
+		else if (name == "Clock" || name == "Button" || name == "Constant" || (name == "Pin" && ports[c][0].kind == PORT_OUTPUT))
+		{
+			// inputs set from outside the netlist; three-state pins float and so drive nothing
+			if (name == "Pin" && component.attribute("tristate", "true") == "true") continue;
+			vector<uint32_t> outputs = nodes(c, 0);
+			uint32_t value = (uint32_t)strtoul(component.attribute("value", "1").c_str(), nullptr, 0);
+			for (size_t bit = 0; bit < outputs.size(); ++bit)
+			{
+				uint32_t node = newNode();
+				external[node] = 1;
+				busDrivers[outputs[bit]].push_back({ nodeHigh, node });
+				if (name == "Clock") clock = node;
+				else if (name == "Button" && component.attribute("label") == "HRD RST") hardReset = node;
+				else if (name == "Button" && component.attribute("label") == "SFT RST") softReset = node;
+				else if (name != "Button") fixed.push_back({ node, name == "Constant" ? (uint8_t)(value >> bit & 1) : (uint8_t)0 });
+			}
+		}
+		else if (name == "ROM" || name == "RAM" || name == "Comparator" || name == "TTY" || name == "Keyboard")
+		{
+			Device device;
+			device.label = name + " at (" + to_string(component.x) + "," + to_string(component.y) + ")";
+			vector<uint32_t> inputs;
+			if (name == "Comparator")
+			{
+				device.type = DEVICE_COMPARATOR;
+				device.data = nodes(c, 0);
+				device.address = nodes(c, 1);
+				device.twosComplement = component.attribute("mode", "twosComplement") == "twosComplement";
+				for (int p = 2; p < 5; ++p) device.outputs.push_back(nodes(c, p)[0]);
+				inputs = device.data;
+				inputs.insert(inputs.end(), device.address.begin(), device.address.end());
+			}
+			else if (name == "TTY" || name == "Keyboard")
+			{
+				// clocked, so they are updated between settling rather than as operations
+				bool tty = name == "TTY";
+				device.type = tty ? DEVICE_TTY : DEVICE_KEYBOARD;
+				device.select = nodes(c, tty ? 1 : 0)[0];
+				device.enable = nodes(c, tty ? 2 : 1)[0];
+				device.clear = nodes(c, tty ? 3 : 2)[0];
+				if (tty) device.data = nodes(c, 0);
+				else
+				{
+					// nothing is ever typed, so what it drives never changes
+					for (int p = 3; p < 5; ++p)
+						for (uint32_t node : nodes(c, p))
+						{
+							uint32_t value = newNode();
+							external[value] = 1;
+							fixed.push_back({ value, 0 });
+							busDrivers[node].push_back({ nodeHigh, value });
+						}
+				}
+				devices.push_back(device);
+				continue;
+			}
+			else
+			{
+				// the data lines are driven from the contents at the address, the RAM also stores from them
+				device.type = name == "ROM" ? DEVICE_ROM : DEVICE_RAM;
+				device.data = nodes(c, 0);
+				device.address = nodes(c, 1);
+				device.select = nodes(c, 2)[0];
+				device.memory.assign((size_t)1 << device.address.size(), 0);
+				inputs = device.address;
+				inputs.push_back(device.select);
+				uint32_t enable = device.select;
+				if (device.type == DEVICE_RAM)
+				{
+					device.enable = nodes(c, 3)[0];
+					device.clear = nodes(c, 4)[0];
+					device.driving = enable = newNode();
+					inputs.push_back(device.enable);
+				}
+				else
+				{
+					// the contents are saved as "addr/data: 16 8" and then values, with runs written as count*value
+					string contents = component.attribute("contents");
+					size_t at = contents.find('\n');
+					uint32_t address = 0;
+					while (at < contents.size() && address < device.memory.size())
+					{
+						while (at < contents.size() && isspace((unsigned char)contents[at])) ++at;
+						size_t end = at;
+						while (end < contents.size() && !isspace((unsigned char)contents[end])) ++end;
+						if (end == at) break;
+						string word = contents.substr(at, end - at);
+						size_t star = word.find('*');
+						uint32_t run = star == string::npos ? 1 : (uint32_t)strtoul(word.c_str(), nullptr, 10);
+						uint8_t value = (uint8_t)strtoul(word.c_str() + (star == string::npos ? 0 : star + 1), nullptr, 16);
+						for (uint32_t i = 0; i < run && address < device.memory.size(); ++i) device.memory[address++] = value;
+						at = end;
+					}
+				}
+				for (size_t bit = 0; bit < device.data.size(); ++bit)
+				{
+					device.outputs.push_back(newNode());
+					busDrivers[device.data[bit]].push_back({ enable, device.outputs.back() });
+				}
+			}
+			operations.push_back({ OP_DEVICE, 0, (uint32_t)devices.size(), (uint32_t)operands.size(), (uint32_t)inputs.size() });
+			operands.insert(operands.end(), inputs.begin(), inputs.end());
+			devices.push_back(device);
+		}
+	}
+	if (clock == UINT32_MAX || hardReset == UINT32_MAX || softReset == UINT32_MAX)
+	{
+		cerr << "ERROR: " << filename << " needs a clock and buttons labelled HRD RST and SFT RST!\n";
+		return false;
+	}
+
+	// nodes with more than one driver, or a pull resistor, are buses; a node with only one driver that is
+	// an input is moved onto that input, so the input is set directly
+	vector<uint32_t> rename(numNodes);
+	for (uint32_t n = 0; n < numNodes; ++n) rename[n] = n;
+	for (uint32_t n = 2; n < numNodes; ++n)
+	{
+		size_t drivers = drivingOperations[n].size() + busDrivers[n].size();
+		if (drivers == 1 && pulls[n] < 0 && busDrivers[n].size() == 1 && busDrivers[n][0].first == nodeHigh && external[busDrivers[n][0].second])
+			rename[n] = busDrivers[n][0].second;
+		else if (drivers > 1 || pulls[n] >= 0 || !busDrivers[n].empty())
+		{
+			for (uint32_t op : drivingOperations[n])
+			{
+				uint32_t value = newNode();
+				rename.push_back(value);
+				operations[op].output = value;
+				busDrivers[n].push_back({ nodeHigh, value });
+			}
+			vector<uint32_t> inputs;
+			for (auto& driver : busDrivers[n])
+			{
+				inputs.push_back(driver.first);
+				inputs.push_back(driver.second);
+			}
+			uint32_t op = addOperation(OP_BUS, inputs, n);
+			operations[op].pull = pulls[n] > 0 ? 1 : 0;
+		}
+	}
+	for (uint32_t& operand : operands) operand = rename[operand];
+	for (Operation& operation : operations)
+		if (operation.type != OP_DEVICE) operation.output = rename[operation.output];
+	for (Device& device : devices)
+		for (vector<uint32_t>* list : { &device.data, &device.address, &device.outputs })
+			for (uint32_t& node : *list) node = rename[node];
+	for (Device& device : devices)
+		for (uint32_t* node : { &device.select, &device.enable, &device.clear, &device.driving }) *node = rename[*node];
+	for (auto& labelled : labels) labelled.second = rename[labelled.second];
+
+	// the operations that read what each operation writes
+	vector<uint32_t> writer(numNodes, UINT32_MAX);
+	auto outputsOf = [&](const Operation& operation)
+	{
+		if (operation.type != OP_DEVICE) return vector<uint32_t>{ operation.output };
+		vector<uint32_t> outputs = devices[operation.output].outputs;
+		if (devices[operation.output].driving) outputs.push_back(devices[operation.output].driving);
+		return outputs;
+	};
+	for (uint32_t op = 0; op < operations.size(); ++op)
+		for (uint32_t node : outputsOf(operations[op])) writer[node] = op;
+	vector<vector<uint32_t>> dependents(operations.size());
+	for (uint32_t op = 0; op < operations.size(); ++op)
+		for (uint32_t i = 0; i < operations[op].count; ++i)
+		{
+			uint32_t from = writer[operands[operations[op].first + i]];
+			if (from != UINT32_MAX) dependents[from].push_back(op);
+		}
+
+	// levelize: strongly connected operations (Tarjan's algorithm) are the loops, and they come out in
+	// reverse order of their dependencies
+	uint32_t numOperations = (uint32_t)operations.size();
+	vector<uint32_t> index(numOperations, UINT32_MAX), low(numOperations), stack, order;
+	vector<uint8_t> onStack(numOperations, 0);
+	vector<pair<uint32_t, uint32_t>> components_;	// start and size of each loop in order
+	uint32_t nextIndex = 0;
+	for (uint32_t root = 0; root < numOperations; ++root)
+	{
+		if (index[root] != UINT32_MAX) continue;
+		vector<pair<uint32_t, uint32_t>> calls = { { root, 0 } };
+		index[root] = low[root] = nextIndex++;
+		stack.push_back(root);
+		onStack[root] = 1;
+		while (!calls.empty())
+		{
+			uint32_t op = calls.back().first;
+			uint32_t& next = calls.back().second;
+			if (next < dependents[op].size())
+			{
+				uint32_t to = dependents[op][next++];
+				if (index[to] == UINT32_MAX)
+				{
+					index[to] = low[to] = nextIndex++;
+					stack.push_back(to);
+					onStack[to] = 1;
+					calls.push_back({ to, 0 });
+				}
+				else if (onStack[to]) low[op] = min(low[op], index[to]);
+				continue;
+			}
+			if (low[op] == index[op])
+			{
+				uint32_t start = (uint32_t)order.size();
+				uint32_t member;
+				do
+				{
+					member = stack.back();
+					stack.pop_back();
+					onStack[member] = 0;
+					order.push_back(member);
+				} while (member != op);
+				if (order.size() - start > 1) orderLoop(order.data() + start, (uint32_t)(order.size() - start), dependents);
+				components_.push_back({ start, (uint32_t)order.size() - start });
+			}
+			calls.pop_back();
+			if (!calls.empty()) low[calls.back().first] = min(low[calls.back().first], low[op]);
+		}
+	}
+
+	// put the operations in levelized order, a block for each loop and each run of operations outside them
+	vector<Operation> sorted;
+	vector<uint32_t> level(numOperations, 0);
+	for (size_t k = components_.size(); k-- > 0;)
+	{
+		uint32_t start = components_[k].first, size = components_[k].second;
+		bool loop = size > 1 || find(dependents[order[start]].begin(), dependents[order[start]].end(), order[start]) != dependents[order[start]].end();
+		if (loop || blocks.empty() || blocks.back().loop) blocks.push_back({ (uint32_t)sorted.size(), 0, loop });
+		uint32_t componentLevel = 0;
+		for (uint32_t i = 0; i < size; ++i) componentLevel = max(componentLevel, level[order[start + i]]);
+		for (uint32_t i = 0; i < size; ++i)
+		{
+			uint32_t op = order[start + i];
+			sorted.push_back(operations[op]);
+			++blocks.back().count;
+			for (uint32_t to : dependents[op]) level[to] = max(level[to], componentLevel + 1);
+		}
+		levels = max(levels, componentLevel + 1);
+		if (loop) blocks.push_back({ (uint32_t)sorted.size(), 0, false });
+	}
+	blocks.erase(remove_if(blocks.begin(), blocks.end(), [](const Block& block) { return block.count == 0; }), blocks.end());
+	operations = sorted;
+
+	// the operations reading each node, now that they are in order
+	vector<vector<uint32_t>> nodeReaders(numNodes);
+	for (uint32_t op = 0; op < operations.size(); ++op)
+		for (uint32_t i = 0; i < operations[op].count; ++i)
+		{
+			vector<uint32_t>& list = nodeReaders[operands[operations[op].first + i]];
+			if (list.empty() || list.back() != op) list.push_back(op);
+		}
+	for (uint32_t n = 0; n < numNodes; ++n)
+	{
+		readerStart.push_back((uint32_t)readers.size());
+		readers.insert(readers.end(), nodeReaders[n].begin(), nodeReaders[n].end());
+	}
+	readerStart.push_back((uint32_t)readers.size());
+	return true;
+}
+
+// identifies the levelized netlist, so code compiled from one circuit is not run with another
+uint64_t Netlist::checksum() const
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	auto mix = [&](uint64_t value)
+	{
+		for (int i = 0; i < 8; ++i) hash = (hash ^ (value >> i * 8 & 0xff)) * 0x100000001b3;
+	};
+	mix(numNodes);
+	for (const Operation& operation : operations) mix((uint64_t)operation.type << 56 | (uint64_t)operation.pull << 48 | operation.output), mix(operation.count);
+	for (uint32_t operand : operands) mix(operand);
+	for (const Block& block : blocks) mix((uint64_t)block.first << 32 | block.count << 1 | block.loop);
+	return hash;
+}
+
+// the C++ expression for an operation
+string operationCode(const Netlist& netlist, const Operation& operation)
+{
+	auto node = [](uint32_t n) { return n == nodeLow ? string("0") : n == nodeHigh ? string("one") : "v[" + to_string(n) + "]"; };
+	const uint32_t* operands = netlist.operands.data() + operation.first;
+	string code;
+	if (operation.type == OP_BUS)
+	{
+		// low if anything pulls it low, otherwise high if anything drives it high or it is pulled up
+		string low, high;
+		for (uint32_t i = 0; i < operation.count; i += 2)
+		{
+			auto term = [&](const string& value) { return operands[i] == nodeHigh ? value : "(" + node(operands[i]) + " & " + value + ")"; };
+			if (operands[i + 1] == nodeLow) low += (low.empty() ? "" : " | ") + node(operands[i]);
+			else if (operands[i + 1] == nodeHigh) high += (high.empty() ? "" : " | ") + node(operands[i]);
+			else
+			{
+				low += (low.empty() ? "" : " | ") + term("(" + node(operands[i + 1]) + " ^ one)");
+				high += (high.empty() ? "" : " | ") + term(node(operands[i + 1]));
+			}
+		}
+		if (low.empty()) low = "0";
+		if (operation.pull) return "(" + low + ") ^ one";
+		if (high.empty()) return "0";
+		return "(" + high + ") & ((" + low + ") ^ one)";
+	}
+	static const char* joins[] = { " & ", " | ", " & ", " | ", " ^ ", " ^ ", "", "" };
+	for (uint32_t i = 0; i < operation.count; ++i) code += (i ? joins[operation.type] : "") + node(operands[i]);
+	if (operation.count == 0) code = operation.type == OP_AND || operation.type == OP_NAND ? "one" : "0";
+	bool negated = operation.type == OP_NAND || operation.type == OP_NOR || operation.type == OP_XNOR || operation.type == OP_NOT;
+	return negated ? "(" + code + ") ^ one" : code;
+}
+
+// writes the levelized netlist as a function that settles it, for building into the simulator
+string Netlist::emit(const string& filename) const
+{
+	char line[160];
+	string code = "// the netlist of " + filename + " levelized by gatesim --emit, build it in with -DCOMPILED_CIRCUIT\n";
+	snprintf(line, sizeof(line), "// %u nodes, %u operations in %u blocks, %u levels\n\n", numNodes, (unsigned)operations.size(), (unsigned)blocks.size(), levels);
+	code += line;
+	snprintf(line, sizeof(line), "#define COMPILED_CIRCUIT_CHECKSUM 0x%016llxull\n\n", (unsigned long long)checksum());
+	code += line;
+	code += "template <class Circuit, class Word>\nvoid settleCompiled(Circuit& circuit, Word* v)\n{\n\tconst Word one = Circuit::one;\n";
+	for (const Block& block : blocks)
+	{
+		string indent = block.loop ? "\t\t" : "\t";
+		if (block.loop) code += "\tfor (int pass = 0;; ++pass)\n\t{\n\t\tWord changed = 0, t;\n";
+		for (uint32_t i = block.first; i < block.first + block.count; ++i)
+		{
+			const Operation& operation = operations[i];
+			if (operation.type == OP_DEVICE)
+			{
+				code += indent + (block.loop ? "changed |= " : "") + "circuit.evaluateDevice(" + to_string(operation.output) + ");\n";
+				continue;
+			}
+			string output = "v[" + to_string(operation.output) + "]";
+			if (block.loop) code += indent + "t = " + operationCode(*this, operation) + "; changed |= t ^ " + output + "; " + output + " = t;\n";
+			else code += indent + output + " = " + operationCode(*this, operation) + ";\n";
+		}
+		if (block.loop) code += "\t\tif (!changed) break;\n\t\tif (pass == settleLimit)\n\t\t{\n\t\t\tcircuit.oscillating();\n\t\t\tbreak;\n\t\t}\n\t}\n";
+	}
+	code += "}\n";
+	return code;
+}
+
+#ifdef COMPILED_CIRCUIT
+#include COMPILED_CIRCUIT
+#endif
+
+// the position of the lowest bit that is set
+inline int lowestBit(uint64_t bits)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(bits);
+#else
+	int position = 0;
+	for (; !(bits & 1); bits >>= 1) ++position;
+	return position;
+#endif
+}
+
+// the state of the circuit as it runs, with one copy of the CPU in each bit of a Word: a uint8_t
+// holds a single CPU whose nodes are 0 or 1, a uint64_t runs 64 of them at once
+template <class Word>
+struct Circuit
+{
+	static constexpr int lanes = sizeof(Word) == 1 ? 1 : (int)sizeof(Word) * 8;
+	static constexpr Word one = lanes == 1 ? 1 : (Word)~(Word)0;	// a node that is high in every lane
+
+	Netlist netlist;
+	vector<Word> values;
+	vector<Word> previous;			// the values at the end of the last cycle, to tell when it stops
+	vector<uint64_t> pending;		// the operations to run again, by position
+	vector<uint32_t> deviceOperations;	// the position of each device's operation
+	vector<vector<uint8_t>> memories;	// the memory of each ROM and RAM, a copy for each lane one after another
+	vector<vector<Word>> addresses;		// the address lines each ROM and RAM was last read with
+	vector<uint8_t> stale;			// whether a RAM has been written since it was last read
+	bool compiled = false;
+	uint64_t cycles = 0;
+	uint64_t oscillations = 0;
+	string console[lanes];
+	bool logStores = false;			// keep the address of everything stored to RAM in stores
+	vector<uint16_t> stores[lanes];
+
+	void oscillating()
+	{
+		++oscillations;
+	}
+
+	uint8_t* memory(uint32_t device, int lane)
+	{
+		return memories[device].data() + (size_t)lane * netlist.devices[device].memory.size();
+	}
+
+	// the number in each lane of a group of nodes
+	uint32_t word(const vector<uint32_t>& nodes, int lane) const
+	{
+		uint32_t value = 0;
+		for (size_t bit = 0; bit < nodes.size(); ++bit) value |= (uint32_t)(values[nodes[bit]] >> lane & 1) << bit;
+		return value;
+	}
+
+	// drives the data lines of a ROM or RAM, or sets the outputs of a comparator; returns the lanes where any changed
+	Word evaluateDevice(uint32_t index)
+	{
+		const Device& device = netlist.devices[index];
+		Word* v = values.data();
+		Word changed = 0;
+		auto set = [&](uint32_t node, Word value)
+		{
+			changed |= v[node] ^ value;
+			v[node] = value;
+		};
+		if (device.type == DEVICE_COMPARATOR)
+		{
+			// compares a bit at a time from the top, in every lane at once
+			Word greater = 0, less = 0, equal = one;
+			for (size_t bit = device.data.size(); bit-- > 0;)
+			{
+				Word a = v[device.data[bit]], b = v[device.address[bit]];
+				if (device.twosComplement && bit == device.data.size() - 1)
+				{
+					// flipping the sign bits makes signed numbers compare like unsigned ones
+					a ^= one;
+					b ^= one;
+				}
+				greater |= equal & a & (b ^ one);
+				less |= equal & (a ^ one) & b;
+				equal &= a ^ b ^ one;
+			}
+			set(device.outputs[0], greater);
+			set(device.outputs[1], equal);
+			set(device.outputs[2], less);
+			return changed;
+		}
+		if (device.type == DEVICE_RAM) set(device.driving, v[device.select] & v[device.enable]);
+
+		// the memory is only read again when the address or what is stored has changed
+		vector<Word>& last = addresses[index];
+		bool same = !stale[index];
+		for (size_t bit = 0; bit < device.address.size(); ++bit)
+		{
+			same = same && last[bit] == v[device.address[bit]];
+			last[bit] = v[device.address[bit]];
+		}
+		if (same) return changed;
+		stale[index] = false;
+		uint32_t laneAddresses[lanes] = {};
+		for (size_t bit = 0; bit < device.address.size(); ++bit)
+			for (Word bits = last[bit]; bits; bits &= bits - 1) laneAddresses[lowestBit(bits)] |= 1u << bit;
+		Word data[8] = {};
+		for (int lane = 0; lane < lanes; ++lane)
+		{
+			uint8_t value = memory(index, lane)[laneAddresses[lane]];
+			for (size_t bit = 0; bit < device.outputs.size(); ++bit) data[bit] |= (Word)(value >> bit & 1) << lane;
+		}
+		for (size_t bit = 0; bit < device.outputs.size(); ++bit) set(device.outputs[bit], data[bit]);
+		return changed;
+	}
+
+	// marks the operations that read a node to be run again
+	void touch(uint32_t node)
+	{
+		for (uint32_t i = netlist.readerStart[node]; i < netlist.readerStart[node + 1]; ++i)
+			pending[netlist.readers[i] >> 6] |= 1ull << (netlist.readers[i] & 63);
+	}
+
+	// sets a node driven from outside, like the clock or a button
+	void setInput(uint32_t node, Word value)
+	{
+		if (values[node] == value) return;
+		values[node] = value;
+		touch(node);
+	}
+
+	// runs the operation at a position, and marks whatever reads its output if it changed
+	void evaluate(uint32_t position)
+	{
+		const Operation& operation = netlist.operations[position];
+		const uint32_t* in = netlist.operands.data() + operation.first;
+		Word* v = values.data();
+		Word value;
+		switch (operation.type)
+		{
+		case OP_AND:
+		case OP_NAND:
+			value = one;
+			for (uint32_t k = 0; k < operation.count; ++k) value &= v[in[k]];
+			if (operation.type == OP_NAND) value ^= one;
+			break;
+		case OP_OR:
+		case OP_NOR:
+			value = 0;
+			for (uint32_t k = 0; k < operation.count; ++k) value |= v[in[k]];
+			if (operation.type == OP_NOR) value ^= one;
+			break;
+		case OP_XOR:
+		case OP_XNOR:
+			value = operation.type == OP_XNOR ? one : 0;
+			for (uint32_t k = 0; k < operation.count; ++k) value ^= v[in[k]];
+			break;
+		case OP_BUFFER:
+			value = v[in[0]];
+			break;
+		case OP_NOT:
+			value = v[in[0]] ^ one;
+			break;
+		case OP_BUS:
+		{
+			Word low = 0, high = 0;
+			for (uint32_t k = 0; k < operation.count; k += 2)
+			{
+				low |= v[in[k]] & (v[in[k + 1]] ^ one);
+				high |= v[in[k]] & v[in[k + 1]];
+			}
+			value = (high | (operation.pull ? one : 0)) & (low ^ one);
+			break;
+		}
+		default: // OP_DEVICE
+			if (evaluateDevice(operation.output))
+			{
+				const Device& device = netlist.devices[operation.output];
+				for (uint32_t node : device.outputs) touch(node);
+				if (device.type == DEVICE_RAM) touch(device.driving);
+			}
+			return;
+		}
+		if (v[operation.output] == value) return;
+		v[operation.output] = value;
+		touch(operation.output);
+	}
+
+	// the first operation marked to run from position up to end, or end if there are none
+	uint32_t nextPending(uint32_t position, uint32_t end) const
+	{
+		while (position < end)
+		{
+			uint64_t word = pending[position >> 6] >> (position & 63);
+			if (word) return min(position + lowestBit(word), end);
+			position = (position | 63) + 1;
+		}
+		return end;
+	}
+
+	// runs the operations whose operands changed in levelized order, going around each loop until
+	// it stops changing; an operation marked by one further on waits for the next pass, so this
+	// gives the same values as running every operation in every pass
+	void settle()
+	{
+#ifdef COMPILED_CIRCUIT
+		if (compiled)
+		{
+			settleCompiled(*this, values.data());
+			return;
+		}
+#endif
+		for (const Block& block : netlist.blocks)
+		{
+			uint32_t end = block.first + block.count;
+			for (int pass = 0;; ++pass)
+			{
+				uint32_t position = nextPending(block.first, end);
+				if (position == end) break;
+				if (pass > settleLimit)
+				{
+					oscillating();
+					break;
+				}
+				for (; position < end; position = nextPending(position + 1, end))
+				{
+					pending[position >> 6] &= ~(1ull << (position & 63));
+					evaluate(position);
+				}
+			}
+		}
+	}
+
+	bool build(const string& filename)
+	{
+		if (!netlist.build(filename)) return false;
+		deviceOperations.assign(netlist.devices.size(), 0);
+		for (uint32_t i = 0; i < netlist.operations.size(); ++i)
+			if (netlist.operations[i].type == OP_DEVICE) deviceOperations[netlist.operations[i].output] = i;
+		stale.assign(netlist.devices.size(), true);
+		for (const Device& device : netlist.devices)
+		{
+			addresses.emplace_back(device.address.size(), 0);
+			memories.emplace_back();
+			for (int lane = 0; lane < lanes; ++lane) memories.back().insert(memories.back().end(), device.memory.begin(), device.memory.end());
+		}
+#ifdef COMPILED_CIRCUIT
+		compiled = netlist.checksum() == COMPILED_CIRCUIT_CHECKSUM;
+		if (!compiled) cerr << "WARNING: the compiled netlist is not from " << filename << ", so it is interpreted\n";
+#endif
+		return true;
+	}
+
+	// puts a program in the ROM of a lane, the rest of the ROM is cleared
+	void load(int lane, const vector<uint8_t>& program)
+	{
+		for (uint32_t i = 0; i < netlist.devices.size(); ++i)
+		{
+			if (netlist.devices[i].type != DEVICE_ROM) continue;
+			uint8_t* rom = memory(i, lane);
+			size_t size = netlist.devices[i].memory.size();
+			fill(rom, rom + size, 0);
+			copy(program.begin(), program.begin() + min(program.size(), size), rom);
+			stale[i] = true;
+		}
+	}
+
+	// the length of the ROM of a lane up to the last byte that is not 0
+	size_t programSize(int lane)
+	{
+		size_t size = 0;
+		for (uint32_t i = 0; i < netlist.devices.size(); ++i)
+		{
+			if (netlist.devices[i].type != DEVICE_ROM) continue;
+			const uint8_t* rom = memory(i, lane);
+			size_t end = netlist.devices[i].memory.size();
+			while (end > 0 && rom[end - 1] == 0) --end;
+			size = max(size, end);
+		}
+		return size;
+	}
+
+	// switches the power on with every node low, the RAM as it was saved in the circuit and the text display empty
+	void powerOn()
+	{
+		for (uint32_t i = 0; i < netlist.devices.size(); ++i)
+		{
+			if (netlist.devices[i].type != DEVICE_RAM) continue;
+			for (int lane = 0; lane < lanes; ++lane) copy(netlist.devices[i].memory.begin(), netlist.devices[i].memory.end(), memory(i, lane));
+		}
+		stale.assign(netlist.devices.size(), true);
+		for (string& text : console) text.clear();
+		values.assign(netlist.numNodes, 0);
+		values[nodeHigh] = one;
+		for (auto& node : netlist.fixed) values[node.first] = node.second ? one : 0;
+		pending.assign((netlist.operations.size() + 63) / 64, ~0ull);
+		settle();
+		previous = values;
+		cycles = 0;
+	}
+
+	// the clock devices see their inputs as they were just before the clock changed
+	void halfCycle(Word clock)
+	{
+		Word* v = values.data();
+		vector<Word> before;
+		for (const Device& device : netlist.devices)
+		{
+			if (device.type != DEVICE_TTY) continue;
+			before.push_back(v[device.select]);
+			before.push_back(v[device.enable]);
+			for (uint32_t node : device.data) before.push_back(v[node]);
+		}
+		setInput(netlist.clock, clock);
+		settle();
+
+		size_t tty = 0;
+		for (uint32_t index = 0; index < netlist.devices.size(); ++index)
+		{
+			const Device& device = netlist.devices[index];
+			if (device.type == DEVICE_TTY)
+			{
+				Word printing = (before[tty] ^ one) & v[device.select] & before[tty + 1] & (v[device.clear] ^ one);
+				for (int lane = 0; printing; ++lane, printing >>= 1)
+				{
+					if (!(printing & 1)) continue;
+					char character = 0;
+					for (size_t bit = 0; bit < device.data.size(); ++bit) character |= (before[tty + 2 + bit] >> lane & 1) << bit;
+					console[lane] += character;
+				}
+				tty += 2 + device.data.size();
+			}
+			else if (device.type == DEVICE_RAM)
+			{
+				// an asynchronous port stores whatever is on the data lines while it is selected and not loading
+				Word clearing = v[device.clear], storing = v[device.select] & (v[device.enable] ^ one) & (v[device.clear] ^ one);
+				if (!clearing && !storing) continue;
+				for (int lane = 0; lane < lanes; ++lane)
+				{
+					uint8_t* ram = memory(index, lane);
+					if (clearing >> lane & 1) fill(ram, ram + device.memory.size(), 0);
+					else if (storing >> lane & 1)
+					{
+						uint32_t address = word(device.address, lane);
+						ram[address] = (uint8_t)word(device.data, lane);
+						if (logStores) stores[lane].push_back((uint16_t)address);
+					}
+				}
+				stale[index] = true;
+				pending[deviceOperations[index] >> 6] |= 1ull << (deviceOperations[index] & 63);
+			}
+		}
+	}
+
+	// runs a clock cycle, returns the lanes where anything changed; a lane where nothing changes
+	// from one cycle to the next has stopped, which is what HLT does by stopping the clock
+	Word cycle()
+	{
+		halfCycle(one);
+		halfCycle(0);
+		++cycles;
+		Word running = 0;
+		for (size_t i = 0; i < values.size(); ++i) running |= values[i] ^ previous[i];
+		previous = values;
+		return running;
+	}
+
+	void press(uint32_t button, int numCycles)
+	{
+		setInput(button, one);
+		for (int i = 0; i < numCycles; ++i) cycle();
+		setInput(button, 0);
+	}
+
+	void flushConsole()
+	{
+		fwrite(console[0].data(), 1, console[0].size(), stdout);
+		fflush(stdout);
+		console[0].clear();
+	}
+};
+
+int hexValue(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// places a record's data in the program, growing it to cover the record
+bool placeRecord(vector<uint8_t>& program, uint32_t address, const uint8_t* data, size_t count)
+{
+	if (address + count > memorySize) return false;
+	if (program.size() < address + count) program.resize(address + count);
+	copy(data, data + count, program.begin() + address);
+	return true;
+}
+
+// loads Intel HEX or Motorola S-records, the gaps between the records are left as zeros
+bool loadRecords(const string& data, const string& filename, vector<uint8_t>& program)
+{
+	vector<uint8_t> record;
+	size_t lineNumber = 0;
+	for (size_t start = 0; start < data.size(); ++lineNumber)
+	{
+		size_t end = min(data.find('\n', start), data.size());
+		string line = data.substr(start, end - start);
+		start = end + 1;
+		while (!line.empty() && isspace((unsigned char)line.back())) line.pop_back();
+		if (line.empty()) continue;
+
+		// every record is a start character (and type for S-records) followed by hex bytes
+		bool intel = line[0] == ':';
+		size_t first = intel ? 1 : 2;
+		record.clear();
+		bool valid = (intel || (line[0] == 'S' && line.size() > 1)) && (line.size() - first) % 2 == 0;
+		for (size_t i = first; valid && i < line.size(); i += 2)
+		{
+			int high = hexValue(line[i]), low = hexValue(line[i + 1]);
+			valid = high >= 0 && low >= 0;
+			record.push_back((uint8_t)(high << 4 | low));
+		}
+		uint8_t checksum = 0;
+		for (uint8_t byte : record) checksum += byte;
+		if (intel) valid = valid && record.size() >= 5 && record[0] == record.size() - 5 && checksum == 0;
+		else valid = valid && record.size() >= 3 && record[0] == record.size() - 1 && checksum == 0xff;
+		if (!valid)
+		{
+			cerr << "ERROR: line " << lineNumber + 1 << " of " << filename << " is not a valid record!\n";
+			return false;
+		}
+
+		bool placed = true;
+		if (intel)
+		{
+			// data, end of file, or extended and start addresses, which only matter beyond 64K
+			uint8_t type = record[3];
+			if (type == 0x00) placed = placeRecord(program, record[1] << 8 | record[2], &record[4], record[0]);
+			else if (type == 0x01) break;
+			else if (type == 0x02 || type == 0x04) placed = record[4] == 0 && record[5] == 0;
+		}
+		else if (line[1] >= '1' && line[1] <= '3')
+		{
+			// S1, S2 and S3 hold data with 2, 3 and 4 byte addresses, the other records are headers, counts and start addresses
+			size_t addressSize = line[1] - '0' + 1;
+			if (record.size() < addressSize + 2)
+			{
+				cerr << "ERROR: line " << lineNumber + 1 << " of " << filename << " is not a valid record!\n";
+				return false;
+			}
+			uint32_t address = 0;
+			for (size_t i = 1; i <= addressSize; ++i) address = address << 8 | record[i];
+			placed = placeRecord(program, address, &record[addressSize + 1], record.size() - addressSize - 2);
+		}
+		if (!placed)
+		{
+			cerr << "ERROR: " << filename << " does not fit in memory!\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// loads a program written by the assembler: raw binary, its space separated hex text, Intel HEX or S-records
+bool loadProgram(string filename, vector<uint8_t>& program)
+{
+	ifstream file(filename, ios::binary);
+	if (!file.is_open())
+	{
+		cerr << "ERROR: could not open " << filename << "!\n";
+		return false;
+	}
+	string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+	// the format is told by the extension, since a binary can start with any byte
+	string extension = filename.substr(min(filename.find_last_of('.'), filename.size()));
+	for (char& c : extension) c = tolower((unsigned char)c);
+	program.clear();
+	if (extension == ".hex" || extension == ".ihex" || extension == ".s19" || extension == ".srec")
+		return loadRecords(data, filename, program);
+	if (extension == ".txt")
+	{
+		for (size_t i = 0; i < data.size(); ++i)
+		{
+			if (isspace((unsigned char)data[i])) continue;
+			int high = hexValue(data[i]);
+			int low = i + 1 < data.size() ? hexValue(data[i + 1]) : -1;
+			if (high < 0 || low < 0)
+			{
+				cerr << "ERROR: " << filename << " is not a hex dump!\n";
+				return false;
+			}
+			program.push_back((uint8_t)(high << 4 | low));
+			++i;
+		}
+	}
+	else program.assign(data.begin(), data.end());
+
+	if (program.size() > memorySize)
+	{
+		cerr << "ERROR: " << filename << " does not fit in memory!\n";
+		return false;
+	}
+	return true;
+}
+
+// prints what the circuit was reduced to
+void printStatistics(const Netlist& netlist)
+{
+	size_t counts[OP_DEVICE + 1] = {}, loops = 0, inLoops = 0, largest = 0;
+	for (const Operation& operation : netlist.operations) ++counts[operation.type];
+	for (const Block& block : netlist.blocks)
+		if (block.loop)
+		{
+			++loops;
+			inLoops += block.count;
+			largest = max(largest, (size_t)block.count);
+		}
+	fprintf(stderr, "%u components, %u wires, %u nets, %u nodes\n", (unsigned)netlist.components.size(), (unsigned)netlist.wires.size(), netlist.numNets, netlist.numNodes);
+	fprintf(stderr, "%u operations:", (unsigned)netlist.operations.size());
+	for (int type = 0; type <= OP_DEVICE; ++type)
+		if (counts[type]) fprintf(stderr, " %u %s", (unsigned)counts[type], operationNames[type]);
+	fprintf(stderr, "\n%u levels, %u loops holding %u operations (the largest %u)\n", netlist.levels, (unsigned)loops, (unsigned)inLoops, (unsigned)largest);
+}
+
+void printUsage()
+{
+	cerr << "usage: gatesim [options] [program...]\n"
+		"  program            binary, _hex.txt, Intel HEX or S-record file to put in the ROM (default the ROM saved in the circuit)\n"
+		"  --circ=FILE        the circuit to simulate (default \"Chameleon CPU.circ\")\n"
+		"  --cycles=N         stop after N clock cycles of the program (default 10000000, 0 for no limit)\n"
+		"  --load=N           cycles HRD RST copies the ROM into RAM for before SFT RST starts the program\n"
+		"                     (default up to the last byte of the ROM that is not 0)\n"
+		"  --lanes=N          run N copies of the CPU at once, up to 64, each with the next program in turn\n"
+		"                     (default one for each program)\n"
+		"  --emit=FILE        write the levelized netlist as C++ to FILE\n"
+		"  --check            run the programs next to the instruction set, stopping at the first difference\n"
+		"  --random=N         check N random programs instead\n"
+		"  --seed=N           the seed of the first random program, each one after uses the next (default 1)\n"
+		"  --skip=NAMES       leave these instructions and ALU operations out of the random programs, e.g. PSH,BR,AND\n"
+		"  --stats            print what the circuit was reduced to\n"
+		"  -q                 do not print the statistics when the programs stop\n";
+}
+
+// what a lane printed, as a string in quotes with anything that is not printable escaped
+string quoted(const string& text)
+{
+	string result = "\"";
+	for (char c : text)
+	{
+		char escape[8];
+		if (c == '\n') result += "\\n";
+		else if (c == '"' || c == '\\') result += string("\\") + c;
+		else if (c < ' ' || c > '~')
+		{
+			snprintf(escape, sizeof(escape), "\\x%02x", (unsigned char)c);
+			result += escape;
+		}
+		else result += c;
+	}
+	return result + "\"";
+}
+
+// builds the circuit and runs the programs on it, a lane each, and returns the exit code
+template <class Word>
+int run(const string& circuitFile, const vector<string>& inputs, int numLanes, const string& emitFile, uint64_t maxCycles, int64_t loadCycles, bool quiet, bool statistics)
+{
+	typedef Circuit<Word> LaneCircuit;
+	unique_ptr<LaneCircuit> circuit(new LaneCircuit);
+	auto start = chrono::steady_clock::now();
+	if (!circuit->build(circuitFile)) return 1;
+	double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	if (statistics)
+	{
+		printStatistics(circuit->netlist);
+		fprintf(stderr, "read and levelized in %.1f ms%s\n", buildSeconds * 1000, circuit->compiled ? ", running the compiled netlist" : "");
+	}
+	if (!emitFile.empty())
+	{
+		ofstream out(emitFile, ios::binary);
+		out << circuit->netlist.emit(circuitFile);
+		if (!out.good())
+		{
+			cerr << "ERROR: could not write " << emitFile << "!\n";
+			return 1;
+		}
+		if (inputs.empty()) return 0;
+	}
+
+	bool hasRom = false;
+	for (const Device& device : circuit->netlist.devices) hasRom = hasRom || device.type == DEVICE_ROM;
+	if (!hasRom)
+	{
+		cerr << "ERROR: " << circuitFile << " has no ROM!\n";
+		return 1;
+	}
+	vector<uint8_t> program;
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		if (!loadProgram(inputs[i], program)) return 1;
+		for (int lane = (int)i; lane < LaneCircuit::lanes; lane += (int)inputs.size()) circuit->load(lane, program);
+	}
+	if (loadCycles < 0)
+	{
+		loadCycles = 0;
+		for (int lane = 0; lane < numLanes; ++lane) loadCycles = max(loadCycles, (int64_t)circuit->programSize(lane));
+	}
+
+	// HRD RST copies the ROM into RAM, a cycle a byte, and SFT RST starts the program
+	start = chrono::steady_clock::now();
+	circuit->powerOn();
+	circuit->press(circuit->netlist.hardReset, resetCycles);
+	for (int64_t i = 0; i < loadCycles; ++i) circuit->cycle();
+	circuit->press(circuit->netlist.softReset, resetCycles);
+	uint64_t loaded = circuit->cycles;
+
+	// each lane stops when its clock does, the cycle that showed nothing changes any more is not part of its program
+	Word waiting = numLanes == LaneCircuit::lanes ? LaneCircuit::one : (Word)(((Word)1 << numLanes) - 1);
+	vector<uint64_t> programCycles(numLanes, 0);
+	while (waiting && circuit->cycles - loaded < maxCycles)
+	{
+		Word running = circuit->cycle();
+		for (int lane = 0; lane < numLanes; ++lane)
+			if ((waiting & ~running) >> lane & 1) programCycles[lane] = circuit->cycles - loaded - 1;
+		waiting &= running;
+		if (numLanes == 1 && circuit->console[0].size() >= 64) circuit->flushConsole();
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	if (numLanes == 1)
+	{
+		circuit->flushConsole();
+		if (!quiet)
+		{
+			fprintf(stderr, "\n%s after %llu cycles (%llu loading), %.3f s, %.1f kHz\n", waiting ? "cycle limit reached" : "halted",
+				(unsigned long long)(waiting ? circuit->cycles - loaded : programCycles[0]), (unsigned long long)loaded, seconds, circuit->cycles / seconds / 1000);
+		}
+	}
+	else
+	{
+		for (int lane = 0; lane < numLanes; ++lane)
+		{
+			string name = inputs.empty() ? circuitFile : inputs[lane % inputs.size()];
+			bool halted = !(waiting >> lane & 1);
+			printf("lane %d: %s %s after %llu cycles: %s\n", lane, name.c_str(), halted ? "halted" : "cycle limit reached",
+				(unsigned long long)(halted ? programCycles[lane] : circuit->cycles - loaded), quoted(circuit->console[lane]).c_str());
+		}
+		fflush(stdout);
+		if (!quiet)
+		{
+			fprintf(stderr, "%d lanes, %llu cycles each (%llu loading), %.3f s, %.1f kHz, %.2f million lane cycles/s\n", numLanes, (unsigned long long)circuit->cycles,
+				(unsigned long long)loaded, seconds, circuit->cycles / seconds / 1000, circuit->cycles * (double)numLanes / seconds / 1e6);
+		}
+	}
+	if (!quiet && circuit->oscillations) fprintf(stderr, "WARNING: the circuit oscillated %llu times\n", (unsigned long long)circuit->oscillations);
+	return waiting ? 1 : 0;
+}
+
+// condition flags, in the same order as the low nibble of BR and BN
+enum ConditionFlag : uint8_t
+{
+	FLAG_C = 0x1,
+	FLAG_Z = 0x2,
+	FLAG_N = 0x4,
+	FLAG_V = 0x8
+};
+
+// high nibble of each opcode (the emulator's OP_ names are taken by the operations here)
+enum Instruction : uint8_t
+{
+	INS_NOP, INS_ALM, INS_ALA, INS_ALI, INS_ALS, INS_LOD, INS_LDI, INS_STO,
+	INS_PSH, INS_POP, INS_JMP, INS_BR, INS_BN, INS_JSR, INS_RSR, INS_HLT
+};
+
+const char* instructionNames[] = { "NOP", "ALM", "ALA", "ALI", "ALS", "LOD", "LDI", "STO", "PSH", "POP", "JMP", "BR", "BN", "JSR", "RSR", "HLT" };
+
+// ALU operations, the low nibble of ALM, ALA, ALI and ALS
+enum AluOperation : uint8_t
+{
+	ALU_ADD, ALU_ADC, ALU_SUB, ALU_SBB, ALU_ONC, ALU_TWC, ALU_AND, ALU_OR,
+	ALU_XOR, ALU_LSL, ALU_LSR, ALU_ASR, ALU_ROL, ALU_ROR, ALU_RCL, ALU_RCR
+};
+
+const char* aluNames[] = { "ADD", "ADC", "SUB", "SBB", "ONC", "TWC", "AND", "OR", "XOR", "LSL", "LSR", "ASR", "ROL", "ROR", "RCL", "RCR" };
+
+// clock cycles taken by each instruction, including the fetch, and the extra cycles a branch takes when it falls through
+constexpr uint8_t cycleCounts[16] = { 2, 4, 2, 2, 3, 4, 2, 4, 2, 3, 4, 4, 4, 6, 6, 2 };
+constexpr uint8_t branchNotTakenCycles = 2;
+
+// bytes taken by each instruction, including the opcode
+constexpr uint8_t instructionLengths[16] = { 1, 3, 1, 2, 1, 3, 2, 3, 1, 1, 3, 3, 3, 3, 1, 1 };
+
+constexpr uint16_t stackPage = 0xff00;
+constexpr uint16_t consoleAddress = 0xfeff;
+
+// result of an ALU operation along with the new flags
+struct AluResult
+{
+	uint8_t value;
+	uint8_t flags;
+};
+
+// the ALU as the instruction set describes it, the same as the emulator's
+AluResult alu(uint8_t operation, uint8_t a, uint8_t b, uint8_t flags)
+{
+	unsigned carryIn = flags & FLAG_C;
+	unsigned result;
+	uint8_t carry = 0, overflow = 0;
+
+	switch (operation)
+	{
+	case ALU_ADD:
+		carryIn = 0;
+		// fall through
+	case ALU_ADC:
+		result = a + b + carryIn;
+		carry = result >> 8;
+		overflow = ~(a ^ b) & (a ^ result) & 0x80;
+		break;
+	case ALU_SUB:
+		carryIn = 1;
+		// fall through
+	case ALU_SBB:
+		// subtraction adds the complement, so carry set means no borrow
+		result = a + (uint8_t)~b + carryIn;
+		carry = result >> 8;
+		overflow = (a ^ b) & (a ^ result) & 0x80;
+		break;
+	case ALU_ONC:
+		result = (uint8_t)~b;
+		break;
+	case ALU_TWC:
+		result = (uint8_t)~b + 1;
+		carry = result >> 8;
+		overflow = b == 0x80;
+		break;
+	case ALU_AND:
+		result = a & b;
+		break;
+	case ALU_OR:
+		result = a | b;
+		break;
+	case ALU_XOR:
+		result = a ^ b;
+		break;
+	case ALU_LSL:
+		result = b << 1;
+		carry = b >> 7;
+		break;
+	case ALU_LSR:
+		result = b >> 1;
+		carry = b & 1;
+		break;
+	case ALU_ASR:
+		result = (b >> 1) | (b & 0x80);
+		carry = b & 1;
+		break;
+	case ALU_ROL:
+		result = (b << 1) | (b >> 7);
+		carry = b >> 7;
+		break;
+	case ALU_ROR:
+		result = (b >> 1) | (b << 7);
+		carry = b & 1;
+		break;
+	case ALU_RCL:
+		result = (b << 1) | carryIn;
+		carry = b >> 7;
+		break;
+	default: // ALU_RCR
+		result = (b >> 1) | (carryIn << 7);
+		carry = b & 1;
+		break;
+	}
+
+	uint8_t value = (uint8_t)result;
+	return { value, (uint8_t)((carry ? FLAG_C : 0) | (value == 0 ? FLAG_Z : 0) | (value & 0x80 ? FLAG_N : 0) | (overflow ? FLAG_V : 0)) };
+}
+
+// the CPU as the instruction set describes it, run an instruction at a time next to the circuit by --check
+struct Machine
+{
+	vector<uint8_t> memory;
+	uint16_t pc = 0;
+	uint8_t a = 0;
+	uint8_t flags = 0;
+	uint8_t sp = 0;
+	bool halted = false;
+	uint64_t cycles = 0;
+	uint64_t instructions = 0;
+	string console;
+	vector<uint16_t> stores;	// the addresses stored to since they were last checked
+
+	void load(const vector<uint8_t>& program)
+	{
+		memory.assign(memorySize, 0);
+		copy(program.begin(), program.end(), memory.begin());
+		pc = 0;
+		a = 0;
+		flags = 0;
+		sp = 0;
+		halted = false;
+		cycles = 0;
+		instructions = 0;
+		console.clear();
+		stores.clear();
+	}
+
+	uint16_t operand() const
+	{
+		return memory[(uint16_t)(pc + 1)] | memory[(uint16_t)(pc + 2)] << 8;
+	}
+
+	void store(uint16_t address, uint8_t value)
+	{
+		memory[address] = value;
+		stores.push_back(address);
+		if (address == consoleAddress) console += (char)(value & 0x7f);
+	}
+
+	void step()
+	{
+		uint8_t opcode = memory[pc];
+		cycles += cycleCounts[opcode >> 4];
+		++instructions;
+		AluResult result;
+		switch (opcode >> 4)
+		{
+		case INS_NOP:
+			pc += 1;
+			return;
+		case INS_ALM:
+			result = alu(opcode & 0xf, a, memory[operand()], flags);
+			pc += 3;
+			break;
+		case INS_ALA:
+			result = alu(opcode & 0xf, a, a, flags);
+			pc += 1;
+			break;
+		case INS_ALI:
+			result = alu(opcode & 0xf, a, memory[(uint16_t)(pc + 1)], flags);
+			pc += 2;
+			break;
+		case INS_ALS:
+			result = alu(opcode & 0xf, a, memory[stackPage | --sp], flags);
+			pc += 1;
+			break;
+		case INS_LOD:
+			a = memory[operand()];
+			pc += 3;
+			return;
+		case INS_LDI:
+			a = memory[(uint16_t)(pc + 1)];
+			pc += 2;
+			return;
+		case INS_STO:
+			store(operand(), a);
+			pc += 3;
+			return;
+		case INS_PSH:
+			store(stackPage | sp++, a);
+			pc += 1;
+			return;
+		case INS_POP:
+			a = memory[stackPage | --sp];
+			pc += 1;
+			return;
+		case INS_BR:
+		case INS_BN:
+			// BR branches if any of the flags in the low nibble are set, BN if none of them are
+			if (((opcode >> 4) == INS_BR) == !(flags & opcode & 0xf))
+			{
+				cycles += branchNotTakenCycles;
+				pc += 3;
+				return;
+			}
+			// fall through
+		case INS_JMP:
+			pc = operand();
+			return;
+		case INS_JSR:
+		{
+			uint16_t ret = pc + 1;
+			store(stackPage | sp++, (uint8_t)ret);
+			store(stackPage | sp++, ret >> 8);
+			pc = operand();
+			return;
+		}
+		case INS_RSR:
+		{
+			uint16_t ret = memory[stackPage | --sp] << 8;
+			ret |= memory[stackPage | --sp];
+			pc = ret + 2;
+			return;
+		}
+		default: // INS_HLT
+			halted = true;
+			return;
+		}
+		a = result.value;
+		flags = result.flags;
+	}
+};
+
+// an instruction the way the assembler writes it, from its bytes
+string disassemble(const uint8_t* bytes)
+{
+	char text[32];
+	uint8_t opcode = bytes[0], operation = opcode >> 4;
+	unsigned address = bytes[1] | bytes[2] << 8;
+	string name = instructionNames[operation];
+	if (operation >= INS_ALM && operation <= INS_ALS) name = aluNames[opcode & 0xf];
+	if (operation == INS_LDI) name = "LOD";
+	if (operation == INS_BR || operation == INS_BN)
+		for (int flag = 0; flag < 4; ++flag)
+			if (opcode >> flag & 1) name += "CZNV"[flag];
+	switch (operation)
+	{
+	case INS_ALM: case INS_LOD: case INS_STO: case INS_JMP: case INS_BR: case INS_BN: case INS_JSR:
+		snprintf(text, sizeof(text), "%s 0x%04x", name.c_str(), address);
+		return text;
+	case INS_ALI: case INS_LDI:
+		snprintf(text, sizeof(text), "%s !0x%02x", name.c_str(), bytes[1]);
+		return text;
+	case INS_ALS:
+		return name + " #stack";
+	default:
+		return name;
+	}
+}
+
+// the flags as letters, with a dash for each one that is clear
+string flagLetters(uint8_t flags)
+{
+	string letters = "----";
+	for (int flag = 0; flag < 4; ++flag)
+		if (flags >> flag & 1) letters[flag] = "CZNV"[flag];
+	return letters;
+}
+
+// a random program for --random, which always halts: straight-line code with jumps and branches that only go forward,
+// calls to short subroutines placed after its HLT, and loads and stores to a block of data after them, the stack page
+// and the text display.  Instructions and ALU operations whose bit is set in skipped are left out.
+vector<uint8_t> randomProgram(uint64_t seed, uint32_t skipped)
+{
+	// at most 0x0791 bytes, below 0x07ff, which HRD RST doesn't copy unless it carries on past 0x1000
+	const int numInstructions = 600, numSubroutines = 8, dataSize = 32;
+	enum OperandKind { OPERAND_NONE, OPERAND_BYTE, OPERAND_ADDRESS, OPERAND_DATA, OPERAND_CODE, OPERAND_SUBROUTINE };
+	struct Slot
+	{
+		uint8_t opcode;
+		OperandKind kind;
+		uint32_t operand;	// a byte, an address, an offset into the data or the instruction or subroutine it refers to
+	};
+
+	mt19937_64 random(seed);
+	auto pick = [&](uint32_t n) { return (uint32_t)(random() % n); };
+	vector<Slot> code;
+
+	// somewhere to read a byte from, never the keyboard or the text display
+	auto source = [&]() -> Slot
+	{
+		uint32_t kind = pick(8);
+		if (kind < 5) return { 0, OPERAND_DATA, pick(dataSize) };
+		if (kind < 7) return { 0, OPERAND_ADDRESS, stackPage | pick(256) };
+		return { 0, OPERAND_CODE, pick(numInstructions) };
+	};
+	// somewhere to store a byte, not the stack page in a subroutine since that is where its return address is
+	auto destination = [&](bool stack) -> Slot
+	{
+		uint32_t kind = pick(20);
+		if (kind == 0) return { 0, OPERAND_ADDRESS, consoleAddress };
+		if (kind < 14 || !stack) return { 0, OPERAND_DATA, pick(dataSize) };
+		return { 0, OPERAND_ADDRESS, stackPage | pick(256) };
+	};
+	// an instruction that does not change the flow of the program, a NOP if everything it tried was skipped
+	auto simple = [&](bool stack) -> Slot
+	{
+		for (int tries = 0; tries < 64; ++tries)
+		{
+			uint8_t operation = pick(16);
+			Slot slot;
+			switch (pick(10))
+			{
+			case 0: slot = source(); slot.opcode = INS_ALM << 4 | operation; break;
+			case 1: slot = { (uint8_t)(INS_ALA << 4 | operation), OPERAND_NONE, 0 }; break;
+			case 2: case 3: slot = { (uint8_t)(INS_ALI << 4 | operation), OPERAND_BYTE, pick(256) }; break;
+			case 4: slot = { (uint8_t)(INS_ALS << 4 | operation), OPERAND_NONE, 0 }; break;
+			case 5: slot = source(); slot.opcode = INS_LOD << 4; break;
+			case 6: slot = { INS_LDI << 4, OPERAND_BYTE, pick(256) }; break;
+			case 7: slot = destination(stack); slot.opcode = INS_STO << 4; break;
+			case 8: slot = { INS_PSH << 4, OPERAND_NONE, 0 }; break;
+			default: slot = { INS_POP << 4, OPERAND_NONE, 0 }; break;
+			}
+			uint8_t instruction = slot.opcode >> 4;
+			bool usesStack = instruction == INS_ALS || instruction == INS_PSH || instruction == INS_POP;
+			bool usesAlu = instruction >= INS_ALM && instruction <= INS_ALS;
+			if (skipped >> instruction & 1 || (usesAlu && skipped >> (16 + operation) & 1) || (usesStack && !stack)) continue;
+			return slot;
+		}
+		return { INS_NOP << 4, OPERAND_NONE, 0 };
+	};
+
+	// BR and BN test a single flag, as the assembler writes them
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		uint32_t kind = pick(32);
+		uint8_t flag = 1 << pick(4);
+		if (kind == 0 && !(skipped >> INS_NOP & 1)) code.push_back({ INS_NOP << 4, OPERAND_NONE, 0 });
+		else if (kind < 3 && !(skipped >> INS_JMP & 1)) code.push_back({ INS_JMP << 4, OPERAND_CODE, i + 1 + pick(3) });
+		else if (kind < 5 && !(skipped >> INS_BR & 1)) code.push_back({ (uint8_t)(INS_BR << 4 | flag), OPERAND_CODE, i + 1 + pick(3) });
+		else if (kind < 7 && !(skipped >> INS_BN & 1)) code.push_back({ (uint8_t)(INS_BN << 4 | flag), OPERAND_CODE, i + 1 + pick(3) });
+		else if (kind < 9 && !(skipped >> INS_JSR & 1)) code.push_back({ INS_JSR << 4, OPERAND_SUBROUTINE, pick(numSubroutines) });
+		else code.push_back(simple(true));
+	}
+	code.push_back({ INS_HLT << 4, OPERAND_NONE, 0 });
+	vector<uint32_t> subroutines;
+	for (int i = 0; i < numSubroutines; ++i)
+	{
+		subroutines.push_back((uint32_t)code.size());
+		for (uint32_t length = pick(5); length > 0; --length) code.push_back(simple(false));
+		code.push_back({ INS_RSR << 4, OPERAND_NONE, 0 });
+	}
+
+	vector<uint32_t> addresses(code.size() + 1, 0);
+	for (size_t i = 0; i < code.size(); ++i) addresses[i + 1] = addresses[i] + instructionLengths[code[i].opcode >> 4];
+	uint32_t data = addresses.back();
+	vector<uint8_t> program;
+	for (const Slot& slot : code)
+	{
+		uint32_t operand = slot.operand;
+		if (slot.kind == OPERAND_DATA) operand = data + slot.operand;
+		else if (slot.kind == OPERAND_CODE) operand = addresses[min(slot.operand, (uint32_t)numInstructions)];
+		else if (slot.kind == OPERAND_SUBROUTINE) operand = addresses[subroutines[slot.operand]];
+		program.push_back(slot.opcode);
+		if (instructionLengths[slot.opcode >> 4] > 1) program.push_back((uint8_t)operand);
+		if (instructionLengths[slot.opcode >> 4] > 2) program.push_back((uint8_t)(operand >> 8));
+	}
+	for (int i = 0; i < dataSize; ++i) program.push_back((uint8_t)pick(256));
+	return program;
+}
+
+// the registers of the circuit, as the nodes that hold each bit of A, the flags and SP
+struct Registers
+{
+	enum { A = 0, FLAGS = 8, SP = 12, BITS = 20 };
+	uint32_t nodes[BITS];
+	bool inverted[BITS];
+	uint32_t fetch;		// IRI, high while the clock is high in the cycle that fetches an instruction
+	uint32_t ram;		// the device the program runs from
+
+	template <class Word>
+	uint8_t read(const Circuit<Word>& circuit, int first, int count, int lane) const
+	{
+		uint8_t value = 0;
+		for (int bit = 0; bit < count; ++bit) value |= (uint8_t)(((circuit.values[nodes[first + bit]] >> lane & 1) ^ inverted[first + bit]) << bit);
+		return value;
+	}
+};
+
+// starts the program in the ROM of each lane, letting HRD RST copy programSize bytes of it into RAM first
+template <class Word>
+void start(Circuit<Word>& circuit, size_t programSize)
+{
+	circuit.powerOn();
+	circuit.press(circuit.netlist.hardReset, resetCycles);
+	for (size_t i = 0; i < programSize; ++i) circuit.cycle();
+	circuit.press(circuit.netlist.softReset, resetCycles);
+}
+
+// the circuit doesn't say which of its latches are the registers, so they are found by running a program that changes
+// them in lane 0 next to the instruction set model, and keeping the nodes that match a bit (or its inverse) after
+// every instruction; the program only uses instructions the circuit is known to get right
+bool findRegisters(Circuit<uint64_t>& circuit, Registers& registers)
+{
+	registers.fetch = circuit.netlist.signal("IRI");
+	registers.ram = UINT32_MAX;
+	for (uint32_t i = 0; i < circuit.netlist.devices.size(); ++i)
+		if (circuit.netlist.devices[i].type == DEVICE_RAM) registers.ram = i;
+	if (registers.fetch == UINT32_MAX || registers.ram == UINT32_MAX)
+	{
+		cerr << "ERROR: the circuit has no " << (registers.ram == UINT32_MAX ? "RAM" : "IRI signal") << " to check against!\n";
+		return false;
+	}
+
+	// LDI, ALI, LOD and STO with random values and addresses, POP and ALS walking SP around the stack page, and JSR to
+	// RSRs at random addresses, so the buses carry all sorts of values; the 1000 instructions take up to 3000 bytes, and
+	// the subroutines go past 0x1000 so HRD RST copies the byte at 0x07ff
+	const uint16_t data = 0x0f00, subroutines = 0x1000;
+	const uint8_t operations[] = { ALU_ADD, ALU_ADC, ALU_SUB, ALU_SBB, ALU_ONC, ALU_TWC, ALU_OR };
+	mt19937_64 random(1);
+	vector<uint8_t> program;
+	for (int i = 0; i < 1000; ++i)
+	{
+		uint16_t address = data | (uint8_t)random(), subroutine = subroutines | (uint8_t)random();
+		switch (random() % 10)
+		{
+		case 0: case 1: program.insert(program.end(), { INS_LDI << 4, (uint8_t)random() }); break;
+		case 2: case 3: program.insert(program.end(), { (uint8_t)(INS_ALI << 4 | operations[random() % 7]), (uint8_t)random() }); break;
+		case 4: program.push_back(INS_POP << 4); break;
+		case 5: case 6: program.push_back((uint8_t)(INS_ALS << 4 | operations[random() % 7])); break;
+		case 7: program.insert(program.end(), { INS_LOD << 4, (uint8_t)address, (uint8_t)(address >> 8) }); break;
+		case 8: program.insert(program.end(), { INS_STO << 4, (uint8_t)address, (uint8_t)(address >> 8) }); break;
+		default: program.insert(program.end(), { INS_JSR << 4, (uint8_t)subroutine, (uint8_t)(subroutine >> 8) }); break;
+		}
+	}
+	program.push_back(INS_HLT << 4);
+	program.resize(data);
+	for (int i = 0; i < 256; ++i) program.push_back((uint8_t)random());
+	program.resize(subroutines + 0x100, INS_RSR << 4);
+	for (int lane = 0; lane < Circuit<uint64_t>::lanes; ++lane) circuit.load(lane, program);
+	Machine machine;
+	machine.load(program);
+	start(circuit, program.size());
+
+	// each node can still be a bit (1) or its inverse (2); the first few instructions are left out, since the
+	// registers are all 0 until then
+	vector<uint8_t> candidates((size_t)circuit.netlist.numNodes * Registers::BITS, 3);
+	uint64_t begin = circuit.cycles;
+	for (int instruction = 0; !machine.halted; ++instruction)
+	{
+		machine.step();
+		while (circuit.cycles - begin < machine.cycles) circuit.cycle();
+		if (instruction < 4 || machine.halted) continue;
+		uint32_t state = machine.a | machine.flags << Registers::FLAGS | machine.sp << Registers::SP;
+		for (uint32_t node = 0; node < circuit.netlist.numNodes; ++node)
+		{
+			uint32_t value = circuit.values[node] & 1 ? (1u << Registers::BITS) - 1 : 0;
+			uint8_t* candidate = &candidates[(size_t)node * Registers::BITS];
+			for (int bit = 0; bit < Registers::BITS; ++bit) candidate[bit] &= (value ^ state) >> bit & 1 ? 2 : 1;
+		}
+	}
+
+	static const char* registerNames[] = { "A", "the flags", "SP" };
+	for (int bit = 0; bit < Registers::BITS; ++bit)
+	{
+		registers.nodes[bit] = UINT32_MAX;
+		for (int match = 1; match <= 2 && registers.nodes[bit] == UINT32_MAX; ++match)
+			for (uint32_t node = 0; node < circuit.netlist.numNodes; ++node)
+				if (candidates[(size_t)node * Registers::BITS + bit] & match)
+				{
+					registers.nodes[bit] = node;
+					registers.inverted[bit] = match == 2;
+					break;
+				}
+		if (registers.nodes[bit] == UINT32_MAX)
+		{
+			int which = bit < Registers::FLAGS ? 0 : bit < Registers::SP ? 1 : 2;
+			int first = which == 0 ? Registers::A : which == 1 ? Registers::FLAGS : Registers::SP;
+			cerr << "ERROR: could not find bit " << bit - first << " of " << registerNames[which] << " in the circuit!\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// an instruction that has been run, kept to show what led up to a difference
+struct Retired
+{
+	uint16_t address;
+	uint8_t bytes[3];
+};
+
+// runs the programs on the circuit and the instruction set model side by side, a lane each, and compares A, the flags,
+// SP, the memory stored to and the text display after every instruction, and that the circuit fetches each instruction
+// from the right address in the cycle the model says it should; prints the first difference and returns false
+bool checkPrograms(Circuit<uint64_t>& circuit, const Registers& registers, const vector<vector<uint8_t>>& programs,
+	const vector<string>& names, uint64_t maxCycles, bool warn, uint64_t& instructions)
+{
+	typedef Circuit<uint64_t> LaneCircuit;
+	const int numLanes = (int)programs.size(), numRecent = 8;
+	vector<Machine> machines(numLanes);
+	vector<vector<Retired>> recent(numLanes);
+	size_t programSize = 0;
+	for (int lane = 0; lane < numLanes; ++lane)
+	{
+		circuit.load(lane, programs[lane]);
+		machines[lane].load(programs[lane]);
+		programSize = max(programSize, circuit.programSize(lane));
+	}
+	start(circuit, programSize);
+	circuit.logStores = true;
+	for (auto& stores : circuit.stores) stores.clear();
+
+	// HRD RST has to leave the RAM holding the program, and nothing else
+	size_t ramSize = min(circuit.netlist.devices[registers.ram].memory.size(), (size_t)memorySize);
+	for (int lane = 0; lane < numLanes; ++lane)
+	{
+		const uint8_t* ram = circuit.memory(registers.ram, lane);
+		if (equal(ram, ram + ramSize, machines[lane].memory.begin())) continue;
+		printf("%s differs after HRD RST copied it into RAM:\n", names[lane].c_str());
+		for (uint32_t address = 0, shown = 0; address < ramSize && shown < 8; ++address)
+			if (ram[address] != machines[lane].memory[address])
+			{
+				printf("    [%04x]  gate 0x%02x  isa 0x%02x\n", address, ram[address], machines[lane].memory[address]);
+				++shown;
+			}
+		fflush(stdout);
+		return false;
+	}
+
+	uint64_t checking = numLanes == LaneCircuit::lanes ? LaneCircuit::one : ((uint64_t)1 << numLanes) - 1;
+	vector<vector<string>> differences(numLanes);
+	for (uint64_t cycle = 0; checking && cycle < maxCycles; ++cycle)
+	{
+		// each lane that starts an instruction in this cycle has just finished the last one
+		uint64_t starting = 0;
+		for (uint64_t lanes = checking; lanes; lanes &= lanes - 1)
+		{
+			int lane = lowestBit(lanes);
+			if (machines[lane].cycles != cycle) continue;
+			starting |= (uint64_t)1 << lane;
+			Machine& machine = machines[lane];
+			vector<string>& found = differences[lane];
+			char text[128];
+			uint8_t a = registers.read(circuit, Registers::A, 8, lane), flags = registers.read(circuit, Registers::FLAGS, 4, lane);
+			uint8_t sp = registers.read(circuit, Registers::SP, 8, lane);
+			if (cycle == 0)
+			{
+				// SFT RST doesn't clear A, so the model starts from whatever the registers were left at
+				if (warn && (a || flags || sp))
+				{
+					fprintf(stderr, "WARNING: %s starts with A 0x%02x, flags %s and SP 0x%02x rather than 0\n", names[lane].c_str(), a, flagLetters(flags).c_str(), sp);
+					warn = false;
+				}
+				machine.a = a;
+				machine.flags = flags;
+				machine.sp = sp;
+			}
+			if (a != machine.a)
+			{
+				snprintf(text, sizeof(text), "A       gate 0x%02x  isa 0x%02x", a, machine.a);
+				found.push_back(text);
+			}
+			if (flags != machine.flags) found.push_back("flags   gate " + flagLetters(flags) + "  isa " + flagLetters(machine.flags));
+			if (sp != machine.sp)
+			{
+				snprintf(text, sizeof(text), "SP      gate 0x%02x  isa 0x%02x", sp, machine.sp);
+				found.push_back(text);
+			}
+
+			// only what either of them stored to can differ, the text display is compared by what it printed
+			vector<uint16_t>& stores = circuit.stores[lane];
+			stores.insert(stores.end(), machine.stores.begin(), machine.stores.end());
+			sort(stores.begin(), stores.end());
+			stores.erase(unique(stores.begin(), stores.end()), stores.end());
+			const uint8_t* ram = circuit.memory(registers.ram, lane);
+			for (uint16_t address : stores)
+				if (address != consoleAddress && ram[address] != machine.memory[address])
+				{
+					snprintf(text, sizeof(text), "[%04x]  gate 0x%02x  isa 0x%02x", address, ram[address], machine.memory[address]);
+					found.push_back(text);
+				}
+			stores.clear();
+			machine.stores.clear();
+			if (circuit.console[lane] != machine.console) found.push_back("display gate " + quoted(circuit.console[lane]) + "  isa " + quoted(machine.console));
+		}
+
+		circuit.halfCycle(LaneCircuit::one);
+		for (uint64_t lanes = starting; lanes; lanes &= lanes - 1)
+		{
+			int lane = lowestBit(lanes);
+			uint16_t address = (uint16_t)circuit.word(circuit.netlist.devices[registers.ram].address, lane);
+			char text[128];
+			if (machines[lane].halted) continue;	// HLT has stopped the clock, there is nothing more to fetch
+			if (!(circuit.values[registers.fetch] >> lane & 1))
+			{
+				snprintf(text, sizeof(text), "PC      gate not fetching  isa 0x%04x", machines[lane].pc);
+				differences[lane].push_back(text);
+			}
+			else if (address != machines[lane].pc)
+			{
+				snprintf(text, sizeof(text), "PC      gate 0x%04x  isa 0x%04x", address, machines[lane].pc);
+				differences[lane].push_back(text);
+			}
+		}
+		circuit.halfCycle(0);
+		++circuit.cycles;
+
+		for (uint64_t lanes = starting; lanes; lanes &= lanes - 1)
+		{
+			int lane = lowestBit(lanes);
+			Machine& machine = machines[lane];
+			if (!differences[lane].empty())
+			{
+				// the instruction that went wrong is the last one run, the next one is where the circuit went instead
+				printf("%s differs after %llu instructions, %llu cycles:\n", names[lane].c_str(), (unsigned long long)machine.instructions, (unsigned long long)cycle);
+				for (const Retired& retired : recent[lane]) printf("  %04x  %s\n", retired.address, disassemble(retired.bytes).c_str());
+				for (const string& difference : differences[lane]) printf("    %s\n", difference.c_str());
+				fflush(stdout);
+				return false;
+			}
+			if (machine.halted)
+			{
+				checking &= ~((uint64_t)1 << lane);
+				continue;
+			}
+			Retired retired = { machine.pc, { machine.memory[machine.pc], machine.memory[(uint16_t)(machine.pc + 1)], machine.memory[(uint16_t)(machine.pc + 2)] } };
+			if ((int)recent[lane].size() == numRecent) recent[lane].erase(recent[lane].begin());
+			recent[lane].push_back(retired);
+			machine.step();
+			++instructions;
+		}
+	}
+	for (int lane = 0; lane < numLanes; ++lane)
+		if (checking >> lane & 1) printf("%s: cycle limit reached after %llu instructions\n", names[lane].c_str(), (unsigned long long)machines[lane].instructions);
+	return true;
+}
+
+// turns a list of instructions and ALU operations like "PSH,BR,AND" into bits, an instruction's by its high nibble and
+// an ALU operation's 16 above that
+bool parseSkipped(const string& list, uint32_t& skipped)
+{
+	size_t begin = 0;
+	while (begin <= list.size())
+	{
+		size_t end = min(list.find(',', begin), list.size());
+		string name = list.substr(begin, end - begin);
+		for (char& c : name) c = toupper((unsigned char)c);
+		int bit = -1;
+		for (int i = 0; i < 16; ++i)
+		{
+			if (name == instructionNames[i]) bit = i;
+			if (name == aluNames[i]) bit = 16 + i;
+		}
+		if (bit < 0)
+		{
+			cerr << "ERROR: " << name << " is not an instruction or ALU operation!\n";
+			return false;
+		}
+		skipped |= 1u << bit;
+		begin = end + 1;
+	}
+	return true;
+}
+
+// checks the circuit against the instruction set, running the programs or numRandom random ones 64 at a time; returns
+// the exit code
+int check(const string& circuitFile, const vector<string>& inputs, uint64_t numRandom, uint64_t seed, uint32_t skipped, uint64_t maxCycles, bool quiet)
+{
+	typedef Circuit<uint64_t> LaneCircuit;
+	unique_ptr<LaneCircuit> circuit(new LaneCircuit);
+	Registers registers;
+	if (!circuit->build(circuitFile) || !findRegisters(*circuit, registers)) return 1;
+
+	// without any programs, the one saved in the ROM of the circuit is checked
+	vector<uint8_t> program;
+	if (inputs.empty() && !numRandom)
+		for (const Device& device : circuit->netlist.devices)
+			if (device.type == DEVICE_ROM) program = device.memory;
+	uint64_t total = numRandom ? numRandom : max(inputs.size(), (size_t)1), instructions = 0;
+	auto begin = chrono::steady_clock::now();
+	for (uint64_t first = 0; first < total; first += LaneCircuit::lanes)
+	{
+		vector<vector<uint8_t>> programs;
+		vector<string> names;
+		for (uint64_t i = first; i < min(total, first + LaneCircuit::lanes); ++i)
+		{
+			if (numRandom)
+			{
+				programs.push_back(randomProgram(seed + i, skipped));
+				names.push_back("random program " + to_string(i) + " (--seed=" + to_string(seed + i) + ")");
+				continue;
+			}
+			if (!inputs.empty() && !loadProgram(inputs[i], program)) return 1;
+			programs.push_back(program);
+			names.push_back(inputs.empty() ? circuitFile : inputs[i]);
+		}
+		if (!checkPrograms(*circuit, registers, programs, names, maxCycles, !quiet && first == 0, instructions)) return 1;
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+	if (!quiet)
+	{
+		fprintf(stderr, "%llu program%s, %llu instructions the same on the circuit and the instruction set, %.3f s, %.2f million instructions a minute\n",
+			(unsigned long long)total, total == 1 ? "" : "s", (unsigned long long)instructions, seconds, instructions / seconds * 60 / 1e6);
+	}
+	if (!quiet && circuit->oscillations) fprintf(stderr, "WARNING: the circuit oscillated %llu times\n", (unsigned long long)circuit->oscillations);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	string circuitFile = "Chameleon CPU.circ", emitFile;
+	vector<string> inputs;
+	uint64_t maxCycles = 10000000;
+	int64_t loadCycles = -1;
+	int numLanes = 0;
+	bool quiet = false, statistics = false, checking = false;
+	uint64_t numRandom = 0, seed = 1;
+	uint32_t skipped = 0;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "-q") quiet = true;
+		else if (arg == "--stats") statistics = true;
+		else if (arg == "--check") checking = true;
+		else if (arg.compare(0, 9, "--random=") == 0) numRandom = strtoull(arg.c_str() + 9, nullptr, 0);
+		else if (arg.compare(0, 7, "--seed=") == 0) seed = strtoull(arg.c_str() + 7, nullptr, 0);
+		else if (arg.compare(0, 7, "--skip=") == 0)
+		{
+			if (!parseSkipped(arg.substr(7), skipped)) return 2;
+		}
+		else if (arg.compare(0, 7, "--circ=") == 0) circuitFile = arg.substr(7);
+		else if (arg.compare(0, 7, "--emit=") == 0) emitFile = arg.substr(7);
+		else if (arg.compare(0, 7, "--load=") == 0) loadCycles = strtoll(arg.c_str() + 7, nullptr, 0);
+		else if (arg.compare(0, 8, "--lanes=") == 0)
+		{
+			numLanes = atoi(arg.c_str() + 8);
+			if (numLanes < 1 || numLanes > 64)
+			{
+				cerr << "ERROR: the number of lanes has to be from 1 to 64!\n";
+				return 2;
+			}
+		}
+		else if (arg.compare(0, 9, "--cycles=") == 0)
+		{
+			maxCycles = strtoull(arg.c_str() + 9, nullptr, 0);
+			if (maxCycles == 0) maxCycles = UINT64_MAX;
+		}
+		else if (arg == "-h" || arg == "--help")
+		{
+			printUsage();
+			return 0;
+		}
+		else if (arg[0] == '-')
+		{
+			cerr << "ERROR: unexpected argument " << arg << "!\n";
+			printUsage();
+			return 2;
+		}
+		else inputs.push_back(arg);
+	}
+	if (checking || numRandom) return check(circuitFile, inputs, numRandom, seed, skipped, maxCycles, quiet);
+	if (numLanes == 0) numLanes = max((int)inputs.size(), 1);
+	if ((int)inputs.size() > numLanes)
+	{
+		cerr << "ERROR: there are more programs than lanes!\n";
+		return 2;
+	}
+
+	// a single CPU is run a byte a node, any more a bit of a 64 bit word each
+	if (numLanes == 1) return run<uint8_t>(circuitFile, inputs, numLanes, emitFile, maxCycles, loadCycles, quiet, statistics);
+	return run<uint64_t>(circuitFile, inputs, numLanes, emitFile, maxCycles, loadCycles, quiet, statistics);
+}
\ No newline at end of file